@@ -1,9 +1,14 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "gost.h"
+#include "gostsmall.h"
 
 static void fill_buffer(word32 *data, size_t blocks)
 {
@@ -84,13 +89,1511 @@ static void run_benchmark(size_t blocks_per_batch, size_t iterations)
         free(buffer);
 }
 
+static double now_seconds(void)
+{
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+                perror("clock_gettime");
+                exit(EXIT_FAILURE);
+        }
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Key words from 32 bytes, little-endian as the rest of the standard */
+static void load_key(unsigned char const bytes[32], word32 key[8])
+{
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)bytes[i * 4] |
+                         (word32)bytes[i * 4 + 1] << 8 |
+                         (word32)bytes[i * 4 + 2] << 16 |
+                         (word32)bytes[i * 4 + 3] << 24;
+}
+
+/*
+ * Multi-tenant traffic: every message is encrypted under a key drawn
+ * at random from a pool, as a server juggling many sessions would.
+ * Against a single key this shows the price of setting a key up, of
+ * key material falling out of cache once the pool outgrows it, and of
+ * the table tier competing with that key material.
+ */
+static void run_key_benchmark(size_t message_bytes, size_t pool_size,
+                              size_t messages)
+{
+        static int const tiers[] = { GOST_TIER_WORD, GOST_TIER_BYTE };
+        static char const *const tier_names[] = { "word tables", "byte tables" };
+        size_t blocks = (message_bytes + 7) / 8;
+        size_t setups = 100000;
+        unsigned char *key_bytes;
+        word32 (*keys)[8];
+        word32 *buffer;
+        word32 iv[2] = { 0x12345678, 0x9abcdef0 };
+        double start, seconds;
+
+        key_bytes = malloc(pool_size * 32);
+        keys = malloc(pool_size * sizeof(*keys));
+        buffer = calloc(blocks * 2, sizeof(word32));
+        if (!key_bytes || !keys || !buffer) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        fill_buffer(buffer, blocks);
+        {
+                unsigned long seed = 0x2545f491UL;
+                for (size_t i = 0; i < pool_size * 32; i++) {
+                        seed = seed * 1664525UL + 1013904223UL;
+                        key_bytes[i] = (unsigned char)(seed >> 24);
+                }
+        }
+
+        printf("Key agility: %zu-byte messages, %zu keys in the pool, %zu messages.\n",
+               blocks * 8, pool_size, messages);
+
+        /* The setup a new key or parameter set costs */
+        start = now_seconds();
+        for (size_t i = 0; i < setups; i++)
+                load_key(&key_bytes[(i % pool_size) * 32], keys[i % pool_size]);
+        seconds = now_seconds() - start;
+        printf("  Key load         : %.1f ns\n", seconds / setups * 1e9);
+
+        start = now_seconds();
+        for (size_t i = 0; i < 1000; i++)
+                gostsboxinit(gost_sbox_des);
+        seconds = now_seconds() - start;
+        printf("  Table build      : %.1f ns\n", seconds / 1000 * 1e9);
+
+        for (size_t i = 0; i < pool_size; i++)
+                load_key(&key_bytes[i * 32], keys[i]);
+
+        for (size_t t = 0; t < sizeof(tiers) / sizeof(tiers[0]); t++) {
+                struct gost_choice c;
+
+                gostgetchoice(GOST_OP_GAMMA, &c);
+                c.tier = tiers[t];
+                gostsetchoice(GOST_OP_GAMMA, &c);
+
+                for (int pooled = 0; pooled < 2; pooled++) {
+                        unsigned long seed = 0x1db71064UL;
+                        size_t k = 0;
+
+                        start = now_seconds();
+                        for (size_t m = 0; m < messages; m++) {
+                                if (pooled) {
+                                        seed = seed * 1664525UL + 1013904223UL;
+                                        k = (seed >> 8) % pool_size;
+                                }
+                                gostgamma(buffer, buffer, blocks, iv, 0, keys[k]);
+                        }
+                        seconds = now_seconds() - start;
+
+                        printf("  %s, %-11s: %8.1f ns/message  %8.2f MiB/s\n",
+                               tier_names[t], pooled ? "key pool" : "one key",
+                               seconds / messages * 1e9,
+                               (double)messages * blocks * 8 /
+                               (1024.0 * 1024.0) / seconds);
+                }
+        }
+
+        free(buffer);
+        free(keys);
+        free(key_bytes);
+}
+
+/*
+ * Roofline: how close each bulk cipher path comes to the memory bound.
+ *
+ * For each size and thread count we first measure STREAM-style copy
+ * and triad bandwidth and memcpy, then the cipher paths on buffers of
+ * the same size split the same way.  Bandwidth counts every byte read
+ * and written, as STREAM does, so a cipher that reads and writes n
+ * bytes moves 2n; the MAC only reads.  The fraction is the cipher's
+ * memory traffic over copy bandwidth: near 1 it is memory bound and
+ * faster kernels will not help, far below it the kernels are the limit.
+ */
+enum stream_op { STREAM_COPY, STREAM_TRIAD, STREAM_MEMCPY, STREAM_ECB,
+                 STREAM_GAMMA, STREAM_CFBDEC, STREAM_MAC, STREAM_NOPS };
+
+static char const *const stream_names[STREAM_NOPS] = {
+        "copy", "triad", "memcpy", "ecb", "gamma", "cfbdec", "mac"
+};
+
+/* Bytes moved per byte of buffer, as STREAM counts them */
+static int const stream_traffic[STREAM_NOPS] = { 2, 3, 2, 2, 2, 2, 1 };
+
+struct stream_job {
+        double *a, *b, *c;
+        size_t n;               /* doubles per array */
+        size_t parts;
+};
+
+static void stream_part(void *arg, size_t part)
+{
+        struct stream_job *j = arg;
+        size_t lo = j->n * part / j->parts, hi = j->n * (part + 1) / j->parts;
+        double const s = 3.0;
+
+        if (j->c) {
+                for (size_t i = lo; i < hi; i++)
+                        j->a[i] = j->b[i] + s * j->c[i];
+        } else if (j->b) {
+                for (size_t i = lo; i < hi; i++)
+                        j->a[i] = j->b[i];
+        } else {
+                memcpy(&j->a[lo], &j->a[j->n + lo], (hi - lo) * sizeof(double));
+        }
+}
+
+/* Best time of at least three runs, and of at least 0.2 s of runs */
+static double run_stream_op(int op, double *a, double *b, double *c,
+                            size_t bytes, size_t threads)
+{
+        struct stream_job j;
+        word32 key[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+        word32 iv[2] = { 0, 0 };
+        word32 mac[2];
+        size_t blocks = bytes / 8;
+        double best = 1e9, total = 0;
+
+        j.a = a;
+        j.b = op == STREAM_MEMCPY ? NULL : b;
+        j.c = op == STREAM_TRIAD ? c : NULL;
+        j.n = bytes / sizeof(double);
+        j.parts = threads;
+
+        for (size_t r = 0; r < 3 || total < 0.2; r++) {
+                double start = now_seconds(), t;
+
+                switch (op) {
+                case STREAM_COPY:
+                case STREAM_TRIAD:
+                case STREAM_MEMCPY:
+                        gostparallel(stream_part, &j, threads);
+                        break;
+                case STREAM_ECB:
+                        gostecb((word32 *)b, (word32 *)a, blocks, key);
+                        break;
+                case STREAM_GAMMA:
+                        gostgamma((word32 *)b, (word32 *)a, blocks, iv, 0, key);
+                        break;
+                case STREAM_CFBDEC:
+                        gostcfbdec((word32 *)b, (word32 *)a, blocks, iv, key);
+                        break;
+                case STREAM_MAC:
+                        gostmac((word32 *)b, (int)blocks, mac, key);
+                        break;
+                }
+                t = now_seconds() - start;
+                total += t;
+                if (t < best)
+                        best = t;
+        }
+        return best;
+}
+
+static void run_roofline(size_t max_bytes, size_t max_threads)
+{
+        struct gost_tunables saved, t;
+        double *a, *b, *c;
+
+        /* memcpy copies from the second half of a */
+        a = malloc(max_bytes * 2);
+        b = malloc(max_bytes);
+        c = malloc(max_bytes);
+        if (!a || !b || !c) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        memset(a, 1, max_bytes * 2);
+        memset(b, 2, max_bytes);
+        memset(c, 3, max_bytes);
+
+        gostgettunables(&saved);
+        printf("%10s %7s %-7s %12s %9s\n",
+               "bytes", "threads", "path", "MiB/s", "of copy");
+
+        for (size_t bytes = 32 * 1024; bytes <= max_bytes; bytes *= 8) {
+                for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+                        double copy = 0;
+
+                        /* Split every path the way the copy is split */
+                        t = saved;
+                        t.threads = (int)threads;
+                        t.grain = bytes / 8 / threads;
+                        if (t.grain < 1)
+                                t.grain = 1;
+                        t.threadmin = threads > 1 ? 2 : (size_t)-1;
+                        gostsettunables(&t);
+
+                        for (int op = 0; op < STREAM_NOPS; op++) {
+                                double secs, bw, rate;
+
+                                /* The MAC is one chain; only one thread can run it */
+                                if (op == STREAM_MAC && threads > 1)
+                                        continue;
+                                secs = run_stream_op(op, a, b, c, bytes, threads);
+                                rate = bytes / secs / (1024.0 * 1024.0);
+                                bw = rate * stream_traffic[op];
+                                if (op == STREAM_COPY)
+                                        copy = bw;
+                                printf("%10zu %7zu %-7s %12.1f %8.1f%%\n",
+                                       bytes, threads, stream_names[op], rate,
+                                       100.0 * bw / copy);
+                        }
+                }
+        }
+
+        gostsettunables(&saved);
+        free(a);
+        free(b);
+        free(c);
+}
+
+/*
+ * Trace replay.  Each record of the trace is one request:
+ *
+ *      op,mode,size,key,gap_us                 (CSV; a header line is skipped)
+ *      {"op":"encrypt","mode":"gamma","size":4096,"key":7,"gap_us":35}
+ *                                              (JSON, one object per line)
+ *
+ * op is encrypt, decrypt or mac; mode is ecb, gamma, ofb, cfb or mac;
+ * size is in bytes and rounded up to whole blocks; key picks one of a
+ * pool of keys; gap_us is the time since the previous request arrived.
+ *
+ * Closed loop, the threads take requests back to back and latency is
+ * service time.  Open loop, each request is issued at its arrival time
+ * (the trace's gaps divided by the rate) and latency runs from then, so
+ * queueing behind slow requests counts as it would in production.
+ */
+enum { REPLAY_ENCRYPT, REPLAY_DECRYPT, REPLAY_MAC };
+enum { REPLAY_ECB, REPLAY_GAMMA, REPLAY_OFB, REPLAY_CFB, REPLAY_MODE_MAC };
+
+struct request {
+        int op;
+        int mode;
+        size_t blocks;
+        size_t key;             /* As in the trace, then an index into the keys */
+        double arrival;         /* Seconds from the start of the trace */
+        double latency;
+};
+
+static int lookup(char const *name, char const *const *names, int n)
+{
+        for (int i = 0; i < n; i++)
+                if (strcmp(name, names[i]) == 0)
+                        return i;
+        return -1;
+}
+
+static char const *const replay_ops[] = { "encrypt", "decrypt", "mac" };
+static char const *const replay_modes[] = { "ecb", "gamma", "ofb", "cfb", "mac" };
+
+/* The value after "name": in a flat JSON object, without quotes */
+static int json_field(char const *line, char const *name, char *out, size_t size)
+{
+        char key[32];
+        char const *p;
+        size_t n = 0;
+
+        snprintf(key, sizeof(key), "\"%s\"", name);
+        p = strstr(line, key);
+        if (!p)
+                return -1;
+        p += strlen(key);
+        while (*p == ' ' || *p == ':' || *p == '"')
+                p++;
+        while (*p && *p != '"' && *p != ',' && *p != '}' && n + 1 < size)
+                out[n++] = *p++;
+        out[n] = '\0';
+        return 0;
+}
+
+static int parse_request(char *line, struct request *r)
+{
+        char op[16], mode[16], size[32], key[32], gap[32];
+
+        if (line[0] == '{') {
+                if (json_field(line, "op", op, sizeof(op)) ||
+                    json_field(line, "mode", mode, sizeof(mode)) ||
+                    json_field(line, "size", size, sizeof(size)) ||
+                    json_field(line, "key", key, sizeof(key)) ||
+                    json_field(line, "gap_us", gap, sizeof(gap)))
+                        return -1;
+        } else if (sscanf(line, " %15[^, ] , %15[^, ] , %31[^, ] , %31[^, ] , %31s",
+                          op, mode, size, key, gap) != 5) {
+                return -1;
+        }
+
+        r->op = lookup(op, replay_ops, 3);
+        r->mode = lookup(mode, replay_modes, 5);
+        if (r->op < 0 || r->mode < 0)
+                return -1;
+        r->blocks = ((size_t)strtoul(size, NULL, 0) + 7) / 8;
+        r->key = (size_t)strtoul(key, NULL, 0);
+        r->arrival = strtod(gap, NULL) / 1e6;   /* A gap until summed */
+        return 0;
+}
+
+static struct request *load_trace(char const *path, size_t *count)
+{
+        FILE *fp = fopen(path, "r");
+        struct request *reqs = NULL;
+        size_t n = 0, cap = 0, lineno = 0;
+        double t = 0;
+        char line[512];
+
+        if (!fp) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        while (fgets(line, sizeof(line), fp)) {
+                struct request r;
+
+                lineno++;
+                if (line[0] == '\n' || line[0] == '#')
+                        continue;
+                if (parse_request(line, &r) != 0) {
+                        if (lineno == 1)
+                                continue;       /* CSV header */
+                        fprintf(stderr, "%s:%zu: bad record\n", path, lineno);
+                        exit(EXIT_FAILURE);
+                }
+                t += r.arrival;
+                r.arrival = t;
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 1024;
+                        reqs = realloc(reqs, cap * sizeof(*reqs));
+                        if (!reqs) {
+                                fprintf(stderr, "Failed to allocate trace\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                reqs[n++] = r;
+        }
+        fclose(fp);
+        *count = n;
+        return reqs;
+}
+
+struct replay {
+        struct request *reqs;
+        size_t count;
+        atomic_size_t next;
+        word32 (*keys)[8];
+        size_t max_blocks;
+        double rate;            /* 0 for closed loop */
+        double start;
+};
+
+static void serve(struct request const *r, word32 *buf, word32 const key[8])
+{
+        word32 iv[2] = { 0x12345678, 0x9abcdef0 };
+        word32 mac[2];
+        size_t i;
+
+        if (r->op == REPLAY_MAC || r->mode == REPLAY_MODE_MAC) {
+                gostmac(buf, (int)r->blocks, mac, key);
+                return;
+        }
+        switch (r->mode) {
+        case REPLAY_ECB:
+                if (r->op == REPLAY_ENCRYPT)
+                        gostecb(buf, buf, r->blocks, key);
+                else
+                        for (i = 0; i < r->blocks; i++)
+                                gostdecrypt(&buf[i * 2], &buf[i * 2], key);
+                break;
+        case REPLAY_GAMMA:
+                gostgamma(buf, buf, r->blocks, iv, 0, key);
+                break;
+        case REPLAY_OFB:
+                gostofb(buf, buf, (int)r->blocks, iv, key);
+                break;
+        case REPLAY_CFB:
+                if (r->op == REPLAY_ENCRYPT)
+                        gostcfbencrypt(buf, buf, (int)r->blocks, iv, key);
+                else
+                        gostcfbdec(buf, buf, r->blocks, iv, key);
+                break;
+        }
+}
+
+static void *replay_thread(void *arg)
+{
+        struct replay *rp = arg;
+        word32 *buf = calloc(rp->max_blocks * 2 + 2, sizeof(word32));
+        size_t i;
+
+        if (!buf) {
+                fprintf(stderr, "Failed to allocate buffer\n");
+                exit(EXIT_FAILURE);
+        }
+        while ((i = atomic_fetch_add(&rp->next, 1)) < rp->count) {
+                struct request *r = &rp->reqs[i];
+                double issued = now_seconds();
+
+                if (rp->rate > 0) {
+                        double due = rp->start + r->arrival / rp->rate;
+
+                        /* Sleep most of the way, then spin for precision */
+                        if (due - issued > 200e-6) {
+                                double wait = due - issued - 100e-6;
+                                struct timespec ts;
+
+                                ts.tv_sec = (time_t)wait;
+                                ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+                                nanosleep(&ts, NULL);
+                        }
+                        while ((issued = now_seconds()) < due)
+                                ;
+                        issued = due;
+                }
+                serve(r, buf, rp->keys[r->key]);
+                r->latency = now_seconds() - issued;
+        }
+        free(buf);
+        return NULL;
+}
+
+static int compare_double(void const *a, void const *b)
+{
+        double x = *(double const *)a, y = *(double const *)b;
+
+        return (x > y) - (x < y);
+}
+
+static int compare_size(void const *a, void const *b)
+{
+        size_t x = *(size_t const *)a, y = *(size_t const *)b;
+
+        return (x > y) - (x < y);
+}
+
+/*
+ * The distinct key ids of a trace, sorted, with each request's id
+ * replaced by its place among them, so that the ids can be anything
+ * and the table holds only the keys the trace uses.
+ */
+static size_t *dense_keys(struct request *reqs, size_t count, size_t *nkeys)
+{
+        size_t *ids = malloc(count * sizeof(*ids));
+        size_t n = 0;
+
+        if (!ids) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < count; i++)
+                ids[i] = reqs[i].key;
+        qsort(ids, count, sizeof(*ids), compare_size);
+        for (size_t i = 0; i < count; i++)
+                if (n == 0 || ids[i] != ids[n - 1])
+                        ids[n++] = ids[i];
+        for (size_t i = 0; i < count; i++) {
+                size_t const *k = bsearch(&reqs[i].key, ids, n, sizeof(*ids),
+                                          compare_size);
+
+                reqs[i].key = (size_t)(k - ids);
+        }
+        *nkeys = n;
+        return ids;
+}
+
+/*
+ * Cold start.  An autoscaled worker's first request pays for building
+ * the tables, faulting in their pages and code, and missing cache on
+ * all of it.  Two measurements:
+ *
+ * From process start: the benchmark re-executes itself, and the child
+ * reports how long after the exec it was ready (tables built, and
+ * prewarmed if asked) and how long its first request then took.
+ *
+ * After a cache flush: in one process, the tables, key and buffer are
+ * flushed with clflush and one request timed; then the same after
+ * gostprewarm(), and with everything already hot.
+ */
+static void flush_range(void const *p, size_t n)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+        for (size_t i = 0; i < n; i += 64)
+                __builtin_ia32_clflush((char const *)p + i);
+        __builtin_ia32_mfence();
+#else
+        (void)p;
+        (void)n;
+#endif
+}
+
+static int run_coldstart_child(char **argv)
+{
+        double t0 = strtod(argv[2], NULL);
+        int prewarm = atoi(argv[3]);
+        size_t blocks = (size_t)strtoul(argv[4], NULL, 0);
+        word32 key[8], iv[2] = { 1, 2 };
+        word32 *buf = calloc(blocks * 2, sizeof(word32));
+        double ready, done;
+
+        if (!buf)
+                return EXIT_FAILURE;
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+
+        kboxinit();
+        if (prewarm)
+                gostprewarm(key);
+        ready = now_seconds();
+        gostgamma(buf, buf, blocks, iv, 0, key);
+        done = now_seconds();
+
+        printf("%.9f %.9f\n", ready - t0, done - ready);
+        free(buf);
+        return 0;
+}
+
+static void child_times(char const *self, int prewarm, size_t blocks,
+                        double *ready, double *first)
+{
+        char t0[64], pw[8], nb[32], out[128];
+        int fds[2];
+        pid_t pid;
+        ssize_t n;
+
+        if (pipe(fds) != 0) {
+                perror("pipe");
+                exit(EXIT_FAILURE);
+        }
+        snprintf(pw, sizeof(pw), "%d", prewarm);
+        snprintf(nb, sizeof(nb), "%zu", blocks);
+        snprintf(t0, sizeof(t0), "%.9f", now_seconds());
+        pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+                dup2(fds[1], STDOUT_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                execl(self, self, "coldstart-child", t0, pw, nb, (char *)NULL);
+                _exit(127);
+        }
+        close(fds[1]);
+        n = read(fds[0], out, sizeof(out) - 1);
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        out[n > 0 ? n : 0] = '\0';
+        if (sscanf(out, "%lf %lf", ready, first) != 2) {
+                fprintf(stderr, "coldstart child failed\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static double median(double *v, size_t n)
+{
+        qsort(v, n, sizeof(*v), compare_double);
+        return v[n / 2];
+}
+
+static void run_coldstart(char const *self, size_t trials, size_t message_bytes)
+{
+        size_t blocks = (message_bytes + 7) / 8;
+        double *ready = malloc(trials * sizeof(double));
+        double *first = malloc(trials * sizeof(double));
+        word32 *buf = calloc(blocks * 2, sizeof(word32));
+        word32 key[8], iv[2] = { 1, 2 };
+        static char const *const how[] = { "flushed", "flushed+prewarm", "hot" };
+
+        if (!ready || !first || !buf) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+
+        printf("Cold start: %zu-byte first request, median of %zu trials.\n",
+               blocks * 8, trials);
+
+        for (int prewarm = 0; prewarm < 2; prewarm++) {
+                for (size_t t = 0; t < trials; t++)
+                        child_times(self, prewarm, blocks, &ready[t], &first[t]);
+                printf("  New process%-9s: ready after %8.1f us, first request %8.2f us\n",
+                       prewarm ? ", prewarm" : "", median(ready, trials) * 1e6,
+                       median(first, trials) * 1e6);
+        }
+
+        for (int h = 0; h < 3; h++) {
+                for (size_t t = 0; t < trials; t++) {
+                        double start;
+
+                        if (h < 2) {
+                                gostflushtables();
+                                flush_range(key, sizeof(key));
+                                flush_range(buf, blocks * 2 * sizeof(word32));
+                        }
+                        if (h == 1)
+                                gostprewarm(key);
+                        start = now_seconds();
+                        gostgamma(buf, buf, blocks, iv, 0, key);
+                        first[t] = now_seconds() - start;
+                }
+                printf("  In process, %-15s: first request %8.2f us\n",
+                       how[h], median(first, trials) * 1e6);
+        }
+
+        free(buf);
+        free(first);
+        free(ready);
+}
+
+static void run_replay(char const *path, size_t threads, double rate)
+{
+        static double const pct[] = { 50, 90, 99, 99.9 };
+        struct replay rp;
+        pthread_t *tids;
+        double *lat, seconds, bytes = 0;
+        size_t nkeys, *ids;
+
+        rp.reqs = load_trace(path, &rp.count);
+        if (rp.count == 0) {
+                fprintf(stderr, "%s: no requests\n", path);
+                exit(EXIT_FAILURE);
+        }
+        rp.max_blocks = 0;
+        for (size_t i = 0; i < rp.count; i++) {
+                if (rp.reqs[i].blocks > rp.max_blocks)
+                        rp.max_blocks = rp.reqs[i].blocks;
+                bytes += (double)rp.reqs[i].blocks * 8;
+        }
+
+        ids = dense_keys(rp.reqs, rp.count, &nkeys);
+        rp.keys = malloc(nkeys * sizeof(*rp.keys));
+        tids = malloc(threads * sizeof(*tids));
+        lat = malloc(rp.count * sizeof(*lat));
+        if (!rp.keys || !tids || !lat) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        /* Each trace id still gets the key it always did */
+        for (size_t k = 0; k < nkeys; k++)
+                for (size_t i = 0; i < 8; i++)
+                        rp.keys[k][i] = (word32)(0x9e3779b9UL * (ids[k] * 8 + i + 1));
+        free(ids);
+
+        atomic_init(&rp.next, 0);
+        rp.rate = rate;
+        rp.start = now_seconds();
+        for (size_t t = 0; t < threads; t++)
+                if (pthread_create(&tids[t], NULL, replay_thread, &rp) != 0) {
+                        perror("pthread_create");
+                        exit(EXIT_FAILURE);
+                }
+        for (size_t t = 0; t < threads; t++)
+                pthread_join(tids[t], NULL);
+        seconds = now_seconds() - rp.start;
+
+        for (size_t i = 0; i < rp.count; i++)
+                lat[i] = rp.reqs[i].latency;
+        qsort(lat, rp.count, sizeof(*lat), compare_double);
+
+        printf("Replayed %zu requests (%.2f MiB, %zu keys) on %zu thread(s), %s.\n",
+               rp.count, bytes / (1024.0 * 1024.0), nkeys, threads,
+               rate > 0 ? "open loop" : "closed loop");
+        if (rate > 0)
+                printf("  Arrival rate     : %.2fx trace timing\n", rate);
+        printf("  Elapsed time     : %.6f seconds\n", seconds);
+        printf("  Throughput       : %.2f MiB/s, %.0f requests/s\n",
+               bytes / (1024.0 * 1024.0) / seconds, rp.count / seconds);
+        for (size_t p = 0; p < sizeof(pct) / sizeof(pct[0]); p++)
+                printf("  Latency p%-5g   : %.2f us\n", pct[p],
+                       lat[(size_t)(pct[p] / 100 * (rp.count - 1))] * 1e6);
+        printf("  Latency max      : %.2f us\n", lat[rp.count - 1] * 1e6);
+
+        free(lat);
+        free(tids);
+        free(rp.keys);
+        free(rp.reqs);
+}
+
+/*
+ * The 4- and 8-block kernels head to head on a buffer that stays in
+ * cache: the word and byte table kernels, which are bound by loads,
+ * the SIMD one, bound by vector ALU work, and the hybrid that runs
+ * both kinds of lane in one loop.  The best of five runs is reported,
+ * each over the whole buffer, in place, eight blocks per step.
+ */
+static void kernel8w(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4(in, out, key);
+        gostcrypt4(in + 8, out + 8, key);
+}
+
+static void kernel8b(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4b(in, out, key);
+        gostcrypt4b(in + 8, out + 8, key);
+}
+
+static void kernel8s(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4s(in, out, key);
+        gostcrypt4s(in + 8, out + 8, key);
+}
+
+static void kernel8h(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt8h(in, out, key);
+}
+
+static void run_kernel_benchmark(size_t blocks, size_t iterations)
+{
+        static struct {
+                char const *name;
+                void (*fn)(word32 const *, word32 *, word32 const *);
+        } const kernels[] = {
+                { "word tables (gostcrypt4)", kernel8w },
+                { "byte tables (gostcrypt4b)", kernel8b },
+                { "simd (gostcrypt4s)", kernel8s },
+                { "hybrid (gostcrypt8h)", kernel8h },
+        };
+        word32 key[8];
+        word32 *buffer;
+        double best, start, seconds;
+
+        blocks = (blocks + 7) / 8 * 8;
+        buffer = calloc(blocks * 2, sizeof(word32));
+        if (!buffer) {
+                fprintf(stderr, "Failed to allocate buffer\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer(buffer, blocks);
+
+        printf("Kernels: %zu blocks in place, %zu passes, best of 5%s.\n",
+               blocks, iterations,
+               gostsimd() ? "" : " (no SSSE3: simd and hybrid fall back to words)");
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                best = 1e30;
+                for (int run = 0; run < 5; run++) {
+                        start = now_seconds();
+                        for (size_t iter = 0; iter < iterations; iter++)
+                                for (size_t i = 0; i < blocks; i += 8)
+                                        kernels[k].fn(&buffer[i * 2],
+                                                      &buffer[i * 2], key);
+                        seconds = now_seconds() - start;
+                        if (seconds < best)
+                                best = seconds;
+                }
+                printf("  %-26s: %7.2f ns/block  %8.2f MiB/s\n", kernels[k].name,
+                       best / ((double)blocks * iterations) * 1e9,
+                       (double)blocks * iterations * 8 / (1024.0 * 1024.0) / best);
+        }
+        free(buffer);
+}
+
+/*
+ * Latency of tiny messages: each operation on 1 to 8 blocks through the
+ * library and through the inline forms in gostsmall.h.  Every call
+ * works in place on the output of the one before, so what is timed is
+ * one call after another, not calls overlapping; gamma takes its IV
+ * from there too.
+ */
+#define SMALL_TIME(label, n, call) \
+        do { \
+                double t0 = now_seconds(); \
+                for (size_t r = 0; r < reps; r++) \
+                        call; \
+                ns[label] = (now_seconds() - t0) / reps * 1e9; \
+                (void)(n); \
+        } while (0)
+
+static void run_small_benchmark(size_t reps)
+{
+        static char const *const ops[] = { "encrypt", "decrypt", "gamma", "mac" };
+        word32 key[8];
+        word32 buf[16];
+        double ns[8];
+
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer(buf, 8);
+
+        printf("Small messages: ns per call, %zu calls each.\n", reps);
+        printf("  %-8s %6s %10s %10s\n", "op", "bytes", "library", "inline");
+        for (size_t n = 1; n <= 8; n *= 2) {
+                SMALL_TIME(0, n, gostecb(buf, buf, n, key));
+                SMALL_TIME(2, n, for (size_t i = 0; i < n; i++)
+                                         gostdecrypt(&buf[i * 2], &buf[i * 2], key));
+                SMALL_TIME(4, n, gostgamma(buf, buf, n, buf, 0, key));
+                SMALL_TIME(6, n, gostmac(buf, (int)n, buf, key));
+                switch (n) {
+                case 1:
+                        SMALL_TIME(1, n, gostsmallcrypt1(buf, buf, key));
+                        SMALL_TIME(3, n, gostsmalldecrypt1(buf, buf, key));
+                        SMALL_TIME(5, n, gostsmallgamma1(buf, buf, buf, 0, key));
+                        SMALL_TIME(7, n, gostsmallmac1(buf, buf, key));
+                        break;
+                case 2:
+                        SMALL_TIME(1, n, gostsmallcrypt2(buf, buf, key));
+                        SMALL_TIME(3, n, gostsmalldecrypt2(buf, buf, key));
+                        SMALL_TIME(5, n, gostsmallgamma2(buf, buf, buf, 0, key));
+                        SMALL_TIME(7, n, gostsmallmac2(buf, buf, key));
+                        break;
+                case 4:
+                        SMALL_TIME(1, n, gostsmallcrypt4(buf, buf, key));
+                        SMALL_TIME(3, n, gostsmalldecrypt4(buf, buf, key));
+                        SMALL_TIME(5, n, gostsmallgamma4(buf, buf, buf, 0, key));
+                        SMALL_TIME(7, n, gostsmallmac4(buf, buf, key));
+                        break;
+                default:
+                        SMALL_TIME(1, n, gostsmallcrypt8(buf, buf, key));
+                        SMALL_TIME(3, n, gostsmalldecrypt8(buf, buf, key));
+                        SMALL_TIME(5, n, gostsmallgamma8(buf, buf, buf, 0, key));
+                        SMALL_TIME(7, n, gostsmallmac8(buf, buf, key));
+                        break;
+                }
+                for (size_t op = 0; op < 4; op++)
+                        printf("  %-8s %6zu %10.1f %10.1f\n", ops[op], n * 8,
+                               ns[op * 2], ns[op * 2 + 1]);
+        }
+        printf("  (checksum %08x)\n", (unsigned)(buf[0] ^ buf[15]));
+}
+
+/*
+ * Key rotation over a buffer well beyond the caches: decrypting it all
+ * and then encrypting it all again, against goststreamrecrypt() doing
+ * both a tile at a time.  Either way the cipher work is the same; the
+ * difference is the second trip through memory.
+ */
+static void run_recrypt_benchmark(size_t mib)
+{
+        size_t bytes = mib << 20;
+        unsigned char *buf = malloc(bytes);
+        word32 key[2][8], iv[2] = { 0x01234567, 0x89abcdef };
+        struct gost_stream from, to;
+        double t0, two, one;
+
+        if (!buf) {
+                fprintf(stderr, "Failed to allocate buffer\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 16; i++)
+                key[i / 8][i % 8] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer((word32 *)(void *)buf, bytes / 8);
+
+        goststreaminit(&from, GOST_MODE_CFB, GOST_STREAM_DECRYPT | GOST_STREAM_MAC, iv);
+        goststreaminit(&to, GOST_MODE_GAMMA, GOST_STREAM_MAC, iv);
+        t0 = now_seconds();
+        goststream(&from, buf, buf, bytes, key[0]);
+        goststream(&to, buf, buf, bytes, key[1]);
+        two = now_seconds() - t0;
+
+        goststreaminit(&from, GOST_MODE_CFB, GOST_STREAM_DECRYPT | GOST_STREAM_MAC, iv);
+        goststreaminit(&to, GOST_MODE_GAMMA, GOST_STREAM_MAC, iv);
+        t0 = now_seconds();
+        goststreamrecrypt(&from, key[0], &to, key[1], buf, buf, bytes);
+        one = now_seconds() - t0;
+
+        printf("Re-encrypting %zu MiB, CFB with MAC to gamma with MAC:\n", mib);
+        printf("  two passes : %8.3f s  %8.2f MiB/s\n", two, mib / two);
+        printf("  one pass   : %8.3f s  %8.2f MiB/s\n", one, mib / one);
+        printf("  (checksum %02x)\n", buf[0] ^ buf[bytes - 1]);
+        free(buf);
+}
+
+/*
+ * A small edit to a large chunked object: sealing it all again, as
+ * re-encrypting and re-MACing the whole object amounts to, against
+ * gostobjectupdate() on just the chunks the edit falls in.
+ */
+static void run_object_benchmark(size_t mib, size_t chunk, size_t edit)
+{
+        size_t bytes = mib << 20, edits = 1000;
+        unsigned char *plain = malloc(bytes), *cipher = malloc(bytes);
+        unsigned char *data = malloc(edit);
+        word32 key[8], iv[2] = { 0x01234567, 0x89abcdef };
+        struct gost_object *o;
+        double t0, seal, update;
+
+        if (!plain || !cipher || !data || edit > bytes) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer((word32 *)(void *)plain, bytes / 8);
+        memset(data, 0x5a, edit);
+
+        t0 = now_seconds();
+        o = gostobjectseal(plain, cipher, bytes, chunk, iv, key);
+        seal = now_seconds() - t0;
+        if (!o) {
+                fprintf(stderr, "gostobjectseal failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        t0 = now_seconds();
+        for (size_t i = 0; i < edits; i++)
+                if (gostobjectupdate(o, cipher, (i * 7919 * 4096) % (bytes - edit + 1),
+                                     data, edit) != 0) {
+                        fprintf(stderr, "gostobjectupdate failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        update = (now_seconds() - t0) / edits;
+
+        printf("A %zu byte edit to a %zu MiB object in %zu byte chunks:\n",
+               edit, mib, chunk);
+        printf("  whole object : %12.1f us\n", seal * 1e6);
+        printf("  update       : %12.1f us  (%.0fx)\n", update * 1e6, seal / update);
+        printf("  (checksum %02x)\n", cipher[0] ^ cipher[bytes - 1]);
+        gostobjectfree(o);
+        free(data);
+        free(cipher);
+        free(plain);
+}
+
+/*
+ * 34.13 MACs of short messages under a pool of keys, whose subkeys are
+ * worked out beforehand as a verifier would keep them: one message at
+ * a time through gostcmac(), against gostcmacbatch() on all of them.
+ */
+static void run_cmac_benchmark(size_t message_bytes, size_t nkeys, size_t messages)
+{
+        struct gost_cmackey *ck = malloc(nkeys * sizeof(*ck));
+        struct gost_cmacjob *jobs = malloc(messages * sizeof(*jobs));
+        unsigned char *data = malloc(messages * message_bytes + 1);
+        unsigned char mac[8], sum = 0, bsum = 0;
+        word32 key[8];
+        double t0, one, batch;
+
+        if (!ck || !jobs || !data) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < nkeys; i++) {
+                for (size_t j = 0; j < 8; j++)
+                        key[j] = (word32)(0x9e3779b9UL * (i * 8 + j + 1));
+                gostcmackey(&ck[i], key);
+        }
+        for (size_t i = 0; i < messages * message_bytes; i++)
+                data[i] = (unsigned char)(i * 131);
+        for (size_t i = 0; i < messages; i++) {
+                jobs[i].ck = &ck[(i * 7919) % nkeys];
+                jobs[i].msg = data + i * message_bytes;
+                jobs[i].len = message_bytes;
+        }
+
+        t0 = now_seconds();
+        for (size_t i = 0; i < messages; i++) {
+                gostcmac(jobs[i].ck, jobs[i].msg, jobs[i].len, mac);
+                sum ^= mac[0];
+        }
+        one = now_seconds() - t0;
+
+        t0 = now_seconds();
+        gostcmacbatch(jobs, messages);
+        batch = now_seconds() - t0;
+        for (size_t i = 0; i < messages; i++)
+                bsum ^= jobs[i].mac[0];
+
+        printf("34.13 MAC of %zu messages of %zu bytes under %zu keys:\n",
+               messages, message_bytes, nkeys);
+        printf("  one at a time : %8.1f ns/message\n", one * 1e9 / messages);
+        printf("  batched       : %8.1f ns/message  (%.2fx)\n",
+               batch * 1e9 / messages, one / batch);
+        printf("  (checksum %02x%s)\n", bsum, sum == bsum ? "" : ", MISMATCH");
+        free(data);
+        free(jobs);
+        free(ck);
+}
+
+/*
+ * The chained 34.13 modes over one message as the register widens:
+ * z = 1 is one block at a time, and each z above it is that many
+ * chains for the multi-block kernels to run side by side.
+ */
+static void run_zchain_benchmark(size_t kib, size_t iterations)
+{
+        static char const *const names[] = { "ofb", "cbc", "cfb" };
+        static int (*const modes[])(word32 const *, word32 *, size_t, word32 *,
+                                    size_t, word32 const *) = {
+                gost3413ofb, gost3413cbcencrypt, gost3413cfbencrypt
+        };
+        size_t blocks = kib * 128;
+        word32 *buf = malloc(blocks * 8), reg[16 * 2] = { 0 }, key[8];
+        static size_t const zs[] = { 1, 2, 4, 8, 16 };
+        double t0, t;
+
+        if (!buf) {
+                fprintf(stderr, "Failed to allocate buffer\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer(buf, blocks);
+
+        printf("34.13 chained modes over %zu KiB, MiB/s by register size:\n", kib);
+        printf("  %-4s", "mode");
+        for (size_t j = 0; j < sizeof(zs) / sizeof(zs[0]); j++)
+                printf("  z=%-6zu", zs[j]);
+        printf("\n");
+        for (size_t m = 0; m < 3; m++) {
+                printf("  %-4s", names[m]);
+                for (size_t j = 0; j < sizeof(zs) / sizeof(zs[0]); j++) {
+                        t0 = now_seconds();
+                        for (size_t i = 0; i < iterations; i++)
+                                modes[m](buf, buf, blocks, reg, zs[j], key);
+                        t = now_seconds() - t0;
+                        printf("  %8.1f", (double)kib * iterations / 1024 / t);
+                }
+                printf("\n");
+        }
+        printf("  (checksum %08x)\n", (unsigned)(buf[0] ^ reg[0]));
+        free(buf);
+}
+
+/*
+ * A lazily decrypted mapping of files of growing size: the time to map
+ * and read the first byte, which should not grow with the file, against
+ * reading and decrypting the whole file up front, and against touching
+ * every page of the mapping.  The files are sparse, so the ciphertext
+ * is zeros and only the decryption is measured.
+ */
+static void run_lazymap_benchmark(size_t max_mib)
+{
+        static char const *const modes[] = { "userfaultfd", "signals" };
+        word32 key[8], iv[2] = { 0x01234567, 0x89abcdef };
+        size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+        unsigned char sum = 0;
+
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        printf("Lazily decrypted mappings (times in ms):\n");
+        printf("  %-12s %8s %12s %12s %12s\n", "mode", "MiB", "first byte",
+               "whole file", "every page");
+        for (size_t mib = 1; mib <= max_mib; mib *= 8) {
+                char path[] = "gost_benchmark_lazy.XXXXXX";
+                size_t bytes = mib << 20;
+                word32 *buf = malloc(bytes);
+                int fd = mkstemp(path);
+                double t0, eager;
+
+                if (fd < 0 || !buf || ftruncate(fd, (off_t)bytes) != 0) {
+                        fprintf(stderr, "Failed to set up a %zu MiB file\n", mib);
+                        exit(EXIT_FAILURE);
+                }
+                unlink(path);
+                t0 = now_seconds();
+                if (pread(fd, buf, bytes, 0) != (ssize_t)bytes) {
+                        fprintf(stderr, "Failed to read the file\n");
+                        exit(EXIT_FAILURE);
+                }
+                gostgamma(buf, buf, bytes / 8, iv, 0, key);
+                eager = now_seconds() - t0;
+                sum ^= (unsigned char)buf[0];
+
+                for (int m = 0; m < 2; m++) {
+                        struct gost_lazymap *lm;
+                        unsigned char const *view;
+                        double first, scan;
+
+                        t0 = now_seconds();
+                        lm = gostlazymap(fd, iv, key, 0, m ? GOST_LAZY_SIGNALS : 0);
+                        if (!lm) {
+                                printf("  %-12s %8zu  (unavailable)\n", modes[m], mib);
+                                continue;
+                        }
+                        view = gostlazyaddr(lm);
+                        sum ^= view[0];
+                        first = now_seconds() - t0;
+                        t0 = now_seconds();
+                        for (size_t i = 0; i < bytes; i += page)
+                                sum ^= view[i];
+                        scan = now_seconds() - t0;
+                        printf("  %-12s %8zu %12.3f %12.3f %12.3f\n", modes[m], mib,
+                               first * 1e3, eager * 1e3, scan * 1e3);
+                        gostlazyunmap(lm);
+                }
+                close(fd);
+                free(buf);
+        }
+        printf("  (checksum %02x)\n", sum);
+}
+
+/*
+ * Skewed page reads from objects held encrypted in memory, nine in ten
+ * of them to a tenth of the pages: decrypting the page on every read,
+ * against the page cache, whose hits are a hash lookup and whose
+ * concurrent misses are filled in batches.
+ */
+#define CACHE_PAGE 4096
+#define CACHE_READS 200000
+
+struct cachebench {
+        pthread_t thread;
+        unsigned char const *crypt;
+        struct gost_cache *c;
+        word32 const *key;
+        size_t pages, perobject;
+        unsigned seed;
+        unsigned char sum;
+};
+
+static int cachebench_read(void *arg, unsigned long long object,
+                           unsigned long long page, unsigned char *buf, word32 iv[2])
+{
+        struct cachebench const *b = arg;
+
+        memcpy(buf, b->crypt + (object * b->perobject + page) * CACHE_PAGE, CACHE_PAGE);
+        iv[0] = (word32)object;
+        iv[1] = 0x89abcdef;
+        return 0;
+}
+
+static size_t cachebench_page(struct cachebench *b)
+{
+        b->seed = b->seed * 1103515245u + 12345u;
+        if ((b->seed >> 8) % 10)
+                return (b->seed >> 12) % (b->pages / 10 + 1);
+        return (b->seed >> 12) % b->pages;
+}
+
+static void *cachebench_thread(void *arg)
+{
+        struct cachebench *b = arg;
+        word32 page[CACHE_PAGE / 4], iv[2];
+
+        for (size_t i = 0; i < CACHE_READS; i++) {
+                size_t n = cachebench_page(b);
+                size_t object = n / b->perobject, at = n % b->perobject;
+
+                if (b->c) {
+                        unsigned char const *p = gostcacheget(b->c, object, at);
+
+                        if (p) {
+                                b->sum ^= p[i % CACHE_PAGE];
+                                gostcacherelease(b->c, p);
+                        }
+                        continue;
+                }
+                cachebench_read(b, object, at, (unsigned char *)page, iv);
+                gostgamma(page, page, CACHE_PAGE / 8, iv, at * (CACHE_PAGE / 8), b->key);
+                b->sum ^= ((unsigned char *)page)[i % CACHE_PAGE];
+        }
+        return NULL;
+}
+
+static double run_cache_readers(struct cachebench *proto, size_t threads,
+                                unsigned char *sum)
+{
+        struct cachebench *b = calloc(threads, sizeof(*b));
+        double t0;
+
+        if (!b) {
+                fprintf(stderr, "Failed to allocate threads\n");
+                exit(EXIT_FAILURE);
+        }
+        t0 = now_seconds();
+        for (size_t i = 0; i < threads; i++) {
+                b[i] = *proto;
+                b[i].seed = (unsigned)(i * 7919 + 1);
+                pthread_create(&b[i].thread, NULL, cachebench_thread, &b[i]);
+        }
+        for (size_t i = 0; i < threads; i++) {
+                pthread_join(b[i].thread, NULL);
+                *sum ^= b[i].sum;
+        }
+        t0 = now_seconds() - t0;
+        free(b);
+        return t0;
+}
+
+static void run_cache_benchmark(size_t mib, size_t cache_mib, size_t threads)
+{
+        size_t const bytes = mib << 20;
+        unsigned char *crypt = malloc(bytes);
+        unsigned char sum = 0, csum = 0;
+        struct cachebench proto;
+        struct gost_cachestats st;
+        word32 key[8];
+        double direct, cached, reads = (double)CACHE_READS * threads;
+
+        if (!crypt) {
+                fprintf(stderr, "Failed to allocate buffers\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        fill_buffer((word32 *)(void *)crypt, bytes / 8);
+        memset(&proto, 0, sizeof(proto));
+        proto.crypt = crypt;
+        proto.key = key;
+        proto.pages = bytes / CACHE_PAGE;
+        proto.perobject = (1 << 20) / CACHE_PAGE;
+
+        direct = run_cache_readers(&proto, threads, &sum);
+        proto.c = gostcachenew(CACHE_PAGE, (cache_mib << 20) / CACHE_PAGE, threads * 4,
+                               cachebench_read, &proto, key);
+        if (!proto.c) {
+                fprintf(stderr, "gostcachenew failed\n");
+                exit(EXIT_FAILURE);
+        }
+        cached = run_cache_readers(&proto, threads, &csum);
+        gostcachestats(proto.c, &st);
+        gostcachefree(proto.c);
+
+        printf("%zu threads reading 4 KiB pages of %zu MiB, %zu MiB cached:\n",
+               threads, mib, cache_mib);
+        printf("  decrypt every read : %8.1f ns/read\n", direct * 1e9 / reads);
+        printf("  page cache         : %8.1f ns/read  (%.1fx)\n",
+               cached * 1e9 / reads, direct / cached);
+        printf("  hits %.1f%%, %llu evictions, %.2f misses per batch\n",
+               100.0 * (double)st.hits / (double)(st.hits + st.misses), st.evictions,
+               st.batches ? (double)st.misses / (double)st.batches : 0.0);
+        printf("  (checksum %02x%s)\n", csum, sum == csum ? "" : ", MISMATCH");
+        free(crypt);
+}
+
+/*
+ * Records for many sessions, in batches of random sessions: a
+ * gost_stream and key on the heap for each, advanced one at a time,
+ * against the session table advancing a batch through its lanes.
+ */
+struct session_object {
+        struct gost_stream s;
+        word32 key[8];
+};
+
+static void run_sessions_benchmark(size_t count, size_t record, size_t batch)
+{
+        size_t const records = 2000000, rounds = records / batch;
+        struct session_object **obj = malloc(count * sizeof(*obj));
+        struct gost_sessionop *ops = malloc(batch * sizeof(*ops));
+        unsigned char *buf = malloc(batch * record + 1);
+        size_t *ids = malloc(count * sizeof(*ids));
+        struct gost_sessions *t = gostsessionsnew(count, GOST_STREAM_MAC);
+        word32 key[8], iv[2] = { 0x01234567, 0x89abcdef };
+        unsigned char sum = 0, tsum = 0;
+        unsigned seed;
+        double t0, one, table;
+
+        if (!obj || !ops || !buf || !ids || !t) {
+                fprintf(stderr, "Failed to allocate sessions\n");
+                exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < count; i++) {
+                for (size_t j = 0; j < 8; j++)
+                        key[j] = (word32)(0x9e3779b9UL * (i * 8 + j + 1));
+                iv[0] = (word32)i;
+                obj[i] = malloc(sizeof(*obj[i]));
+                if (!obj[i]) {
+                        fprintf(stderr, "Failed to allocate sessions\n");
+                        exit(EXIT_FAILURE);
+                }
+                goststreaminit(&obj[i]->s, GOST_MODE_GAMMA, GOST_STREAM_MAC, iv);
+                memcpy(obj[i]->key, key, sizeof(key));
+                ids[i] = gostsessionopen(t, key, iv);
+        }
+        memset(buf, 0x5a, batch * record);
+
+        seed = 1;
+        t0 = now_seconds();
+        for (size_t r = 0; r < rounds; r++)
+                for (size_t i = 0; i < batch; i++) {
+                        struct session_object *o;
+
+                        seed = seed * 1103515245u + 12345u;
+                        o = obj[(seed >> 4) % count];
+                        goststream(&o->s, buf + i * record, buf + i * record, record,
+                                   o->key);
+                        sum ^= buf[i * record];
+                }
+        one = now_seconds() - t0;
+
+        memset(buf, 0x5a, batch * record);
+        seed = 1;
+        t0 = now_seconds();
+        for (size_t r = 0; r < rounds; r++) {
+                for (size_t i = 0; i < batch; i++) {
+                        seed = seed * 1103515245u + 12345u;
+                        ops[i].id = ids[(seed >> 4) % count];
+                        ops[i].in = buf + i * record;
+                        ops[i].out = buf + i * record;
+                        ops[i].len = record;
+                }
+                gostsessionscrypt(t, ops, batch);
+                for (size_t i = 0; i < batch; i++)
+                        tsum ^= buf[i * record];
+        }
+        table = now_seconds() - t0;
+
+        printf("%zu sessions, %zu-byte records in batches of %zu:\n", count, record,
+               batch);
+        printf("  object per session : %8.1f ns/record  %4zu bytes/session + malloc\n",
+               one * 1e9 / (double)(rounds * batch),
+               sizeof(struct session_object) + sizeof(*obj));
+        printf("  session table      : %8.1f ns/record  %4zu bytes/session  (%.2fx)\n",
+               table * 1e9 / (double)(rounds * batch), gostsessionsbytes(t) / count,
+               one / table);
+        printf("  (checksum %02x%s)\n", tsum, sum == tsum ? "" : ", MISMATCH");
+        for (size_t i = 0; i < count; i++)
+                free(obj[i]);
+        gostsessionsfree(t);
+        free(ids);
+        free(buf);
+        free(ops);
+        free(obj);
+}
+
+/*
+ * Producers encrypting records into one logical stream: every thread
+ * through the shared stream's atomic reservation, against all of them
+ * taking turns on one gost_stream under a mutex, which is what one
+ * gostofb() call chain amounts to.
+ */
+struct producer {
+        pthread_t thread;
+        struct gost_shared *sh;
+        struct gost_stream *s;
+        pthread_mutex_t *lock;
+        word32 const *key;
+        size_t record, records;
+};
+
+static void *producer_thread(void *arg)
+{
+        struct producer *p = arg;
+        unsigned char *rec = malloc(p->record);
+
+        if (!rec)
+                return NULL;
+        memset(rec, 0x5a, p->record);
+        for (size_t i = 0; i < p->records; i++) {
+                if (p->sh) {
+                        gostsharedwrite(p->sh, rec, rec, p->record);
+                } else {
+                        pthread_mutex_lock(p->lock);
+                        goststream(p->s, rec, rec, p->record, p->key);
+                        pthread_mutex_unlock(p->lock);
+                }
+        }
+        free(rec);
+        return NULL;
+}
+
+static double run_producers(size_t threads, size_t record, size_t records,
+                            int shared, word32 const key[8])
+{
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        struct producer *p = calloc(threads, sizeof(*p));
+        word32 iv[2] = { 0x01234567, 0x89abcdef };
+        struct gost_stream s;
+        struct gost_shared *sh = shared ? gostsharednew(iv, key) : NULL;
+        double t0;
+
+        if (!p || (shared && !sh)) {
+                fprintf(stderr, "Failed to allocate producers\n");
+                exit(EXIT_FAILURE);
+        }
+        goststreaminit(&s, GOST_MODE_GAMMA, 0, iv);
+        t0 = now_seconds();
+        for (size_t i = 0; i < threads; i++) {
+                p[i].sh = sh;
+                p[i].s = &s;
+                p[i].lock = &lock;
+                p[i].key = key;
+                p[i].record = record;
+                p[i].records = records / threads;
+                pthread_create(&p[i].thread, NULL, producer_thread, &p[i]);
+        }
+        for (size_t i = 0; i < threads; i++)
+                pthread_join(p[i].thread, NULL);
+        t0 = now_seconds() - t0;
+        gostsharedfree(sh);
+        free(p);
+        return t0;
+}
+
+static void run_shared_benchmark(size_t threads, size_t record, size_t mib)
+{
+        size_t records = (mib << 20) / record;
+        word32 key[8];
+        double locked, shared;
+
+        for (size_t i = 0; i < 8; i++)
+                key[i] = (word32)(0x01020304UL * (i + 1));
+        records -= records % threads;
+        locked = run_producers(threads, record, records, 0, key);
+        shared = run_producers(threads, record, records, 1, key);
+        printf("%zu producers, %zu-byte records, %zu MiB into one stream:\n",
+               threads, record, mib);
+        printf("  one stream under a lock : %8.2f MiB/s\n",
+               (double)(records * record) / locked / (1 << 20));
+        printf("  shared, reserved ranges : %8.2f MiB/s\n",
+               (double)(records * record) / shared / (1 << 20));
+}
+
 static void usage(const char *prog)
 {
         fprintf(stderr,
                 "Usage: %s [blocks_per_batch] [iterations]\n"
+                "       %s keys [message_bytes] [key_pool] [messages]\n"
+                "       %s roofline [max_bytes] [max_threads]\n"
+                "       %s replay trace [threads] [rate]\n"
+                "       %s coldstart [trials] [message_bytes]\n"
+                "       %s kernels [blocks] [iterations]\n"
+                "       %s small [calls]\n"
+                "       %s recrypt [mib]\n"
+                "       %s shared [threads] [record_bytes] [mib]\n"
+                "       %s object [mib] [chunk_bytes] [edit_bytes]\n"
+                "       %s cmac [message_bytes] [key_pool] [messages]\n"
+                "       %s zchain [kib] [iterations]\n"
+                "       %s lazymap [max_mib]\n"
+                "       %s cache [mib] [cache_mib] [threads]\n"
+                "       %s sessions [count] [record_bytes] [batch]\n"
                 "  blocks_per_batch: number of 64-bit blocks processed per iteration (default 1024)\n"
-                "  iterations      : number of iterations to run (default 1000)\n",
-                prog);
+                "  iterations      : number of iterations to run (default 1000)\n"
+                "  keys            : key setup cost and per-message keys from a pool\n"
+                "  message_bytes   : size of each message (default 64)\n"
+                "  key_pool        : number of distinct keys (default 65536)\n"
+                "  messages        : number of messages (default 1000000)\n"
+                "  roofline        : cipher paths against copy/triad/memcpy bandwidth\n"
+                "  max_bytes       : largest buffer; sizes go up by 8x from 32 KiB (default 64 MiB)\n"
+                "  max_threads     : most threads; counts double from 1 (default: CPUs)\n"
+                "  replay          : requests from a CSV or JSON-lines trace file\n"
+                "  threads         : threads issuing requests (default 1)\n"
+                "  rate            : 0 to run closed loop, else open loop at this\n"
+                "                    multiple of the trace's arrival rate (default 0)\n"
+                "  coldstart       : first-request latency from process start and after\n"
+                "                    cache flushes, with and without gostprewarm()\n"
+                "  trials          : repetitions to take the median of (default 51)\n"
+                "  kernels         : word, byte, SIMD and hybrid kernels on a cached buffer\n"
+                "  blocks          : buffer size in blocks (default 2048)\n"
+                "  small           : 8 to 64 byte calls, library against gostsmall.h\n"
+                "  calls           : calls per operation and size (default 200000)\n"
+                "  recrypt         : key rotation in two passes against one fused pass\n"
+                "  mib             : buffer size in MiB (default 64)\n"
+                "  shared          : producers writing one stream, locked against shared\n"
+                "  record_bytes    : bytes per record (default 4096)\n"
+                "  object          : a small edit to a chunked object, whole against update\n"
+                "  chunk_bytes     : object chunk size (default 65536)\n"
+                "  edit_bytes      : bytes changed per edit (default 4096)\n"
+                "  cmac            : 34.13 MACs one at a time against batched\n"
+                "  zchain          : 34.13 OFB, CBC and CFB by register size z\n"
+                "  lazymap         : first access to a lazily decrypted file by its size\n"
+                "  max_mib         : largest file; sizes go up by 8x from 1 MiB (default 64)\n"
+                "  cache           : skewed page reads, decrypting each against the page cache\n"
+                "  cache_mib       : cache size in MiB (default 64)\n"
+                "  sessions        : records for many sessions, one object each against\n"
+                "                    the session table\n"
+                "  count           : sessions (default 1000000)\n"
+                "  batch           : records per batch (default 256)\n",
+                prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog,
+                prog, prog, prog);
+}
+
+static size_t arg_size(int argc, char **argv, int i, size_t def)
+{
+        return argc > i ? (size_t)strtoul(argv[i], NULL, 0) : def;
 }
 
 int main(int argc, char **argv)
@@ -98,6 +1601,186 @@ int main(int argc, char **argv)
         size_t blocks_per_batch = 1024;
         size_t iterations = 1000;
 
+        /* Before anything else, so the child really is cold */
+        if (argc >= 5 && strcmp(argv[1], "coldstart-child") == 0)
+                return run_coldstart_child(argv);
+
+        kboxinit();
+
+        if (argc >= 2 && strcmp(argv[1], "coldstart") == 0) {
+                size_t trials = arg_size(argc, argv, 2, 51);
+                size_t message_bytes = arg_size(argc, argv, 3, 64);
+
+                if (trials == 0 || message_bytes == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_coldstart("/proc/self/exe", trials, message_bytes);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "keys") == 0) {
+                size_t message_bytes = arg_size(argc, argv, 2, 64);
+                size_t pool_size = arg_size(argc, argv, 3, 65536);
+                size_t messages = arg_size(argc, argv, 4, 1000000);
+
+                if (message_bytes == 0 || pool_size == 0 || messages == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_key_benchmark(message_bytes, pool_size, messages);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "roofline") == 0) {
+                size_t max_bytes = arg_size(argc, argv, 2, 64 * 1024 * 1024);
+                size_t max_threads = arg_size(argc, argv, 3,
+                                              (size_t)gostpoolthreads());
+
+                if (max_bytes < 32 * 1024 || max_threads == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_roofline(max_bytes, max_threads);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "small") == 0) {
+                size_t calls = arg_size(argc, argv, 2, 200000);
+
+                if (calls == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_small_benchmark(calls);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "recrypt") == 0) {
+                size_t mib = arg_size(argc, argv, 2, 64);
+
+                if (mib == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_recrypt_benchmark(mib);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "shared") == 0) {
+                size_t threads = arg_size(argc, argv, 2, (size_t)gostpoolthreads());
+                size_t record = arg_size(argc, argv, 3, 4096);
+                size_t mib = arg_size(argc, argv, 4, 64);
+
+                if (threads == 0 || record == 0 || mib == 0 ||
+                    (mib << 20) / record < threads) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_shared_benchmark(threads, record, mib);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "object") == 0) {
+                size_t mib = arg_size(argc, argv, 2, 256);
+                size_t chunk = arg_size(argc, argv, 3, 65536);
+                size_t edit = arg_size(argc, argv, 4, 4096);
+
+                if (mib == 0 || chunk == 0 || chunk % 8 || edit == 0 ||
+                    edit > (mib << 20)) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_object_benchmark(mib, chunk, edit);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "cmac") == 0) {
+                size_t message_bytes = arg_size(argc, argv, 2, 64);
+                size_t nkeys = arg_size(argc, argv, 3, 65536);
+                size_t messages = arg_size(argc, argv, 4, 1000000);
+
+                if (nkeys == 0 || messages == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_cmac_benchmark(message_bytes, nkeys, messages);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "zchain") == 0) {
+                size_t kib = arg_size(argc, argv, 2, 256);
+                size_t iters = arg_size(argc, argv, 3, 20);
+
+                if (kib == 0 || iters == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_zchain_benchmark(kib, iters);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "lazymap") == 0) {
+                size_t max_mib = arg_size(argc, argv, 2, 64);
+
+                if (max_mib == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_lazymap_benchmark(max_mib);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "cache") == 0) {
+                size_t mib = arg_size(argc, argv, 2, 256);
+                size_t cache_mib = arg_size(argc, argv, 3, 64);
+                size_t threads = arg_size(argc, argv, 4, 1);
+
+                if (mib == 0 || cache_mib == 0 || threads == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_cache_benchmark(mib, cache_mib, threads);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "sessions") == 0) {
+                size_t count = arg_size(argc, argv, 2, 1000000);
+                size_t record = arg_size(argc, argv, 3, 64);
+                size_t batch = arg_size(argc, argv, 4, 256);
+
+                if (count == 0 || record == 0 || batch == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_sessions_benchmark(count, record, batch);
+                return 0;
+        }
+
+        if (argc >= 2 && strcmp(argv[1], "kernels") == 0) {
+                size_t blocks = arg_size(argc, argv, 2, 2048);
+                size_t passes = arg_size(argc, argv, 3, 200);
+
+                if (blocks == 0 || passes == 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_kernel_benchmark(blocks, passes);
+                return 0;
+        }
+
+        if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+                size_t threads = arg_size(argc, argv, 3, 1);
+                double rate = argc > 4 ? strtod(argv[4], NULL) : 0;
+
+                if (threads == 0 || rate < 0) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                run_replay(argv[2], threads, rate);
+                return 0;
+        }
+
         if (argc >= 2)
                 blocks_per_batch = (size_t)strtoul(argv[1], NULL, 0);
         if (argc >= 3)
@@ -107,7 +1790,6 @@ int main(int argc, char **argv)
                 return EXIT_FAILURE;
         }
 
-        kboxinit();
         run_benchmark(blocks_per_batch, iterations);
         return 0;
 }
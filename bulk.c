@@ -0,0 +1,679 @@
+/*
+ * Bulk modes over the multi-block kernels, and the dispatcher that
+ * picks which kernel each of them uses.
+ *
+ * Every function here must produce output bit-identical to the
+ * block-at-a-time reference in GOST.C; test.c checks every choice.
+ */
+#include <string.h>
+
+#include "gost.h"
+#include "gostsmall.h"
+#include "probe.h"
+
+typedef void gostkernel(word32 const *in, word32 *out, word32 const *key);
+
+/*
+ * Indexed by tier, then log2 of the width.  The SIMD kernels only come
+ * four wide and up, so the narrower calls of those tiers use words.
+ */
+static gostkernel *const kernels[GOST_NTIERS][4] = {
+        { gostcrypt, gostcrypt2, gostcrypt4, NULL },
+        { gostcryptb, gostcrypt2b, gostcrypt4b, NULL },
+        { gostcrypt, gostcrypt2, gostcrypt4s, NULL },
+        { gostcrypt, gostcrypt2, gostcrypt4s, gostcrypt8h },
+};
+
+static struct gost_choice choices[GOST_NOPS] = {
+        { 4, GOST_TIER_WORD, 0 },       /* ECB */
+        { 4, GOST_TIER_WORD, 64 },      /* gamma */
+        { 4, GOST_TIER_WORD, 64 },      /* CFB decrypt */
+};
+
+static char const *const opnames[GOST_NOPS] = { "ecb", "gamma", "cfbdec" };
+
+static struct gost_tunables tunables = {
+        2,              /* scalarmax: 16 bytes */
+        16384,          /* threadmin: 128 KiB */
+        4096,           /* grain: 32 KiB */
+        0               /* threads: one per CPU */
+};
+
+char const *
+gostopname(int op)
+{
+        return op >= 0 && op < GOST_NOPS ? opnames[op] : "?";
+}
+
+void
+gostgetchoice(int op, struct gost_choice *c)
+{
+        *c = choices[op];
+}
+
+int
+gostsetchoice(int op, struct gost_choice const *c)
+{
+        if (op < 0 || op >= GOST_NOPS)
+                return -1;
+        if (c->tier < 0 || c->tier >= GOST_NTIERS)
+                return -1;
+        if (c->width != 1 && c->width != 2 && c->width != 4 &&
+            !(c->width == 8 && kernels[c->tier][3]))
+                return -1;
+        if (op != GOST_OP_ECB && (c->chunk < 1 || c->chunk > GOST_MAXCHUNK))
+                return -1;
+        GOST_PROBE4(choice, opnames[op], c->width, c->tier, c->chunk);
+        choices[op] = *c;
+        return 0;
+}
+
+void
+gostgettunables(struct gost_tunables *t)
+{
+        *t = tunables;
+}
+
+int
+gostsettunables(struct gost_tunables const *t)
+{
+        int restart;
+
+        if (t->grain < 1 || t->threads < 0)
+                return -1;
+        restart = t->threads != tunables.threads;
+        tunables = *t;
+        if (restart)
+                gostpoolstop();         /* Restarted at the new size when next needed */
+        return 0;
+}
+
+/*
+ * Encrypt n independent blocks with the chosen width, finishing the
+ * tail with the narrower kernels of the same tier.
+ */
+static void
+ecbblocks(struct gost_choice const *c, word32 const *in, word32 *out,
+          size_t n, word32 const key[8])
+{
+        gostkernel *const *k = kernels[c->tier];
+        size_t i = 0;
+
+        if (c->width >= 8)
+                for (; i + 8 <= n; i += 8)
+                        k[3](&in[i * 2], &out[i * 2], key);
+        if (c->width >= 4)
+                for (; i + 4 <= n; i += 4)
+                        k[2](&in[i * 2], &out[i * 2], key);
+        if (c->width >= 2)
+                for (; i + 2 <= n; i += 2)
+                        k[1](&in[i * 2], &out[i * 2], key);
+        for (; i < n; i++)
+                k[0](&in[i * 2], &out[i * 2], key);
+}
+
+/* The constants for addition, as in gostofb() */
+#define C1 0x01010104
+#define C2 0x01010101
+
+/*
+ * Advance one half of the gamma counter by n steps of c, modulo 2^32-1
+ * with 0 written as all-ones, exactly as n calls of gostofb()'s
+ * increment would.  n must be at least 1.
+ */
+static word32
+ctrseek(word32 x, unsigned long long n, word32 c)
+{
+        unsigned long long const m = 0xffffffffULL;
+        unsigned long long v = (x % m + (n % m) * c % m) % m;
+
+        return v ? (word32)v : 0xffffffff;
+}
+
+/*
+ * The serial forms of each mode.  start is the encrypted IV, so that
+ * the parts of a split gamma call do not each recompute it.
+ */
+static void
+gammablocks(struct gost_choice const *c, word32 const *in, word32 *out,
+            size_t len, word32 const start[2], unsigned long long pos,
+            word32 const key[8])
+{
+        word32 ctr[GOST_MAXCHUNK * 2];
+        word32 gamma[GOST_MAXCHUNK * 2];
+        size_t n, i;
+
+        while (len) {
+                n = len < (size_t)c->chunk ? len : (size_t)c->chunk;
+                GOST_PROBE3(batch, "gamma", n, c->width);
+
+                /* Block pos is encrypted under the counter stepped pos+1 times */
+                ctr[0] = ctrseek(start[0], pos + 1, C2);
+                ctr[1] = ctrseek(start[1], pos + 1, C1);
+                for (i = 1; i < n; i++) {
+                        word32 t0 = ctr[i * 2 - 2] + C2;
+                        word32 t1 = ctr[i * 2 - 1] + C1;
+
+                        ctr[i * 2] = t0 < C2 ? t0 + 1 : t0;
+                        ctr[i * 2 + 1] = t1 < C1 ? t1 + 1 : t1;
+                }
+
+                ecbblocks(c, ctr, gamma, n, key);
+                for (i = 0; i < n * 2; i++)
+                        out[i] = in[i] ^ gamma[i];
+
+                in += n * 2;
+                out += n * 2;
+                len -= n;
+                pos += n;
+        }
+}
+
+static void
+cfbdecblocks(struct gost_choice const *c, word32 const *in, word32 *out,
+             size_t len, word32 iv[2], word32 const key[8])
+{
+        word32 gamma[GOST_MAXCHUNK * 2];
+        size_t n, i;
+
+        while (len) {
+                n = len < (size_t)c->chunk ? len : (size_t)c->chunk;
+                GOST_PROBE3(batch, "cfbdec", n, c->width);
+
+                /* The gamma for each block is the encrypted block before it */
+                kernels[c->tier][0](iv, gamma, key);
+                ecbblocks(c, in, gamma + 2, n - 1, key);
+
+                /* Keep the chain before a decrypt in place overwrites it */
+                iv[0] = in[n * 2 - 2];
+                iv[1] = in[n * 2 - 1];
+                for (i = 0; i < n * 2; i++)
+                        out[i] = in[i] ^ gamma[i];
+
+                in += n * 2;
+                out += n * 2;
+                len -= n;
+        }
+}
+
+/*
+ * The scalar path for calls too small to be worth the batching: one
+ * block at a time through gostcrypt(), as gostofb() does.
+ */
+static void
+gammascalar(word32 const *in, word32 *out, size_t len,
+            word32 const start[2], unsigned long long pos, word32 const key[8])
+{
+        word32 ctr[2], gamma[2];
+
+        ctr[0] = ctrseek(start[0], pos + 1, C2);
+        ctr[1] = ctrseek(start[1], pos + 1, C1);
+        while (len--) {
+                gostcrypt(ctr, gamma, key);
+                *out++ = *in++ ^ gamma[0];
+                *out++ = *in++ ^ gamma[1];
+
+                ctr[0] += C2;
+                if (ctr[0] < C2)
+                        ctr[0]++;
+                ctr[1] += C1;
+                if (ctr[1] < C1)
+                        ctr[1]++;
+        }
+}
+
+/*
+ * The planner.  Decide how a call of len blocks runs, and into how
+ * many parts it is split if it goes to the pool.
+ */
+enum strategy { SCALAR, WIDE, SPLIT };
+
+static char const *const strategynames[] = { "scalar", "wide", "split" };
+
+static enum strategy
+plan(int op, size_t len, size_t *nparts)
+{
+        enum strategy how = WIDE;
+        size_t n = 1, idle;
+
+        if (len <= tunables.scalarmax) {
+                how = SCALAR;
+        } else if (len >= tunables.threadmin && len / tunables.grain >= 2) {
+                n = len / tunables.grain;
+                idle = (size_t)gostpoolidle() + 1;
+                if (n > idle)
+                        n = idle;
+                if (n > GOST_MAXPARTS)
+                        n = GOST_MAXPARTS;
+                if (n > 1)
+                        how = SPLIT;
+        }
+        *nparts = n;
+        GOST_PROBE3(plan, opnames[op], len, strategynames[how]);
+        if (how == SPLIT)
+                GOST_PROBE3(split, opnames[op], len, n);
+        return how;
+}
+
+/* One call split across the pool, each part a run of whole blocks */
+struct split {
+        int op;
+        word32 const *in;
+        word32 *out;
+        size_t len;
+        size_t nparts;
+        word32 const *key;
+        word32 start[2];                        /* gamma: the encrypted IV */
+        unsigned long long pos;                 /* gamma: block of the first part */
+        word32 ivs[GOST_MAXPARTS * 2];          /* CFB: the chain into each part */
+};
+
+static void
+splitpart(void *arg, size_t part)
+{
+        struct split *s = arg;
+        struct gost_choice const *c = &choices[s->op];
+        size_t first = s->len * part / s->nparts;
+        size_t n = s->len * (part + 1) / s->nparts - first;
+        word32 const *in = s->in + first * 2;
+        word32 *out = s->out + first * 2;
+
+        switch (s->op) {
+        case GOST_OP_ECB:
+                GOST_PROBE3(batch, "ecb", n, c->width);
+                ecbblocks(c, in, out, n, s->key);
+                break;
+        case GOST_OP_GAMMA:
+                gammablocks(c, in, out, n, s->start, s->pos + first, s->key);
+                break;
+        case GOST_OP_CFBDEC:
+                cfbdecblocks(c, in, out, n, &s->ivs[part * 2], s->key);
+                break;
+        }
+}
+
+void
+gostecb(word32 const *in, word32 *out, size_t len, word32 const key[8])
+{
+        struct split s;
+        size_t i;
+
+        GOST_PROBE2(entry, "ecb", len);
+        switch (plan(GOST_OP_ECB, len, &s.nparts)) {
+        case SCALAR:
+                for (i = 0; i < len; i++)
+                        gostcrypt(&in[i * 2], &out[i * 2], key);
+                break;
+        case WIDE:
+                GOST_PROBE3(batch, "ecb", len, choices[GOST_OP_ECB].width);
+                ecbblocks(&choices[GOST_OP_ECB], in, out, len, key);
+                break;
+        case SPLIT:
+                s.op = GOST_OP_ECB;
+                s.in = in;
+                s.out = out;
+                s.len = len;
+                s.key = key;
+                gostparallel(splitpart, &s, s.nparts);
+                break;
+        }
+        GOST_PROBE1(exit, "ecb");
+}
+
+void
+gostgamma(word32 const *in, word32 *out, size_t len, word32 const iv[2],
+          unsigned long long pos, word32 const key[8])
+{
+        struct split s;
+
+        GOST_PROBE2(entry, "gamma", len);
+        gostcrypt(iv, s.start, key);
+
+        switch (plan(GOST_OP_GAMMA, len, &s.nparts)) {
+        case SCALAR:
+                gammascalar(in, out, len, s.start, pos, key);
+                break;
+        case WIDE:
+                gammablocks(&choices[GOST_OP_GAMMA], in, out, len, s.start,
+                            pos, key);
+                break;
+        case SPLIT:
+                s.op = GOST_OP_GAMMA;
+                s.in = in;
+                s.out = out;
+                s.len = len;
+                s.key = key;
+                s.pos = pos;
+                gostparallel(splitpart, &s, s.nparts);
+                break;
+        }
+        GOST_PROBE1(exit, "gamma");
+}
+
+/*
+ * The counters of every buffer go into one staging area, a batch at a
+ * time, and each batch through the wide kernel whichever buffers its
+ * blocks belong to.  seg[] records where each run of them goes back.
+ */
+void
+gostgammav(struct gost_gammavec const *v, size_t n, word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_GAMMA];
+        word32 ctr[GOST_MAXCHUNK * 2];
+        word32 gamma[GOST_MAXCHUNK * 2];
+        struct {
+                size_t vec, first, len;
+        } seg[GOST_MAXCHUNK];
+        word32 start[2], next[2] = { 0, 0 };
+        size_t vec = 0, done = 0, fill, nseg, m, i, k;
+
+        GOST_PROBE2(entry, "gammav", n);
+        while (vec < n) {
+                fill = 0;
+                nseg = 0;
+                while (vec < n && fill < (size_t)c->chunk) {
+                        if (done == v[vec].len) {
+                                vec++;
+                                done = 0;
+                                continue;
+                        }
+                        if (done == 0) {
+                                gostcrypt(v[vec].iv, start, key);
+                                next[0] = ctrseek(start[0], v[vec].pos + 1, C2);
+                                next[1] = ctrseek(start[1], v[vec].pos + 1, C1);
+                        }
+                        m = v[vec].len - done;
+                        if (m > (size_t)c->chunk - fill)
+                                m = (size_t)c->chunk - fill;
+                        seg[nseg].vec = vec;
+                        seg[nseg].first = done;
+                        seg[nseg].len = m;
+                        nseg++;
+                        for (i = 0; i < m; i++, fill++) {
+                                ctr[fill * 2] = next[0];
+                                ctr[fill * 2 + 1] = next[1];
+                                next[0] += C2;
+                                if (next[0] < C2)
+                                        next[0]++;
+                                next[1] += C1;
+                                if (next[1] < C1)
+                                        next[1]++;
+                        }
+                        done += m;
+                }
+                if (fill == 0)
+                        break;
+
+                GOST_PROBE3(batch, "gammav", fill, c->width);
+                ecbblocks(c, ctr, gamma, fill, key);
+                for (k = 0, fill = 0; k < nseg; k++) {
+                        word32 const *in = v[seg[k].vec].in + seg[k].first * 2;
+                        word32 *out = v[seg[k].vec].out + seg[k].first * 2;
+
+                        for (i = 0; i < seg[k].len * 2; i++)
+                                out[i] = in[i] ^ gamma[fill * 2 + i];
+                        fill += seg[k].len;
+                }
+        }
+        GOST_PROBE1(exit, "gammav");
+}
+
+void
+gostcfbdec(word32 const *in, word32 *out, size_t len, word32 iv[2],
+           word32 const key[8])
+{
+        struct split s;
+        size_t part, first;
+
+        GOST_PROBE2(entry, "cfbdec", len);
+        switch (plan(GOST_OP_CFBDEC, len, &s.nparts)) {
+        case SCALAR:
+                gostcfbdecrypt(in, out, (int)len, iv, key);
+                break;
+        case WIDE:
+                cfbdecblocks(&choices[GOST_OP_CFBDEC], in, out, len, iv, key);
+                break;
+        case SPLIT:
+                /*
+                 * Each part chains from the last ciphertext block of the
+                 * part before it.  Collect those now: in place, that part
+                 * may have overwritten them by the time they are wanted.
+                 */
+                s.ivs[0] = iv[0];
+                s.ivs[1] = iv[1];
+                for (part = 1; part < s.nparts; part++) {
+                        first = len * part / s.nparts;
+                        s.ivs[part * 2] = in[first * 2 - 2];
+                        s.ivs[part * 2 + 1] = in[first * 2 - 1];
+                }
+                iv[0] = in[len * 2 - 2];
+                iv[1] = in[len * 2 - 1];
+
+                s.op = GOST_OP_CFBDEC;
+                s.in = in;
+                s.out = out;
+                s.len = len;
+                s.key = key;
+                gostparallel(splitpart, &s, s.nparts);
+                break;
+        }
+        GOST_PROBE1(exit, "cfbdec");
+}
+
+/*
+ * The modes of GOST R 34.13-2015.  A register of z blocks gives z
+ * chains, block i following block i - z, so each turn of a chained
+ * mode takes the next z blocks, one per chain, through the ECB
+ * choice's kernels together: two chains run on gostcrypt2(), four on
+ * gostcrypt4() or the SIMD lanes.  Whatever has no chain to wait for
+ * (CTR, and CBC and CFB decryption, whose inputs are all ciphertext
+ * already there) goes in batches, as gamma and CFB decryption do.
+ *
+ * reg always holds the last z blocks the chains fed back, oldest
+ * first, exactly the standard's shift register after len blocks.
+ */
+#define Z_BATCH GOST_MAXCHUNK   /* Blocks per batch of the unchained modes */
+
+/* Shift n blocks of feedback fb into the register */
+static void
+zshift(word32 *reg, size_t z, word32 const *fb, size_t n)
+{
+        if (n >= z) {
+                memcpy(reg, fb + (n - z) * 2, z * 2 * sizeof(word32));
+        } else {
+                memmove(reg, reg + n * 2, (z - n) * 2 * sizeof(word32));
+                memcpy(reg + (z - n) * 2, fb, n * 2 * sizeof(word32));
+        }
+}
+
+void
+gost3413ctr(word32 const *in, word32 *out, size_t len, word32 iv,
+            unsigned long long pos, word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_GAMMA];
+        word32 ctr[GOST_MAXCHUNK * 2];
+        word32 gamma[GOST_MAXCHUNK * 2];
+        unsigned long long v;
+        size_t n, i;
+
+        GOST_PROBE2(entry, "ctr", len);
+        while (len) {
+                n = len < (size_t)c->chunk ? len : (size_t)c->chunk;
+                GOST_PROBE3(batch, "ctr", n, c->width);
+
+                /* The counter is IV || 0 plus the block number, mod 2^64 */
+                for (i = 0; i < n; i++) {
+                        v = ((unsigned long long)iv << 32) + pos + i;
+                        ctr[i * 2] = (word32)(v & 0xffffffff);
+                        ctr[i * 2 + 1] = (word32)(v >> 32 & 0xffffffff);
+                }
+                ecbblocks(c, ctr, gamma, n, key);
+                for (i = 0; i < n * 2; i++)
+                        out[i] = in[i] ^ gamma[i];
+
+                in += n * 2;
+                out += n * 2;
+                len -= n;
+                pos += n;
+        }
+        GOST_PROBE1(exit, "ctr");
+}
+
+int
+gost3413ofb(word32 const *in, word32 *out, size_t len, word32 *reg, size_t z,
+            word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_ECB];
+        word32 y[GOST_MAXCHUNK * 2];
+        size_t n, i;
+
+        if (z < 1 || z > GOST_MAXCHUNK)
+                return -1;
+        GOST_PROBE2(entry, "ofb3413", len);
+        for (; len; len -= n, in += n * 2, out += n * 2) {
+                n = len < z ? len : z;
+                GOST_PROBE3(batch, "ofb3413", n, c->width);
+                ecbblocks(c, reg, y, n, key);
+                for (i = 0; i < n * 2; i++)
+                        out[i] = in[i] ^ y[i];
+                zshift(reg, z, y, n);
+        }
+        GOST_PROBE1(exit, "ofb3413");
+        return 0;
+}
+
+int
+gost3413cbcencrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                   size_t z, word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_ECB];
+        word32 x[GOST_MAXCHUNK * 2];
+        size_t n, i;
+
+        if (z < 1 || z > GOST_MAXCHUNK)
+                return -1;
+        GOST_PROBE2(entry, "cbcencrypt", len);
+        for (; len; len -= n, in += n * 2, out += n * 2) {
+                n = len < z ? len : z;
+                GOST_PROBE3(batch, "cbcencrypt", n, c->width);
+                for (i = 0; i < n * 2; i++)
+                        x[i] = in[i] ^ reg[i];
+                ecbblocks(c, x, out, n, key);
+                zshift(reg, z, out, n);
+        }
+        GOST_PROBE1(exit, "cbcencrypt");
+        return 0;
+}
+
+int
+gost3413cfbencrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                   size_t z, word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_ECB];
+        word32 g[GOST_MAXCHUNK * 2];
+        size_t n, i;
+
+        if (z < 1 || z > GOST_MAXCHUNK)
+                return -1;
+        GOST_PROBE2(entry, "cfbencrypt3413", len);
+        for (; len; len -= n, in += n * 2, out += n * 2) {
+                n = len < z ? len : z;
+                GOST_PROBE3(batch, "cfbencrypt3413", n, c->width);
+                ecbblocks(c, reg, g, n, key);
+                for (i = 0; i < n * 2; i++)
+                        out[i] = in[i] ^ g[i];
+                zshift(reg, z, out, n);
+        }
+        GOST_PROBE1(exit, "cfbencrypt3413");
+        return 0;
+}
+
+/*
+ * The block z back from block i of a batch starting at in: in the
+ * batch's own copy of its ciphertext, or still in the register.
+ */
+static word32 const *
+zprev(word32 const *reg, size_t z, word32 const *batch, size_t i)
+{
+        return i >= z ? batch + (i - z) * 2 : reg + i * 2;
+}
+
+int
+gost3413cbcdecrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                   size_t z, word32 const key[8])
+{
+        word32 cbuf[Z_BATCH * 2], p[Z_BATCH * 2];
+        word32 const *prev;
+        size_t n, i, k;
+
+        if (z < 1 || z > GOST_MAXCHUNK)
+                return -1;
+        GOST_PROBE2(entry, "cbcdecrypt", len);
+        for (; len; len -= n, in += n * 2, out += n * 2) {
+                n = len < Z_BATCH ? len : Z_BATCH;
+                GOST_PROBE3(batch, "cbcdecrypt", n, 8);
+                /* A copy, since in place the chain is overwritten */
+                memcpy(cbuf, in, n * 2 * sizeof(word32));
+                /* No wide decryption kernels; the inline lanes instead */
+                for (i = 0; i < n; i += k) {
+                        k = n - i < 8 ? n - i : 8;
+                        gostsmall_ecb(cbuf + i * 2, p + i * 2, k, key, 1);
+                }
+                for (i = 0; i < n; i++) {
+                        prev = zprev(reg, z, cbuf, i);
+                        out[i * 2] = p[i * 2] ^ prev[0];
+                        out[i * 2 + 1] = p[i * 2 + 1] ^ prev[1];
+                }
+                zshift(reg, z, cbuf, n);
+        }
+        GOST_PROBE1(exit, "cbcdecrypt");
+        return 0;
+}
+
+int
+gost3413cfbdecrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                   size_t z, word32 const key[8])
+{
+        struct gost_choice const *c = &choices[GOST_OP_CFBDEC];
+        word32 cbuf[Z_BATCH * 2], g[Z_BATCH * 2];
+        size_t n, i;
+
+        if (z < 1 || z > GOST_MAXCHUNK)
+                return -1;
+        GOST_PROBE2(entry, "cfbdecrypt3413", len);
+        for (; len; len -= n, in += n * 2, out += n * 2) {
+                n = len < Z_BATCH ? len : Z_BATCH;
+                GOST_PROBE3(batch, "cfbdecrypt3413", n, c->width);
+                memcpy(cbuf, in, n * 2 * sizeof(word32));
+                /* The first z from the register, the rest from the batch */
+                ecbblocks(c, reg, g, n < z ? n : z, key);
+                if (n > z)
+                        ecbblocks(c, cbuf, g + z * 2, n - z, key);
+                for (i = 0; i < n * 2; i++)
+                        out[i] = cbuf[i] ^ g[i];
+                zshift(reg, z, cbuf, n);
+        }
+        GOST_PROBE1(exit, "cfbdecrypt3413");
+        return 0;
+}
+
+void
+gostprewarm(word32 const key[8])
+{
+        word32 buf[16] = { 0 };
+        word32 iv[2] = { 0, 0 };
+        word32 volatile sink = 0;
+        int i;
+
+        gostwarmtables();
+        for (i = 0; i < 8; i++)
+                sink ^= key[i];
+
+        /* Each op's own kernel, then the scalar and threaded paths */
+        ecbblocks(&choices[GOST_OP_ECB], buf, buf, 8, key);
+        gammablocks(&choices[GOST_OP_GAMMA], buf, buf, 8, iv, 0, key);
+        cfbdecblocks(&choices[GOST_OP_CFBDEC], buf, buf, 8, iv, key);
+        gammascalar(buf, buf, 1, iv, 0, key);
+        if (tunables.threadmin != (size_t)-1)
+                (void)gostpoolidle();
+}
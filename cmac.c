@@ -0,0 +1,202 @@
+/*
+ * The MAC of GOST R 34.13-2015 (section 5.6, OMAC1) over the 32-round
+ * cipher, with the subkeys worked out once per key.
+ *
+ * Bytes go into blocks as the standard writes them, most significant
+ * first: the first four bytes of a block are its high word, in[1].
+ * A message is a chain, one block after another, so a single message
+ * runs on gostcrypt().  Many messages run side by side instead: the
+ * batch keeps CMAC_LANES of them in flight, each under its own key,
+ * and takes all of their next blocks through the rounds together, so
+ * the lanes' table lookups overlap the way gostcrypt4()'s do.
+ */
+#include <string.h>
+
+#include "gost.h"
+#include "gostsmall.h"
+#include "probe.h"
+
+#define CMAC_LANES 8
+#define CMAC_B64 0x1b           /* The constant B_64 of 5.4.1 */
+
+static word32
+load32be(unsigned char const *p)
+{
+        return (word32)p[0] << 24 | (word32)p[1] << 16 | (word32)p[2] << 8 |
+               (word32)p[3];
+}
+
+static void
+store32be(unsigned char *p, word32 x)
+{
+        p[0] = (unsigned char)(x >> 24);
+        p[1] = (unsigned char)(x >> 16);
+        p[2] = (unsigned char)(x >> 8);
+        p[3] = (unsigned char)x;
+}
+
+/* The n bytes at p, padded with a one bit and zeros if n < 8 */
+static void
+loadblock(unsigned char const *p, size_t n, word32 b[2])
+{
+        unsigned char last[8] = { 0 };
+
+        if (n < 8) {
+                if (n)
+                        memcpy(last, p, n);
+                last[n] = 0x80;
+                p = last;
+        }
+        b[1] = load32be(p);
+        b[0] = load32be(p + 4);
+}
+
+/* Shift left one bit, folding in B_64 for the bit shifted out */
+static void
+double64(word32 const in[2], word32 out[2])
+{
+        word32 const carry = in[1] >> 31;
+
+        out[1] = (in[1] << 1 | in[0] >> 31) & 0xffffffff;
+        out[0] = (in[0] << 1 & 0xffffffff) ^ (carry ? CMAC_B64 : 0);
+}
+
+void
+gostcmackey(struct gost_cmackey *ck, word32 const key[8])
+{
+        word32 const zero[2] = { 0, 0 };
+        word32 r[2];
+
+        memcpy(ck->key, key, sizeof(ck->key));
+        gostcrypt(zero, r, key);
+        double64(r, ck->k1);
+        double64(ck->k1, ck->k2);
+}
+
+void
+gostcmacinit(struct gost_cmac *c, struct gost_cmackey const *ck)
+{
+        c->ck = ck;
+        c->c[0] = c->c[1] = 0;
+        c->n = 0;
+}
+
+void
+gostcmacupdate(struct gost_cmac *c, unsigned char const *p, size_t len)
+{
+        word32 b[2];
+        size_t m;
+
+        while (len) {
+                /* A full block is held back until it is known not to be last */
+                if (c->n == 8) {
+                        loadblock(c->buf, 8, b);
+                        b[0] ^= c->c[0];
+                        b[1] ^= c->c[1];
+                        gostcrypt(b, c->c, c->ck->key);
+                        c->n = 0;
+                }
+                if (c->n == 0) {
+                        for (; len > 8; p += 8, len -= 8) {
+                                loadblock(p, 8, b);
+                                b[0] ^= c->c[0];
+                                b[1] ^= c->c[1];
+                                gostcrypt(b, c->c, c->ck->key);
+                        }
+                }
+                m = 8 - c->n < len ? 8 - c->n : len;
+                memcpy(c->buf + c->n, p, m);
+                c->n += (unsigned)m;
+                p += m;
+                len -= m;
+        }
+}
+
+void
+gostcmacfinal(struct gost_cmac const *c, unsigned char mac[8])
+{
+        word32 const *k = c->n == 8 ? c->ck->k1 : c->ck->k2;
+        word32 b[2], t[2];
+
+        loadblock(c->buf, c->n, b);
+        b[0] ^= c->c[0] ^ k[0];
+        b[1] ^= c->c[1] ^ k[1];
+        gostcrypt(b, t, c->ck->key);
+        store32be(mac, t[1]);
+        store32be(mac + 4, t[0]);
+}
+
+void
+gostcmac(struct gost_cmackey const *ck, unsigned char const *p, size_t len,
+         unsigned char mac[8])
+{
+        struct gost_cmac c;
+
+        GOST_PROBE2(entry, "cmac", len);
+        gostcmacinit(&c, ck);
+        gostcmacupdate(&c, p, len);
+        gostcmacfinal(&c, mac);
+        GOST_PROBE1(exit, "cmac");
+}
+
+struct lane {
+        struct gost_cmacjob *job;
+        size_t done;            /* Bytes of the message through the cipher */
+};
+
+void
+gostcmacbatch(struct gost_cmacjob *jobs, size_t njobs)
+{
+        struct lane lane[CMAC_LANES];
+        word32 const *key[CMAC_LANES];
+        word32 n1[CMAC_LANES], n2[CMAC_LANES], b[2];
+        size_t next = 0, n = 0, l;
+
+        GOST_PROBE2(entry, "cmacbatch", njobs);
+        for (;;) {
+                /* Fill empty lanes with fresh messages */
+                while (n < CMAC_LANES && next < njobs) {
+                        lane[n].job = &jobs[next++];
+                        lane[n].done = 0;
+                        n1[n] = n2[n] = 0;
+                        n++;
+                }
+                if (n == 0)
+                        break;
+
+                for (l = 0; l < n; l++) {
+                        struct gost_cmacjob const *j = lane[l].job;
+                        size_t left = j->len - lane[l].done;
+
+                        key[l] = j->ck->key;
+                        loadblock(left ? j->msg + lane[l].done : j->msg,
+                                  left < 8 ? left : 8, b);
+                        n1[l] ^= b[0];
+                        n2[l] ^= b[1];
+                        if (left <= 8) {
+                                word32 const *k = left == 8 ? j->ck->k1 : j->ck->k2;
+
+                                n1[l] ^= k[0];
+                                n2[l] ^= k[1];
+                        }
+                }
+                gostsmall_keyed(n1, n2, key, n);
+
+                /* Retire the messages that are done, keeping the lanes packed */
+                for (l = 0; l < n; ) {
+                        struct gost_cmacjob *j = lane[l].job;
+
+                        if (j->len - lane[l].done > 8) {
+                                lane[l++].done += 8;
+                                continue;
+                        }
+                        store32be(j->mac, n2[l]);
+                        store32be(j->mac + 4, n1[l]);
+                        n--;
+                        lane[l] = lane[n];
+                        n1[l] = n1[n];
+                        n2[l] = n2[n];
+                }
+        }
+        GOST_PROBE1(exit, "cmacbatch");
+}
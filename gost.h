@@ -4,13 +4,37 @@
 /*
  * Shared declarations for the GOST 28147-89 implementation.
  */
-#ifdef __alpha  /* Any other 64-bit machines? */
+#include <limits.h>
+#include <stddef.h>
+
+#define GOST_VERSION "1.2"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The cipher arithmetic relies on word32 being exactly 32 bits wide. */
+#if UINT_MAX == 0xffffffffUL
 typedef unsigned int word32;
 #else
 typedef unsigned long word32;
 #endif
 
+/*
+ * S-box parameter sets.  Row i is the substitution applied to the
+ * i-th 4-bit nibble of the round function input, counting from the lsb.
+ */
+extern unsigned char const gost_sbox_des[8][16];
+extern unsigned char const gost_sbox_tc26_z[8][16];
+
+/* The round function's tables, built by gostsboxinit(); see gostsmall.h */
+extern word32 gost_ftab[4][256];
+
 void kboxinit(void);
+void gostsboxinit(unsigned char const sbox[8][16]);
+unsigned char const (*gostsboxactive(void))[16];
+void gostwarmtables(void);
+void gostflushtables(void);
 void gostcrypt(word32 const in[2], word32 out[2], word32 const key[8]);
 void gostcrypt2(word32 const in[4], word32 out[4], word32 const key[8]);
 void gostcrypt4(word32 const in[8], word32 out[8], word32 const key[8]);
@@ -22,5 +46,418 @@ void gostcfbencrypt(word32 const *in, word32 *out, int len,
 void gostcfbdecrypt(word32 const *in, word32 *out, int len,
                    word32 iv[2], word32 const key[8]);
 void gostmac(word32 const *in, int len, word32 out[2], word32 const key[8]);
+void gostmacchain(word32 const *in, size_t len, word32 mac[2],
+                  word32 const key[8]);
+
+/* The same kernels over the 1 KiB byte tables instead of T0..T3 */
+void gostcryptb(word32 const in[2], word32 out[2], word32 const key[8]);
+void gostcrypt2b(word32 const in[4], word32 out[4], word32 const key[8]);
+void gostcrypt4b(word32 const in[8], word32 out[8], word32 const key[8]);
+
+/*
+ * Four blocks in SIMD lanes (SSSE3), and eight with four of them in
+ * SIMD lanes and four on the word tables.  gostsimd() is 0 when the
+ * CPU cannot run them, and they fall back to gostcrypt4().
+ */
+void gostcrypt4s(word32 const in[8], word32 out[8], word32 const key[8]);
+void gostcrypt8h(word32 const in[16], word32 out[16], word32 const key[8]);
+int gostsimd(void);
+
+/*
+ * Bulk operations.  These produce exactly what the block-at-a-time
+ * functions above do, but through whichever kernel the dispatcher has
+ * been configured with.  len is in blocks.
+ *
+ * gostgamma() is gostofb() started at block pos of the stream, so a
+ * stream can be processed in pieces, out of order or in parallel.
+ * gostcfbdec() is gostcfbdecrypt(); each gamma block depends only on
+ * ciphertext, so it runs on wide kernels too.
+ */
+void gostecb(word32 const *in, word32 *out, size_t len, word32 const key[8]);
+void gostgamma(word32 const *in, word32 *out, size_t len, word32 const iv[2],
+               unsigned long long pos, word32 const key[8]);
+void gostcfbdec(word32 const *in, word32 *out, size_t len, word32 iv[2],
+                word32 const key[8]);
+
+/*
+ * gostgamma() over many buffers under one key in a single call, for
+ * servers with a few blocks from each of many streams.  The counter
+ * blocks of all of them are batched together, so short buffers still
+ * fill the wide kernels.  Buffers must not overlap one another.
+ */
+struct gost_gammavec {
+        word32 const *in;
+        word32 *out;
+        size_t len;                     /* Blocks */
+        word32 const *iv;
+        unsigned long long pos;         /* Block of the stream in[0] is at */
+};
+
+void gostgammav(struct gost_gammavec const *v, size_t n, word32 const key[8]);
+
+/*
+ * The modes of GOST R 34.13-2015, in whole blocks as above.
+ * gost3413ctr() is CTR from the 32-bit iv, started at block pos.  The
+ * others take a register reg of z blocks (2z words, the standard's m =
+ * z·n bits, first block first), which they update so that a message
+ * can go in pieces; z chains run side by side, so z of 2 or more fills
+ * the multi-block kernels even within one message.  CFB feeds back
+ * whole blocks (s = n).  These return 0, or -1 if z is 0 or above
+ * GOST_MAXCHUNK.
+ */
+void gost3413ctr(word32 const *in, word32 *out, size_t len, word32 iv,
+                 unsigned long long pos, word32 const key[8]);
+int gost3413ofb(word32 const *in, word32 *out, size_t len, word32 *reg,
+                size_t z, word32 const key[8]);
+int gost3413cbcencrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                       size_t z, word32 const key[8]);
+int gost3413cbcdecrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                       size_t z, word32 const key[8]);
+int gost3413cfbencrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                       size_t z, word32 const key[8]);
+int gost3413cfbdecrypt(word32 const *in, word32 *out, size_t len, word32 *reg,
+                       size_t z, word32 const key[8]);
+
+/* Operations the dispatcher selects a kernel for */
+enum gost_op { GOST_OP_ECB, GOST_OP_GAMMA, GOST_OP_CFBDEC, GOST_NOPS };
+
+/* Table tiers */
+enum gost_tier {
+        GOST_TIER_WORD, GOST_TIER_BYTE, GOST_TIER_SIMD, GOST_TIER_HYBRID,
+        GOST_NTIERS
+};
+
+#define GOST_MAXCHUNK 256       /* Largest batch the modes buffer, in blocks */
+
+struct gost_choice {
+        int width;      /* Blocks per kernel call: 1, 2, 4, or 8 for hybrid */
+        int tier;       /* enum gost_tier */
+        int chunk;      /* Blocks per batch in gamma and CFB, <= GOST_MAXCHUNK */
+};
+
+char const *gostopname(int op);
+void gostgetchoice(int op, struct gost_choice *c);
+int gostsetchoice(int op, struct gost_choice const *c);
+
+/*
+ * The planner inside gostecb(), gostgamma() and gostcfbdec() picks a
+ * strategy per call from its size: up to scalarmax blocks go straight
+ * through gostcrypt(); from threadmin blocks the work is split across
+ * the thread pool, no part smaller than grain blocks and no more parts
+ * than there are idle threads; everything between runs the dispatched
+ * kernel on the calling thread.  gostautotune() calibrates all but
+ * threads.  Set these before starting any bulk work; changing threads
+ * restarts the pool.
+ */
+struct gost_tunables {
+        size_t scalarmax;
+        size_t threadmin;
+        size_t grain;
+        int threads;            /* Pool size, counting the caller; 0 for one per CPU */
+};
+
+void gostgettunables(struct gost_tunables *t);
+int gostsettunables(struct gost_tunables const *t);
+
+/*
+ * Get ready for traffic under key before it arrives: bring the tables
+ * and key into cache, run every dispatched kernel once so its code is
+ * paged in, and start the pool if the planner would use it.
+ */
+void gostprewarm(word32 const key[8]);
+
+/*
+ * The pool itself.  gostparallel() runs fn(arg, part) for every part
+ * below nparts, on the workers and the calling thread, and returns
+ * when all are done.  gostpoolidle() is how many workers have nothing
+ * to do.  gostpoolstop() joins the workers; nothing may be running.
+ */
+#define GOST_MAXPARTS 256
+
+void gostparallel(void (*fn)(void *arg, size_t part), void *arg, size_t nparts);
+int gostpoolthreads(void);
+int gostpoolidle(void);
+void gostpoolstop(void);
+
+/*
+ * A byte stream in gamma or CFB mode, optionally with the MAC of the
+ * plaintext, whose whole state can be saved and restored so that a
+ * long job can checkpoint and later resume exactly where it stopped.
+ * goststream() takes any number of bytes, in place if need be, and
+ * goststreammac() gives the MAC so far with the last block zero-padded,
+ * little-endian as gost.hpp writes it.  goststreamseek() moves a gamma
+ * stream without a MAC to byte pos, and is -1 for any other stream.
+ *
+ * goststreamsave() writes GOST_STATESIZE bytes: a version, the mode,
+ * the position, the IV or CFB register, the MAC chaining value and the
+ * partial block, in little-endian order, then a MAC of all that under
+ * the key.  The key itself is never saved.  goststreamload() returns
+ * 0, or -1 and leaves s alone for a state of another version, a
+ * damaged one, or one saved under another key.
+ */
+enum gost_mode { GOST_MODE_GAMMA, GOST_MODE_CFB };
+
+#define GOST_STREAM_DECRYPT     1
+#define GOST_STREAM_MAC         2
+
+#define GOST_STATEVERSION 1
+#define GOST_STATESIZE 52
+
+struct gost_stream {
+        int mode;               /* enum gost_mode */
+        int flags;              /* GOST_STREAM_* */
+        unsigned long long pos; /* Bytes processed */
+        word32 iv[2];           /* Gamma: the IV; CFB: the feedback register */
+        word32 mac[2];          /* MAC chaining value */
+        unsigned char part[8];  /* Plaintext of the partial block, for the MAC */
+        unsigned char held[8];  /* CFB: ciphertext of the partial block */
+        unsigned char gamma[8]; /* Gamma of the partial block; not saved */
+};
+
+void goststreaminit(struct gost_stream *s, int mode, int flags,
+                    word32 const iv[2]);
+void goststream(struct gost_stream *s, unsigned char const *in,
+                unsigned char *out, size_t len, word32 const key[8]);
+void goststreammac(struct gost_stream const *s, unsigned char mac[8],
+                   word32 const key[8]);
+int goststreamseek(struct gost_stream *s, unsigned long long pos,
+                   word32 const key[8]);
+void goststreamsave(struct gost_stream const *s,
+                    unsigned char out[GOST_STATESIZE], word32 const key[8]);
+int goststreamload(struct gost_stream *s,
+                   unsigned char const in[GOST_STATESIZE], word32 const key[8]);
+
+/*
+ * Key rotation in one pass: decrypt len bytes under from (which must
+ * have GOST_STREAM_DECRYPT) and encrypt the plaintext again under to,
+ * in place if need be.  The work goes a cache-sized tile at a time, so
+ * each tile is read from memory once and written once, and the
+ * plaintext never leaves the cache.  Either stream may MAC, and both
+ * can be saved and restored between calls as usual.
+ */
+void goststreamrecrypt(struct gost_stream *from, word32 const fromkey[8],
+                       struct gost_stream *to, word32 const tokey[8],
+                       unsigned char const *in, unsigned char *out, size_t len);
+
+/*
+ * One gamma stream written by many threads at once.  Each writer takes
+ * the next len bytes of the stream with gostsharedreserve(), a single
+ * atomic add, and encrypts its data for that position on its own with
+ * gostsharedcrypt(); gostsharedwrite() does both and returns the
+ * position, where the caller then puts out[].  Writers whose ranges
+ * share a block each compute its gamma, so ranges need not be whole
+ * blocks and there is no lock anywhere.  gostsharedcrypt() also
+ * decrypts any range, and gostsharedtell() is the length so far.
+ */
+struct gost_shared;
+
+struct gost_shared *gostsharednew(word32 const iv[2], word32 const key[8]);
+void gostsharedfree(struct gost_shared *sh);
+unsigned long long gostsharedreserve(struct gost_shared *sh, size_t len);
+unsigned long long gostsharedtell(struct gost_shared *sh);
+void gostsharedcrypt(struct gost_shared const *sh, unsigned char const *in,
+                     unsigned char *out, size_t len, unsigned long long pos);
+unsigned long long gostsharedwrite(struct gost_shared *sh,
+                                   unsigned char const *in,
+                                   unsigned char *out, size_t len);
+
+/*
+ * A large encrypted object cut into chunks of chunk bytes (a multiple
+ * of 8), each with its own MAC, under a tree of MACs whose root covers
+ * the whole object.  gostobjectseal() encrypts size bytes of plain into
+ * cipher and builds the tree.  gostobjectupdate() writes len bytes of
+ * data at off: it checks, decrypts and re-encrypts only the chunks
+ * holding them, a generation on so no gamma is reused, and recomputes
+ * only their tags and the nodes above.  Each generation's gamma starts
+ * from an IV derived from the object's IV and the generation under the
+ * key, so objects under one key need only distinct IVs, sequential or
+ * not; no IV may be shared by two objects, or by an object and a
+ * stream, under the same key.  The caller then writes back
+ * those chunks of cipher and of the metadata.  gostobjectread()
+ * decrypts a range, checking each chunk it reads.  Both return 0, or
+ * -1 for a range outside the object, a chunk that fails its check (and
+ * then update changes nothing), or no memory.
+ *
+ * gostobjectmeta() is the metadata to be stored beside the ciphertext,
+ * nwords words in host order: the generation of each chunk, then the
+ * tree as pairs of words, node 1 the root and node n's children 2n and
+ * 2n+1, leaves from the first power of two at or above the number of
+ * chunks.  gostobjectopen() takes it back, and is NULL if the tree does
+ * not match its leaves; the caller compares gostobjectroot() with a
+ * root it trusts.
+ */
+struct gost_object;
+
+struct gost_object *gostobjectseal(unsigned char const *plain,
+                                   unsigned char *cipher,
+                                   unsigned long long size, size_t chunk,
+                                   word32 const iv[2], word32 const key[8]);
+struct gost_object *gostobjectopen(word32 const *meta, unsigned long long size,
+                                   size_t chunk, word32 const iv[2],
+                                   word32 const key[8]);
+void gostobjectfree(struct gost_object *o);
+int gostobjectupdate(struct gost_object *o, unsigned char *cipher,
+                     unsigned long long off, unsigned char const *data,
+                     size_t len);
+int gostobjectread(struct gost_object const *o, unsigned char const *cipher,
+                   unsigned long long off, unsigned char *out, size_t len);
+word32 const *gostobjectmeta(struct gost_object const *o, size_t *nwords);
+void gostobjectroot(struct gost_object const *o, word32 root[2]);
+
+/*
+ * The MAC of GOST R 34.13-2015 (CMAC, over the 32-round cipher), as the
+ * newer protocols use in place of gostmac().  Messages are bytes and
+ * the MAC is 8 bytes, in the standard's order, most significant first;
+ * a shorter MAC is its first bytes.  gostcmackey() works out the
+ * subkeys K1 and K2 once, for every message under that key after.
+ * gostcmacinit(), gostcmacupdate() and gostcmacfinal() take a message
+ * in pieces, and gostcmac() all at once.  gostcmacbatch() does many
+ * messages, under one key or many, several at a time through the
+ * rounds together; it is the cheap way to check a lot of short ones.
+ */
+struct gost_cmackey {
+        word32 key[8];
+        word32 k1[2], k2[2];
+};
+
+struct gost_cmac {
+        struct gost_cmackey const *ck;
+        word32 c[2];                    /* The chain so far */
+        unsigned char buf[8];           /* The last block, held back */
+        unsigned n;                     /* Bytes in buf */
+};
+
+struct gost_cmacjob {
+        struct gost_cmackey const *ck;
+        unsigned char const *msg;
+        size_t len;
+        unsigned char mac[8];           /* Out */
+};
+
+void gostcmackey(struct gost_cmackey *ck, word32 const key[8]);
+void gostcmacinit(struct gost_cmac *c, struct gost_cmackey const *ck);
+void gostcmacupdate(struct gost_cmac *c, unsigned char const *p, size_t len);
+void gostcmacfinal(struct gost_cmac const *c, unsigned char mac[8]);
+void gostcmac(struct gost_cmackey const *ck, unsigned char const *p, size_t len,
+              unsigned char mac[8]);
+void gostcmacbatch(struct gost_cmacjob *jobs, size_t njobs);
+
+/*
+ * A read-only view of a file of gamma ciphertext, as gost_file writes
+ * it without a MAC, that decrypts each page the first time it is read.
+ * Mapping costs the same whatever the size of the file; a fault fills
+ * its page and up to readahead - 1 absent pages after it (0 for the
+ * default) in one batch.  Faults go to a thread by userfaultfd where
+ * the kernel allows it, or else to a SIGSEGV handler, which chains
+ * faults outside these views, and writes to them, to the handler it
+ * replaced; the flag GOST_LAZY_SIGNALS asks for the handler.  The view
+ * is a copy: later writes to the file are not seen in pages already
+ * read.  Bytes the file cannot supply read as zeros and count as
+ * errors in gostlazystats(), beside the pages filled so far.  The
+ * descriptor is duplicated and may be closed once mapped.  What
+ * gost_file -S writes is not such a file: its holes are plaintext, and
+ * read here as gamma.
+ */
+#define GOST_LAZY_SIGNALS 1
+
+struct gost_lazymap;
+
+struct gost_lazymap *gostlazymap(int fd, word32 const iv[2], word32 const key[8],
+                                 size_t readahead, int flags);
+void const *gostlazyaddr(struct gost_lazymap const *m);
+unsigned long long gostlazysize(struct gost_lazymap const *m);
+void gostlazystats(struct gost_lazymap const *m, size_t *filled, size_t *errors);
+void gostlazyunmap(struct gost_lazymap *m);
+
+/*
+ * A bounded cache of decrypted pages of gamma-encrypted objects, keyed
+ * by (object, page), for readers that come back to the same pages.
+ * pages frames of pagesize bytes (a multiple of 8) are split evenly,
+ * rounding up, among shards, each locked apart; eviction is CLOCK
+ * over unpinned frames.
+ * On a miss the cache calls read() for the page's ciphertext, which
+ * fills all pagesize bytes at buf and sets the object's IV, returning
+ * 0, or -1 on failure; page p is then the gamma at block p * pagesize
+ * / 8 under the object's IV and the cache's key.  Misses from many
+ * threads are gathered and decrypted together in one batch.
+ *
+ * gostcacheget() returns the page pinned: it stays valid and in place
+ * until gostcacherelease() with the same pointer.  It is NULL with
+ * errno EBUSY if every frame of the shard is pinned, or EIO if read()
+ * failed.  gostcacheinvalidate() drops a page after its ciphertext
+ * changes; holders keep the old contents until they release it.
+ */
+typedef int (*gost_cacheread)(void *arg, unsigned long long object,
+                              unsigned long long page, unsigned char *buf,
+                              word32 iv[2]);
+
+struct gost_cachestats {
+        unsigned long long hits, misses, evictions;
+        unsigned long long batches;     /* Fills, each of one or more misses */
+        unsigned long long failures;    /* Pages read() could not supply */
+};
+
+struct gost_cache;
+
+struct gost_cache *gostcachenew(size_t pagesize, size_t pages, size_t shards,
+                                gost_cacheread read, void *arg,
+                                word32 const key[8]);
+void gostcachefree(struct gost_cache *c);
+unsigned char const *gostcacheget(struct gost_cache *c, unsigned long long object,
+                                  unsigned long long page);
+void gostcacherelease(struct gost_cache *c, unsigned char const *p);
+void gostcacheinvalidate(struct gost_cache *c, unsigned long long object,
+                         unsigned long long page);
+void gostcachestats(struct gost_cache *c, struct gost_cachestats *st);
+
+/*
+ * A table of gamma stream sessions, for servers holding very many of
+ * them: each session is a row of a few arrays (key, IV, position, and
+ * with GOST_STREAM_MAC the MAC state) instead of a gost_stream and key
+ * apiece, which is what gostsessionsbytes() reports.  flags are those
+ * of goststreaminit() and hold for every session in the table.
+ * gostsessionopen() returns an id, or (size_t)-1 if the table is full;
+ * gostsessionclose() wipes the key and frees the id, or returns -1 and
+ * does nothing if the id is not open, out of range or already closed.
+ * Other calls take only open ids and do not check them.
+ *
+ * gostsessionscrypt() runs a batch of requests, each len bytes of one
+ * session, in order; a session may appear more than once.  The short
+ * ones are gathered block by block into lanes, each under its own
+ * session's key, and run through the rounds together.  Each session
+ * gives exactly what goststream() would, and gostsessionmac() the MAC
+ * goststreammac() would.
+ */
+struct gost_sessionop {
+        size_t id;
+        unsigned char const *in;
+        unsigned char *out;
+        size_t len;
+};
+
+struct gost_sessions;
+
+struct gost_sessions *gostsessionsnew(size_t capacity, int flags);
+void gostsessionsfree(struct gost_sessions *t);
+size_t gostsessionopen(struct gost_sessions *t, word32 const key[8],
+                       word32 const iv[2]);
+int gostsessionclose(struct gost_sessions *t, size_t id);
+void gostsessionscrypt(struct gost_sessions *t, struct gost_sessionop const *ops,
+                       size_t nops);
+void gostsessionmac(struct gost_sessions const *t, size_t id, unsigned char mac[8]);
+unsigned long long gostsessiontell(struct gost_sessions const *t, size_t id);
+size_t gostsessionsbytes(struct gost_sessions const *t);
+
+/*
+ * Load the fastest choices and the planner calibration for this CPU
+ * from the cache file, or benchmark the candidates and write the cache
+ * if it has none for this CPU and library version.  Returns 1 if it tuned, 0 if it used the
+ * cache, -1 if it tuned but could not write the cache.
+ */
+int gostautotune(char const *cachepath);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* GOST_H */
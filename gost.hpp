@@ -0,0 +1,798 @@
+#ifndef GOST_HPP
+#define GOST_HPP
+
+/*
+ * C++20 interface to the GOST 28147-89 code.
+ *
+ * Contexts and streams are move-only values that own their key and
+ * wipe it when destroyed or moved from; only cryptbuf allocates, for
+ * its buffer.
+ * Buffers are spans of std::byte.  The mode and parameter set are
+ * template parameters, so every call resolves at compile time to the
+ * C function for it, with no virtual dispatch.
+ *
+ * Bytes map onto blocks little-endian, as the standard does: byte 0 is
+ * the low byte of in[0].  On a little-endian host the C functions work
+ * on the caller's buffers directly when they are word aligned; anything
+ * else is staged through a small buffer on the stack.
+ */
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <climits>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+
+#include "gost.h"
+
+namespace gost {
+
+inline constexpr std::size_t block_size = 8;
+inline constexpr std::size_t key_size = 32;
+
+using bytes = std::span<std::byte>;
+using const_bytes = std::span<std::byte const>;
+using block = std::array<std::byte, block_size>;
+
+/* Parameter sets: the S-boxes the tables are built from */
+namespace params {
+struct des {
+        static auto sbox() noexcept { return gost_sbox_des; }
+};
+struct tc26_z {
+        static auto sbox() noexcept { return gost_sbox_tc26_z; }
+};
+} // namespace params
+
+/* Stream modes */
+namespace mode {
+struct gamma {};        /* gostofb()/gostgamma(); seekable */
+struct cfb {};          /* gostcfbencrypt()/gostcfbdec() */
+} // namespace mode
+
+namespace detail {
+
+inline word32 load32(std::byte const *p) noexcept
+{
+        return (word32)p[0] | (word32)p[1] << 8 |
+               (word32)p[2] << 16 | (word32)p[3] << 24;
+}
+
+inline void store32(std::byte *p, word32 v) noexcept
+{
+        p[0] = std::byte(v);
+        p[1] = std::byte(v >> 8);
+        p[2] = std::byte(v >> 16);
+        p[3] = std::byte(v >> 24);
+}
+
+/*
+ * The tables are global, so only one parameter set can be in use at a
+ * time.  The first context builds them; a context for a different set
+ * while they are in use is a programming error.
+ */
+template <class Params>
+void use_params()
+{
+        auto active = gostsboxactive();
+
+        if (active == Params::sbox())
+                return;
+        if (active != nullptr)
+                throw std::logic_error("gost: another parameter set is in use");
+        gostsboxinit(Params::sbox());
+}
+
+inline bool direct(void const *p) noexcept
+{
+        return std::endian::native == std::endian::little &&
+               reinterpret_cast<std::uintptr_t>(p) % alignof(word32) == 0;
+}
+
+inline constexpr std::size_t stage_blocks = 64;         /* 512 bytes of stack */
+inline constexpr std::size_t max_call = INT_MAX / 2;    /* For the int len calls */
+
+/*
+ * Run fn(in, out, n, done) over the whole blocks of in and out, where
+ * done counts the blocks already handled.  in and out may be the same.
+ */
+template <class F>
+void for_blocks(std::byte const *in, std::byte *out, std::size_t n, F &&fn)
+{
+        std::size_t done = 0, m;
+
+        if (direct(in) && direct(out)) {
+                for (; done < n; done += m) {
+                        m = std::min(n - done, max_call);
+                        fn(reinterpret_cast<word32 const *>(in + done * block_size),
+                           reinterpret_cast<word32 *>(out + done * block_size),
+                           m, done);
+                }
+                return;
+        }
+
+        word32 stage[stage_blocks * 2];
+        for (; done < n; done += m) {
+                m = std::min(n - done, stage_blocks);
+                for (std::size_t i = 0; i < m * 2; i++)
+                        stage[i] = load32(in + done * block_size + i * 4);
+                fn(stage, stage, m, done);
+                for (std::size_t i = 0; i < m * 2; i++)
+                        store32(out + done * block_size + i * 4, stage[i]);
+        }
+}
+
+inline void check_sizes(const_bytes in, bytes out)
+{
+        if (out.size() < in.size())
+                throw std::length_error("gost: output shorter than input");
+}
+
+template <class T, std::size_t N>
+void wipe(T (&a)[N]) noexcept
+{
+        T volatile *p = a;
+        for (std::size_t i = 0; i < N; i++)
+                p[i] = T();
+}
+
+} // namespace detail
+
+template <class Params> class context;
+
+/*
+ * gostmac() over a message that arrives in pieces, zero-padding the
+ * last block as context::mac() does.
+ */
+template <class Params = params::des>
+class mac_stream {
+public:
+        explicit mac_stream(context<Params> const &ctx)
+        {
+                std::copy(ctx.key(), ctx.key() + 8, key_);
+        }
+
+        mac_stream(mac_stream const &) = delete;
+        mac_stream &operator=(mac_stream const &) = delete;
+
+        ~mac_stream()
+        {
+                detail::wipe(key_);
+                detail::wipe(mac_);
+                detail::wipe(held_);
+        }
+
+        void update(const_bytes in)
+        {
+                std::byte const *p = in.data();
+                std::size_t n = in.size(), m;
+
+                for (; n && held_n_; n--) {
+                        held_[held_n_++] = *p++;
+                        if (held_n_ == block_size) {
+                                chain(held_, 1);
+                                held_n_ = 0;
+                        }
+                }
+                chain(p, n / block_size);
+                p += n / block_size * block_size;
+                for (m = n % block_size; m; m--)
+                        held_[held_n_++] = *p++;
+        }
+
+        std::array<std::byte, block_size> finish()
+        {
+                std::array<std::byte, block_size> out;
+
+                if (held_n_) {
+                        std::fill(held_ + held_n_, held_ + block_size, std::byte(0));
+                        chain(held_, 1);
+                        held_n_ = 0;
+                }
+                detail::store32(out.data(), mac_[0]);
+                detail::store32(out.data() + 4, mac_[1]);
+                return out;
+        }
+
+private:
+        void chain(std::byte const *p, std::size_t n)
+        {
+                word32 stage[detail::stage_blocks * 2];
+                std::size_t m;
+
+                if (detail::direct(p)) {
+                        gostmacchain(reinterpret_cast<word32 const *>(p), n, mac_, key_);
+                        return;
+                }
+                for (; n; n -= m, p += m * block_size) {
+                        m = std::min(n, detail::stage_blocks);
+                        for (std::size_t i = 0; i < m * 2; i++)
+                                stage[i] = detail::load32(p + i * 4);
+                        gostmacchain(stage, m, mac_, key_);
+                }
+        }
+
+        word32 key_[8];
+        word32 mac_[2] = { 0, 0 };
+        std::byte held_[block_size];
+        std::size_t held_n_ = 0;
+};
+
+/*
+ * A key under one parameter set.  encrypt() and decrypt() are ECB over
+ * whole blocks; mac() is gostmac() with the last block zero-padded.
+ */
+template <class Params = params::des>
+class context {
+public:
+        using params_type = Params;
+
+        explicit context(std::span<std::byte const, key_size> key)
+        {
+                detail::use_params<Params>();
+                for (std::size_t i = 0; i < 8; i++)
+                        key_[i] = detail::load32(key.data() + i * 4);
+        }
+
+        explicit context(word32 const (&key)[8])
+        {
+                detail::use_params<Params>();
+                std::copy(key, key + 8, key_);
+        }
+
+        context(context &&other) noexcept
+        {
+                std::copy(other.key_, other.key_ + 8, key_);
+                detail::wipe(other.key_);
+        }
+
+        context &operator=(context &&other) noexcept
+        {
+                if (this != &other) {
+                        std::copy(other.key_, other.key_ + 8, key_);
+                        detail::wipe(other.key_);
+                }
+                return *this;
+        }
+
+        context(context const &) = delete;
+        context &operator=(context const &) = delete;
+
+        ~context() { detail::wipe(key_); }
+
+        void encrypt(const_bytes in, bytes out) const
+        {
+                check_blocks(in, out);
+                detail::for_blocks(in.data(), out.data(), in.size() / block_size,
+                        [this](word32 const *i, word32 *o, std::size_t n, std::size_t) {
+                                gostecb(i, o, n, key_);
+                        });
+        }
+
+        void decrypt(const_bytes in, bytes out) const
+        {
+                check_blocks(in, out);
+                detail::for_blocks(in.data(), out.data(), in.size() / block_size,
+                        [this](word32 const *i, word32 *o, std::size_t n, std::size_t) {
+                                for (std::size_t b = 0; b < n; b++)
+                                        gostdecrypt(i + b * 2, o + b * 2, key_);
+                        });
+        }
+
+        std::array<std::byte, block_size> mac(const_bytes in) const
+        {
+                mac_stream<Params> m(*this);
+
+                m.update(in);
+                return m.finish();
+        }
+
+        word32 const *key() const noexcept { return key_; }
+
+private:
+        static void check_blocks(const_bytes in, bytes out)
+        {
+                detail::check_sizes(in, out);
+                if (in.size() % block_size)
+                        throw std::length_error("gost: ECB needs whole blocks");
+        }
+
+        word32 key_[8];
+};
+
+/*
+ * An encryption or decryption stream in one mode.  It takes its own
+ * copy of the key, so it does not depend on the context outliving it.
+ * Any number of bytes may go through each call; partial blocks carry
+ * over to the next.  Gamma streams can seek to any byte offset.
+ */
+template <class Mode, class Params = params::des>
+class stream {
+        static_assert(std::same_as<Mode, mode::gamma> || std::same_as<Mode, mode::cfb>,
+                      "gost::stream mode must be mode::gamma or mode::cfb");
+
+public:
+        using mode_type = Mode;
+        using params_type = Params;
+
+        stream(context<Params> const &ctx, std::span<std::byte const, block_size> iv)
+        {
+                std::copy(ctx.key(), ctx.key() + 8, key_);
+                iv_[0] = detail::load32(iv.data());
+                iv_[1] = detail::load32(iv.data() + 4);
+                reg_[0] = iv_[0];
+                reg_[1] = iv_[1];
+        }
+
+        stream(stream &&other) noexcept { take(other); }
+
+        stream &operator=(stream &&other) noexcept
+        {
+                if (this != &other)
+                        take(other);
+                return *this;
+        }
+
+        stream(stream const &) = delete;
+        stream &operator=(stream const &) = delete;
+
+        ~stream() { clear(); }
+
+        void encrypt(const_bytes in, bytes out) { run(in, out, false); }
+        void decrypt(const_bytes in, bytes out) { run(in, out, true); }
+
+        /* Bytes processed so far, or the offset sought to */
+        std::uint64_t tell() const noexcept { return pos_; }
+
+        void seek(std::uint64_t offset) noexcept
+                requires std::same_as<Mode, mode::gamma>
+        {
+                pos_ = offset;
+                if (pos_ % block_size)
+                        refill();
+        }
+
+private:
+        void take(stream &other) noexcept
+        {
+                std::copy(other.key_, other.key_ + 8, key_);
+                std::copy(other.iv_, other.iv_ + 2, iv_);
+                std::copy(other.reg_, other.reg_ + 2, reg_);
+                std::copy(other.gamma_, other.gamma_ + block_size, gamma_);
+                std::copy(other.held_, other.held_ + block_size, held_);
+                pos_ = other.pos_;
+                other.clear();
+        }
+
+        void clear() noexcept
+        {
+                detail::wipe(key_);
+                detail::wipe(iv_);
+                detail::wipe(reg_);
+                detail::wipe(gamma_);
+                detail::wipe(held_);
+        }
+
+        /* Gamma for the block holding pos_, for finishing a partial block */
+        void refill() noexcept
+        {
+                word32 g[2] = { 0, 0 };
+
+                if constexpr (std::same_as<Mode, mode::gamma>)
+                        gostgamma(g, g, 1, iv_, pos_ / block_size, key_);
+                else
+                        gostcrypt(reg_, g, key_);
+                detail::store32(gamma_, g[0]);
+                detail::store32(gamma_ + 4, g[1]);
+        }
+
+        /* One byte of a partial block */
+        std::byte step(std::byte x, bool decrypt) noexcept
+        {
+                std::size_t o = pos_ % block_size;
+                std::byte y;
+
+                if (o == 0)
+                        refill();
+                y = x ^ gamma_[o];
+                if constexpr (std::same_as<Mode, mode::cfb>) {
+                        held_[o] = decrypt ? x : y;
+                        if (o == block_size - 1) {
+                                reg_[0] = detail::load32(held_);
+                                reg_[1] = detail::load32(held_ + 4);
+                        }
+                }
+                pos_++;
+                return y;
+        }
+
+        void run(const_bytes in, bytes out, bool decrypt)
+        {
+                std::byte const *i = in.data();
+                std::byte *o = out.data();
+                std::size_t n = in.size(), whole;
+
+                detail::check_sizes(in, out);
+
+                for (; n && pos_ % block_size; n--)
+                        *o++ = step(*i++, decrypt);
+
+                whole = n / block_size;
+                detail::for_blocks(i, o, whole,
+                        [this, decrypt](word32 const *bi, word32 *bo, std::size_t m,
+                                        std::size_t done) {
+                                if constexpr (std::same_as<Mode, mode::gamma>) {
+                                        (void)decrypt;
+                                        gostgamma(bi, bo, m, iv_,
+                                                  pos_ / block_size + done, key_);
+                                } else if (decrypt) {
+                                        gostcfbdec(bi, bo, m, reg_, key_);
+                                } else {
+                                        gostcfbencrypt(bi, bo, (int)m, reg_, key_);
+                                }
+                        });
+                pos_ += whole * block_size;
+                i += whole * block_size;
+                o += whole * block_size;
+                n -= whole * block_size;
+
+                for (; n; n--)
+                        *o++ = step(*i++, decrypt);
+        }
+
+        word32 key_[8];
+        word32 iv_[2];          /* Gamma: the IV everything is relative to */
+        word32 reg_[2];         /* CFB: the feedback register */
+        std::byte gamma_[block_size];   /* Gamma of the current partial block */
+        std::byte held_[block_size];    /* CFB: ciphertext of that block so far */
+        std::uint64_t pos_ = 0;
+};
+
+/*
+ * The gamma keystream as an endless random-access range of bytes, or
+ * of blocks with T = block, computed as it is read.  Each iterator keeps
+ * a small batch: reading on from it fills the next batch with one call
+ * to the bulk code, and jumping elsewhere costs one block, reached by
+ * counter seek.  Iterators point into the view, so it must outlive
+ * them; they are for one thread each, as they update the batch.
+ * Start part way with begin() + n: on an endless range views::drop
+ * can only step there one element at a time.
+ *
+ *      gost::keystream_view ks(ctx, iv);
+ *      std::ranges::transform(data, ks.begin(), data.begin(), std::bit_xor<>());
+ */
+template <class Params = params::des, class T = std::byte>
+class keystream_view : public std::ranges::view_interface<keystream_view<Params, T>> {
+        static_assert(std::same_as<T, std::byte> || std::same_as<T, block>,
+                      "gost::keystream_view yields std::byte or gost::block");
+
+public:
+        class iterator;
+
+        keystream_view() = default;
+
+        keystream_view(context<Params> const &ctx,
+                       std::span<std::byte const, block_size> iv)
+        {
+                std::copy(ctx.key(), ctx.key() + 8, key_);
+                iv_[0] = detail::load32(iv.data());
+                iv_[1] = detail::load32(iv.data() + 4);
+        }
+
+        /* Copyable, as views passed to adaptors by name are copied */
+        keystream_view(keystream_view const &other) noexcept { copy(other); }
+        keystream_view(keystream_view &&other) noexcept
+        {
+                copy(other);
+                other.clear();
+        }
+
+        keystream_view &operator=(keystream_view const &other) noexcept
+        {
+                copy(other);
+                return *this;
+        }
+
+        keystream_view &operator=(keystream_view &&other) noexcept
+        {
+                if (this != &other) {
+                        copy(other);
+                        other.clear();
+                }
+                return *this;
+        }
+
+        ~keystream_view() { clear(); }
+
+        iterator begin() const noexcept { return iterator(this, 0); }
+        std::unreachable_sentinel_t end() const noexcept { return {}; }
+
+private:
+        void copy(keystream_view const &other) noexcept
+        {
+                std::copy(other.key_, other.key_ + 8, key_);
+                std::copy(other.iv_, other.iv_ + 2, iv_);
+        }
+
+        void clear() noexcept
+        {
+                detail::wipe(key_);
+                detail::wipe(iv_);
+        }
+
+        word32 key_[8] = {};
+        word32 iv_[2] = {};
+};
+
+template <class Params>
+keystream_view(context<Params> const &, std::span<std::byte const, block_size>)
+        -> keystream_view<Params>;
+
+template <class Params, class T>
+class keystream_view<Params, T>::iterator {
+public:
+        using iterator_concept = std::random_access_iterator_tag;
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        T operator*() const
+        {
+                std::uint64_t at = pos_ * sizeof(T);
+                T v;
+
+                if (at < base_ || at + sizeof(T) > base_ + len_)
+                        fill(at);
+                if constexpr (std::same_as<T, std::byte>)
+                        v = cache_[at - base_];
+                else
+                        std::copy_n(cache_ + (at - base_), block_size, v.data());
+                return v;
+        }
+
+        T operator[](difference_type n) const { return *(*this + n); }
+
+        iterator &operator++() noexcept { ++pos_; return *this; }
+        iterator &operator--() noexcept { --pos_; return *this; }
+        iterator operator++(int) noexcept { iterator t = *this; ++pos_; return t; }
+        iterator operator--(int) noexcept { iterator t = *this; --pos_; return t; }
+        iterator &operator+=(difference_type n) noexcept { pos_ += n; return *this; }
+        iterator &operator-=(difference_type n) noexcept { pos_ -= n; return *this; }
+
+        friend iterator operator+(iterator i, difference_type n) noexcept { return i += n; }
+        friend iterator operator+(difference_type n, iterator i) noexcept { return i += n; }
+        friend iterator operator-(iterator i, difference_type n) noexcept { return i -= n; }
+
+        friend difference_type operator-(iterator const &a, iterator const &b) noexcept
+        {
+                return (difference_type)(a.pos_ - b.pos_);
+        }
+
+        friend bool operator==(iterator const &a, iterator const &b) noexcept
+        {
+                return a.pos_ == b.pos_;
+        }
+
+        friend auto operator<=>(iterator const &a, iterator const &b) noexcept
+        {
+                return a.pos_ <=> b.pos_;
+        }
+
+        /* Bytes (or blocks) from the start of the keystream */
+        std::uint64_t position() const noexcept { return pos_; }
+
+private:
+        friend class keystream_view;
+
+        static constexpr std::size_t batch = 16;        /* Blocks */
+
+        iterator(keystream_view const *v, std::uint64_t pos) noexcept
+                : view_(v), pos_(pos) {}
+
+        void fill(std::uint64_t at) const
+        {
+                static word32 const zeros[batch * 2] = {};
+                word32 g[batch * 2];
+                std::uint64_t first = at / block_size;
+                /* Reading on gets a whole batch; a jump gets one block */
+                std::size_t n = at == base_ + len_ ? batch : 1;
+
+                gostgamma(zeros, g, n, view_->iv_, first, view_->key_);
+                for (std::size_t i = 0; i < n * 2; i++)
+                        detail::store32(cache_ + i * 4, g[i]);
+                base_ = first * block_size;
+                len_ = n * block_size;
+        }
+
+        keystream_view const *view_ = nullptr;
+        std::uint64_t pos_ = 0;
+        mutable std::uint64_t base_ = 0;        /* Byte offset of cache_ */
+        mutable std::uint64_t len_ = 0;
+        mutable std::byte cache_[batch * block_size];
+};
+
+enum class direction { encrypt, decrypt };
+
+/*
+ * An output filter for iostreams: what is written to it comes out of
+ * next encrypted (or decrypted).  Writes collect in a cache-aligned
+ * buffer, so putting a character costs a pointer bump, and each full
+ * buffer goes to the bulk functions as one batch.  Only the buffer is
+ * held, never the whole payload.
+ *
+ * With a trailer, the MAC of the plaintext follows the ciphertext:
+ * encrypting appends it, decrypting holds back the last 8 bytes and
+ * checks them.  close() flushes, deals with the trailer and reports
+ * whether everything was written and the MAC matched; after it, the
+ * filter refuses more output.  The destructor closes it if need be.
+ */
+template <class Mode, class Params = params::des>
+class cryptbuf : public std::streambuf {
+public:
+        static constexpr std::size_t default_buffer = 64 * 1024;
+
+        cryptbuf(std::streambuf &next, context<Params> const &ctx,
+                 std::span<std::byte const, block_size> iv, direction dir,
+                 bool trailer = false, std::size_t buffer = default_buffer)
+                : next_(next), stream_(ctx, iv), mac_(ctx), dir_(dir),
+                  trailer_(trailer),
+                  lines_((std::max(buffer, sizeof(line)) + sizeof(line) - 1) / sizeof(line)),
+                  buf_(new line[lines_])
+        {
+                std::byte *b = buf_[0].b;
+
+                setp(reinterpret_cast<char *>(b),
+                     reinterpret_cast<char *>(b + lines_ * sizeof(line)));
+        }
+
+        cryptbuf(cryptbuf const &) = delete;
+        cryptbuf &operator=(cryptbuf const &) = delete;
+
+        ~cryptbuf() override
+        {
+                if (!closed_)
+                        close();
+                detail::wipe(tail_);
+                for (std::size_t i = 0; i < lines_; i++)
+                        detail::wipe(buf_[i].b);
+        }
+
+        bool close()
+        {
+                std::array<std::byte, block_size> tag;
+                unsigned char diff = 0;
+
+                if (closed_)
+                        return ok_;
+                closed_ = true;
+                drain();
+                if (trailer_) {
+                        tag = mac_.finish();
+                        if (dir_ == direction::encrypt) {
+                                put(tag.data(), tag.size());
+                        } else if (ntail_ != block_size) {
+                                ok_ = false;
+                        } else {
+                                for (std::size_t i = 0; i < block_size; i++)
+                                        diff |= (unsigned char)(tag[i] ^ tail_[i]);
+                                ok_ = ok_ && diff == 0;
+                        }
+                }
+                setp(nullptr, nullptr);
+                if (next_.pubsync() == -1)
+                        ok_ = false;
+                return ok_;
+        }
+
+protected:
+        int_type overflow(int_type c) override
+        {
+                if (closed_ || !drain())
+                        return traits_type::eof();
+                if (traits_type::eq_int_type(c, traits_type::eof()))
+                        return traits_type::not_eof(c);
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+                return c;
+        }
+
+        int sync() override
+        {
+                if (closed_ || !drain())
+                        return -1;
+                return next_.pubsync();
+        }
+
+private:
+        struct alignas(64) line {
+                std::byte b[64];
+        };
+
+        /* Process and pass on what is in the buffer */
+        bool drain()
+        {
+                std::byte *b = reinterpret_cast<std::byte *>(pbase());
+                std::size_t n = pptr() - pbase(), keep;
+
+                setp(pbase(), epptr());
+                if (!trailer_ || dir_ == direction::encrypt)
+                        return emit(b, n);
+
+                /* The last 8 bytes seen so far may be the MAC, so hold them */
+                if (ntail_ + n <= block_size) {
+                        std::copy_n(b, n, tail_ + ntail_);
+                        ntail_ += n;
+                        return ok_;
+                }
+                keep = ntail_ + n - block_size;         /* Bytes released */
+                if (keep >= ntail_) {
+                        std::byte held[block_size];
+
+                        std::copy_n(tail_, ntail_, held);
+                        emit(held, ntail_);
+                        emit(b, keep - ntail_);
+                        std::copy_n(b + keep - ntail_, block_size, tail_);
+                } else {
+                        std::byte held[block_size];
+
+                        std::copy_n(tail_, keep, held);
+                        emit(held, keep);
+                        std::copy(tail_ + keep, tail_ + ntail_, tail_);
+                        std::copy_n(b, n, tail_ + ntail_ - keep);
+                }
+                ntail_ = block_size;
+                return ok_;
+        }
+
+        /* Encrypt or decrypt n bytes in place, MAC the plaintext, write */
+        bool emit(std::byte *p, std::size_t n)
+        {
+                if (!n)
+                        return ok_;
+                if (dir_ == direction::encrypt) {
+                        if (trailer_)
+                                mac_.update(const_bytes(p, n));
+                        stream_.encrypt(const_bytes(p, n), bytes(p, n));
+                } else {
+                        stream_.decrypt(const_bytes(p, n), bytes(p, n));
+                        if (trailer_)
+                                mac_.update(const_bytes(p, n));
+                }
+                return put(p, n);
+        }
+
+        bool put(std::byte const *p, std::size_t n)
+        {
+                std::streamsize w = next_.sputn(reinterpret_cast<char const *>(p),
+                                                (std::streamsize)n);
+
+                if (w != (std::streamsize)n)
+                        ok_ = false;
+                return ok_;
+        }
+
+        std::streambuf &next_;
+        stream<Mode, Params> stream_;
+        mac_stream<Params> mac_;
+        direction dir_;
+        bool trailer_;
+        bool closed_ = false;
+        bool ok_ = true;
+        std::byte tail_[block_size];    /* Decrypting: the possible MAC */
+        std::size_t ntail_ = 0;
+        std::size_t lines_;
+        std::unique_ptr<line[]> buf_;
+};
+
+} // namespace gost
+
+#endif /* GOST_HPP */
@@ -0,0 +1,570 @@
+/*
+ * Encrypt, decrypt or re-encrypt a file in gamma or CFB mode,
+ * checkpointing the stream state as it goes so that a job that dies
+ * part way resumes where it stopped instead of starting over.
+ *
+ * Usage: gost_file [-d] [-c] [-m] [-s checkpoint] [-e bytes]
+ *                  keyfile iv input output
+ *        gost_file -r [-c] [-m] [-C] [-M] [-s checkpoint] [-e bytes]
+ *                  oldkeyfile oldiv newkeyfile newiv input output
+ *        gost_file -S [-d | -r] keyfile iv [newkeyfile newiv] input output
+ *
+ *      -d      decrypt rather than encrypt
+ *      -c      CFB rather than gamma
+ *      -m      append the MAC of the plaintext, or check and drop it
+ *      -r      decrypt under the old key and encrypt under the new one,
+ *              in one pass; -c and -m describe the input, -C and -M
+ *              the output
+ *      -s      checkpoint to this file, and resume from it if present
+ *      -e      checkpoint every this many bytes (default 256 MiB)
+ *      -S      sparse: only the data extents of the input, in parallel
+ *
+ * A key file holds the 32 key bytes, an IV is 16 hex digits, and the
+ * output is what gost::cryptbuf produces from the same input.
+ *
+ * A checkpoint is only written once the output it covers has reached
+ * the disk, so on restart the output is cut back to the checkpoint's
+ * position and carried on from there.  It records the IVs the job
+ * started from, and resuming with other keys, IVs or modes is refused.
+ * It is removed when the job completes.  Exit status is 0 on success, 2 if the MAC did not match
+ * and 1 for anything else.  The input's MAC is only known once all of
+ * it has been read, so after a 2 the output is not to be trusted.
+ *
+ * With -S the input's extents are found with SEEK_DATA and SEEK_HOLE,
+ * and only they are read, encrypted at their own gamma positions by a
+ * thread per CPU, and written at the same offsets of an output of the
+ * same size; the holes stay holes.  A thin image costs the work of its
+ * data, not of its size.  The holes are left as plaintext zeros, not
+ * encrypted, so where they are shows in the output, and output of -S
+ * must be decrypted with -S too: the whole-stream path would turn its
+ * holes into gamma.  Gamma only, without MACs or checkpoints, since
+ * both need the whole stream in order.
+ */
+#define _GNU_SOURCE             /* SEEK_DATA, SEEK_HOLE */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gost.h"
+
+#define BUFFER_BYTES (1 << 20)
+#define DEFAULT_EVERY (256ULL << 20)
+#define EXTENT_CHUNK (8ULL << 20)       /* Extents are shared out in pieces of this */
+
+/* The input is read through s[0]; re-encrypting, s[1] writes the output */
+struct job {
+        int n;
+        struct gost_stream s[2];
+        word32 key[2][8];
+        word32 iv[2][2];        /* As given; CFB's register moves on from it */
+};
+
+/* A checkpoint is each stream's state, then each stream's starting IV */
+#define CHECKPOINT_MAX (2 * (GOST_STATESIZE + 8))
+
+static void usage(char const *prog)
+{
+        fprintf(stderr,
+                "Usage: %s [-d] [-c] [-m] [-s checkpoint] [-e bytes] "
+                "keyfile iv input output\n"
+                "       %s -r [-c] [-m] [-C] [-M] [-s checkpoint] [-e bytes] "
+                "oldkeyfile oldiv newkeyfile newiv input output\n"
+                "       %s -S [-d | -r] keyfile iv [newkeyfile newiv] input output\n"
+                "Output of -S leaves holes unencrypted; decrypt it with -S -d.\n",
+                prog, prog, prog);
+        exit(1);
+}
+
+static void fail(char const *what, char const *name)
+{
+        fprintf(stderr, "gost_file: %s %s: %s\n", what, name, strerror(errno));
+        exit(1);
+}
+
+static void load_key(char const *path, word32 key[8])
+{
+        unsigned char b[33];
+        FILE *fp = fopen(path, "rb");
+        size_t n;
+
+        if (!fp)
+                fail("cannot open", path);
+        n = fread(b, 1, sizeof(b), fp);
+        fclose(fp);
+        if (n != 32) {
+                fprintf(stderr, "gost_file: %s must hold exactly 32 bytes\n", path);
+                exit(1);
+        }
+        for (int i = 0; i < 8; i++)
+                key[i] = (word32)b[i * 4] | (word32)b[i * 4 + 1] << 8 |
+                         (word32)b[i * 4 + 2] << 16 | (word32)b[i * 4 + 3] << 24;
+}
+
+static void parse_iv(char const *hex, word32 iv[2])
+{
+        unsigned char b[8];
+
+        if (strlen(hex) != 16) {
+                fprintf(stderr, "gost_file: the IV must be 16 hex digits\n");
+                exit(1);
+        }
+        for (int i = 0; i < 8; i++) {
+                unsigned v;
+
+                if (sscanf(hex + i * 2, "%2x", &v) != 1) {
+                        fprintf(stderr, "gost_file: bad IV %s\n", hex);
+                        exit(1);
+                }
+                b[i] = (unsigned char)v;
+        }
+        iv[0] = (word32)b[0] | (word32)b[1] << 8 | (word32)b[2] << 16 | (word32)b[3] << 24;
+        iv[1] = (word32)b[4] | (word32)b[5] << 8 | (word32)b[6] << 16 | (word32)b[7] << 24;
+}
+
+static void store_iv(unsigned char b[8], word32 const iv[2])
+{
+        for (int i = 0; i < 8; i++)
+                b[i] = (unsigned char)(iv[i / 4] >> (i % 4 * 8));
+}
+
+static void read_all(int fd, unsigned char *p, size_t n, char const *name)
+{
+        while (n) {
+                ssize_t r = read(fd, p, n);
+
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0)
+                        fail("cannot read", name);
+                if (r == 0) {
+                        fprintf(stderr, "gost_file: %s is shorter than expected\n", name);
+                        exit(1);
+                }
+                p += r;
+                n -= (size_t)r;
+        }
+}
+
+static void write_all(int fd, unsigned char const *p, size_t n, char const *name)
+{
+        while (n) {
+                ssize_t w = write(fd, p, n);
+
+                if (w < 0 && errno == EINTR)
+                        continue;
+                if (w < 0)
+                        fail("cannot write", name);
+                p += w;
+                n -= (size_t)w;
+        }
+}
+
+/* Replace the checkpoint atomically, so a crash leaves the old or the new */
+static void save_checkpoint(char const *path, struct job const *j)
+{
+        unsigned char state[CHECKPOINT_MAX];
+        unsigned char *iv = state + (size_t)j->n * GOST_STATESIZE;
+        char tmp[4096];
+        int fd, i;
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        for (i = 0; i < j->n; i++) {
+                goststreamsave(&j->s[i], state + i * GOST_STATESIZE, j->key[i]);
+                store_iv(iv + i * 8, j->iv[i]);
+        }
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+                fail("cannot create", tmp);
+        write_all(fd, state, (size_t)j->n * (GOST_STATESIZE + 8), tmp);
+        if (fsync(fd) != 0 || close(fd) != 0)
+                fail("cannot write", tmp);
+        if (rename(tmp, path) != 0)
+                fail("cannot replace", path);
+}
+
+/*
+ * The saved IV is the one the job started from, in either mode: CFB's
+ * register in the state has moved on and says nothing about it.
+ */
+static int same_job(struct gost_stream const *t, struct gost_stream const *s,
+                    unsigned char const *saved, word32 const iv[2])
+{
+        unsigned char given[8];
+
+        store_iv(given, iv);
+        return t->mode == s->mode && t->flags == s->flags &&
+               memcmp(saved, given, 8) == 0;
+}
+
+/* 1 if resumed from the checkpoint, 0 if there is none */
+static int load_checkpoint(char const *path, struct job *j)
+{
+        unsigned char state[CHECKPOINT_MAX + 1];
+        unsigned char const *iv = state + (size_t)j->n * GOST_STATESIZE;
+        struct gost_stream t[2];
+        FILE *fp = fopen(path, "rb");
+        size_t n;
+        int i, ok;
+
+        if (!fp) {
+                if (errno == ENOENT)
+                        return 0;
+                fail("cannot open", path);
+        }
+        n = fread(state, 1, sizeof(state), fp);
+        fclose(fp);
+        ok = n == (size_t)j->n * (GOST_STATESIZE + 8);
+        for (i = 0; ok && i < j->n; i++)
+                ok = goststreamload(&t[i], state + i * GOST_STATESIZE, j->key[i]) == 0 &&
+                     same_job(&t[i], &j->s[i], iv + i * 8, j->iv[i]) &&
+                     t[i].pos == t[0].pos;
+        if (!ok) {
+                fprintf(stderr, "gost_file: %s is not a checkpoint of this job; "
+                        "remove it to start over\n", path);
+                exit(1);
+        }
+        for (i = 0; i < j->n; i++)
+                j->s[i] = t[i];
+        return 1;
+}
+
+static void pread_all(int fd, unsigned char *p, size_t n, unsigned long long off,
+                      char const *name)
+{
+        while (n) {
+                ssize_t r = pread(fd, p, n, (off_t)off);
+
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0)
+                        fail("cannot read", name);
+                if (r == 0) {
+                        fprintf(stderr, "gost_file: %s shrank while being read\n", name);
+                        exit(1);
+                }
+                p += r;
+                n -= (size_t)r;
+                off += (unsigned long long)r;
+        }
+}
+
+static void pwrite_all(int fd, unsigned char const *p, size_t n,
+                       unsigned long long off, char const *name)
+{
+        while (n) {
+                ssize_t w = pwrite(fd, p, n, (off_t)off);
+
+                if (w < 0 && errno == EINTR)
+                        continue;
+                if (w < 0)
+                        fail("cannot write", name);
+                p += w;
+                n -= (size_t)w;
+                off += (unsigned long long)w;
+        }
+}
+
+struct extent {
+        unsigned long long off, len;
+};
+
+struct sparse {
+        struct job *j;
+        int in, out;
+        char const *inname, *outname;
+        struct extent *ext;
+        size_t n;
+        atomic_size_t next;
+};
+
+/* The data extents of fd, cut into pieces of at most EXTENT_CHUNK */
+static struct extent *map_extents(int fd, unsigned long long size, size_t *n,
+                                  unsigned long long *data, char const *name)
+{
+        struct extent *ext = NULL;
+        size_t cap = 0;
+        off_t start, end = 0;
+
+        *n = 0;
+        *data = 0;
+        while ((unsigned long long)end < size) {
+                start = lseek(fd, end, SEEK_DATA);
+                if (start < 0 && errno == ENXIO)
+                        break;          /* Nothing but hole from here */
+                if (start < 0)
+                        fail("cannot map", name);
+                end = lseek(fd, start, SEEK_HOLE);
+                if (end < 0)
+                        fail("cannot map", name);
+                *data += (unsigned long long)(end - start);
+                for (; start < end; start += (off_t)EXTENT_CHUNK) {
+                        if (*n == cap) {
+                                cap = cap ? cap * 2 : 64;
+                                ext = realloc(ext, cap * sizeof(*ext));
+                                if (!ext) {
+                                        fprintf(stderr, "gost_file: out of memory\n");
+                                        exit(1);
+                                }
+                        }
+                        ext[*n].off = (unsigned long long)start;
+                        ext[*n].len = (unsigned long long)(end - start) < EXTENT_CHUNK ?
+                                      (unsigned long long)(end - start) : EXTENT_CHUNK;
+                        (*n)++;
+                }
+        }
+        return ext;
+}
+
+/* Take pieces until there are none; each is its own seek into the stream */
+static void *sparse_worker(void *arg)
+{
+        struct sparse *sp = arg;
+        struct job *j = sp->j;
+        unsigned char *buf = malloc(BUFFER_BYTES);
+        struct gost_stream s[2];
+        size_t e;
+        int i;
+
+        if (!buf) {
+                fprintf(stderr, "gost_file: out of memory\n");
+                exit(1);
+        }
+        while ((e = atomic_fetch_add(&sp->next, 1)) < sp->n) {
+                unsigned long long off = sp->ext[e].off, left = sp->ext[e].len;
+
+                for (i = 0; i < j->n; i++) {
+                        goststreaminit(&s[i], GOST_MODE_GAMMA, j->s[i].flags, j->s[i].iv);
+                        goststreamseek(&s[i], off, j->key[i]);
+                }
+                while (left) {
+                        size_t n = left < BUFFER_BYTES ? (size_t)left : BUFFER_BYTES;
+
+                        pread_all(sp->in, buf, n, off, sp->inname);
+                        if (j->n == 2)
+                                goststreamrecrypt(&s[0], j->key[0], &s[1], j->key[1],
+                                                  buf, buf, n);
+                        else
+                                goststream(&s[0], buf, buf, n, j->key[0]);
+                        pwrite_all(sp->out, buf, n, off, sp->outname);
+                        off += n;
+                        left -= n;
+                }
+        }
+        free(buf);
+        return NULL;
+}
+
+static int run_sparse(struct job *j, char const *inname, char const *outname)
+{
+        struct sparse sp;
+        struct stat st;
+        pthread_t *t;
+        unsigned long long size, data;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads, i;
+
+        sp.j = j;
+        sp.inname = inname;
+        sp.outname = outname;
+        sp.in = open(inname, O_RDONLY);
+        if (sp.in < 0 || fstat(sp.in, &st) != 0)
+                fail("cannot open", inname);
+        size = (unsigned long long)st.st_size;
+        sp.out = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (sp.out < 0)
+                fail("cannot open", outname);
+        /* All hole to begin with; the extents are written into it */
+        if (ftruncate(sp.out, (off_t)size) != 0)
+                fail("cannot size", outname);
+
+        sp.ext = map_extents(sp.in, size, &sp.n, &data, inname);
+        atomic_init(&sp.next, 0);
+        nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+        if (nthreads > sp.n)
+                nthreads = sp.n ? sp.n : 1;
+        t = malloc(nthreads * sizeof(*t));
+        if (!t) {
+                fprintf(stderr, "gost_file: out of memory\n");
+                return 1;
+        }
+        for (i = 1; i < nthreads; i++)
+                if (pthread_create(&t[i], NULL, sparse_worker, &sp) != 0)
+                        break;
+        sparse_worker(&sp);
+        while (--i > 0)
+                pthread_join(t[i], NULL);
+
+        if (fsync(sp.out) != 0 || close(sp.out) != 0)
+                fail("cannot write", outname);
+        close(sp.in);
+        fprintf(stderr, "gost_file: %llu bytes of data in %zu pieces, %llu of hole\n",
+                data, sp.n, size - data);
+        free(sp.ext);
+        free(t);
+        gostpoolstop();
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        char const *checkpoint = NULL, *inname, *outname;
+        unsigned long long every = DEFAULT_EVERY, size, since = 0;
+        static struct job j;
+        struct gost_stream *last;
+        unsigned char *buf, tag[8], trailer[8];
+        struct stat st;
+        int mode[2] = { GOST_MODE_GAMMA, GOST_MODE_GAMMA }, flags[2] = { 0, 0 };
+        int recrypt = 0, sparse = 0, resumed = 0, in, out, opt, i;
+
+        while ((opt = getopt(argc, argv, "dcmrCMSs:e:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        flags[0] |= GOST_STREAM_DECRYPT;
+                        break;
+                case 'c':
+                        mode[0] = GOST_MODE_CFB;
+                        break;
+                case 'm':
+                        flags[0] |= GOST_STREAM_MAC;
+                        break;
+                case 'r':
+                        recrypt = 1;
+                        break;
+                case 'C':
+                        mode[1] = GOST_MODE_CFB;
+                        break;
+                case 'M':
+                        flags[1] |= GOST_STREAM_MAC;
+                        break;
+                case 'S':
+                        sparse = 1;
+                        break;
+                case 's':
+                        checkpoint = optarg;
+                        break;
+                case 'e':
+                        every = strtoull(optarg, NULL, 0);
+                        if (every == 0)
+                                usage(argv[0]);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (recrypt ? (flags[0] & GOST_STREAM_DECRYPT) != 0 :
+                      mode[1] != GOST_MODE_GAMMA || flags[1] != 0)
+                usage(argv[0]);
+        if (sparse && (checkpoint || mode[0] != GOST_MODE_GAMMA ||
+                       mode[1] != GOST_MODE_GAMMA ||
+                       ((flags[0] | flags[1]) & GOST_STREAM_MAC)))
+                usage(argv[0]);
+        j.n = recrypt ? 2 : 1;
+        if (recrypt)
+                flags[0] |= GOST_STREAM_DECRYPT;
+        if (argc - optind != 2 * j.n + 2)
+                usage(argv[0]);
+
+        kboxinit();
+        for (i = 0; i < j.n; i++) {
+                load_key(argv[optind + i * 2], j.key[i]);
+                parse_iv(argv[optind + i * 2 + 1], j.iv[i]);
+                goststreaminit(&j.s[i], mode[i], flags[i], j.iv[i]);
+        }
+        last = &j.s[j.n - 1];
+        inname = argv[optind + j.n * 2];
+        outname = argv[optind + j.n * 2 + 1];
+        if (sparse)
+                return run_sparse(&j, inname, outname);
+
+        in = open(inname, O_RDONLY);
+        if (in < 0 || fstat(in, &st) != 0)
+                fail("cannot open", inname);
+        size = (unsigned long long)st.st_size;
+        if ((flags[0] & GOST_STREAM_MAC) && (flags[0] & GOST_STREAM_DECRYPT)) {
+                if (size < sizeof(trailer)) {
+                        fprintf(stderr, "gost_file: %s has no MAC\n", inname);
+                        return 1;
+                }
+                size -= sizeof(trailer);
+                if (pread(in, trailer, sizeof(trailer), (off_t)size) != (ssize_t)sizeof(trailer))
+                        fail("cannot read", inname);
+        }
+
+        if (checkpoint)
+                resumed = load_checkpoint(checkpoint, &j);
+        if (j.s[0].pos > size) {
+                fprintf(stderr, "gost_file: %s is past the end of %s\n",
+                        checkpoint, inname);
+                return 1;
+        }
+
+        out = open(outname, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+        if (out < 0)
+                fail("cannot open", outname);
+        if (resumed) {
+                /* Whatever was written after the checkpoint is redone */
+                if (ftruncate(out, (off_t)j.s[0].pos) != 0 ||
+                    lseek(out, (off_t)j.s[0].pos, SEEK_SET) < 0)
+                        fail("cannot resume", outname);
+                if (lseek(in, (off_t)j.s[0].pos, SEEK_SET) < 0)
+                        fail("cannot resume", inname);
+                fprintf(stderr, "gost_file: resuming at byte %llu\n", j.s[0].pos);
+        }
+
+        buf = malloc(BUFFER_BYTES);
+        if (!buf) {
+                fprintf(stderr, "gost_file: out of memory\n");
+                return 1;
+        }
+
+        while (j.s[0].pos < size) {
+                size_t n = size - j.s[0].pos < BUFFER_BYTES ?
+                           (size_t)(size - j.s[0].pos) : BUFFER_BYTES;
+
+                read_all(in, buf, n, inname);
+                if (recrypt)
+                        goststreamrecrypt(&j.s[0], j.key[0], &j.s[1], j.key[1],
+                                          buf, buf, n);
+                else
+                        goststream(&j.s[0], buf, buf, n, j.key[0]);
+                write_all(out, buf, n, outname);
+                since += n;
+                if (checkpoint && since >= every) {
+                        if (fsync(out) != 0)
+                                fail("cannot sync", outname);
+                        save_checkpoint(checkpoint, &j);
+                        since = 0;
+                }
+        }
+        free(buf);
+        close(in);
+
+        if ((last->flags & GOST_STREAM_MAC) && !(last->flags & GOST_STREAM_DECRYPT)) {
+                goststreammac(last, tag, j.key[j.n - 1]);
+                write_all(out, tag, sizeof(tag), outname);
+        }
+        if (fsync(out) != 0 || close(out) != 0)
+                fail("cannot write", outname);
+        if (checkpoint && remove(checkpoint) != 0 && errno != ENOENT)
+                fail("cannot remove", checkpoint);
+        gostpoolstop();
+
+        if ((flags[0] & GOST_STREAM_MAC) && (flags[0] & GOST_STREAM_DECRYPT)) {
+                unsigned char diff = 0;
+
+                goststreammac(&j.s[0], tag, j.key[0]);
+                for (size_t k = 0; k < sizeof(tag); k++)
+                        diff |= tag[k] ^ trailer[k];
+                if (diff) {
+                        fprintf(stderr, "gost_file: MAC mismatch\n");
+                        return 2;
+                }
+        }
+        return 0;
+}
@@ -0,0 +1,236 @@
+#ifndef GOST_SMALL_H
+#define GOST_SMALL_H
+
+/*
+ * Inline forms of the block operations for messages of a few blocks:
+ * single-block wraps, nonces, short MACs.  At 8 to 64 bytes the cost
+ * is mostly the call into the library, the loop set-up and reloading
+ * key[] round after round.  These are static inline: the round
+ * function reads gost_ftab directly and the key is copied into locals,
+ * so at a fixed size the compiler can unroll the lanes into the
+ * caller and keep the subkeys in registers.  The tables must have
+ * been built (kboxinit() or gostsboxinit()) as for everything else.
+ *
+ * Each operation comes in 1, 2, 4 and 8 blocks:
+ *
+ *      gostsmallcryptN(in, out, key)           gostcrypt() on N blocks
+ *      gostsmalldecryptN(in, out, key)         gostdecrypt() on N blocks
+ *      gostsmallgammaN(in, out, iv, pos, key)  gostgamma() of N blocks
+ *      gostsmallmacN(in, mac, key)             gostmac() of N blocks
+ *
+ * Each gives exactly what the library function it names does.
+ */
+#include "gost.h"
+
+#ifdef __GNUC__
+#define GOST_SMALL_INLINE static inline __attribute__((always_inline))
+#define GOST_SMALL_UNROLL _Pragma("GCC unroll 8")
+#else
+#define GOST_SMALL_INLINE static inline
+#define GOST_SMALL_UNROLL
+#endif
+
+GOST_SMALL_INLINE word32
+gostsmall_f(word32 x)
+{
+        return gost_ftab[0][(unsigned char)(x      )] ^
+               gost_ftab[1][(unsigned char)(x >>  8)] ^
+               gost_ftab[2][(unsigned char)(x >> 16)] ^
+               gost_ftab[3][(unsigned char)(x >> 24)];
+}
+
+/* Two rounds on every lane */
+#define GOST_SMALL_ROUND(n, n1, n2, key_a, key_b) \
+        do { \
+                size_t l_; \
+                GOST_SMALL_UNROLL \
+                for (l_ = 0; l_ < (n); l_++) \
+                        (n2)[l_] ^= gostsmall_f((n1)[l_] + (key_a)); \
+                GOST_SMALL_UNROLL \
+                for (l_ = 0; l_ < (n); l_++) \
+                        (n1)[l_] ^= gostsmall_f((n2)[l_] + (key_b)); \
+        } while (0)
+
+#define GOST_SMALL_FORWARD(n, n1, n2) \
+        do { \
+                GOST_SMALL_ROUND(n, n1, n2, k0, k1); \
+                GOST_SMALL_ROUND(n, n1, n2, k2, k3); \
+                GOST_SMALL_ROUND(n, n1, n2, k4, k5); \
+                GOST_SMALL_ROUND(n, n1, n2, k6, k7); \
+        } while (0)
+
+#define GOST_SMALL_BACKWARD(n, n1, n2) \
+        do { \
+                GOST_SMALL_ROUND(n, n1, n2, k7, k6); \
+                GOST_SMALL_ROUND(n, n1, n2, k5, k4); \
+                GOST_SMALL_ROUND(n, n1, n2, k3, k2); \
+                GOST_SMALL_ROUND(n, n1, n2, k1, k0); \
+        } while (0)
+
+#define GOST_SMALL_KEY(key) \
+        word32 const k0 = (key)[0], k1 = (key)[1], k2 = (key)[2], k3 = (key)[3]; \
+        word32 const k4 = (key)[4], k5 = (key)[5], k6 = (key)[6], k7 = (key)[7]
+
+/* n <= 8 blocks, encrypted or decrypted independently */
+GOST_SMALL_INLINE void
+gostsmall_ecb(word32 const *in, word32 *out, size_t n, word32 const key[8],
+              int decrypt)
+{
+        GOST_SMALL_KEY(key);
+        word32 n1[8], n2[8];
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                n1[i] = in[i * 2];
+                n2[i] = in[i * 2 + 1];
+        }
+        if (!decrypt) {
+                GOST_SMALL_FORWARD(n, n1, n2);
+                GOST_SMALL_FORWARD(n, n1, n2);
+                GOST_SMALL_FORWARD(n, n1, n2);
+                GOST_SMALL_BACKWARD(n, n1, n2);
+        } else {
+                GOST_SMALL_FORWARD(n, n1, n2);
+                GOST_SMALL_BACKWARD(n, n1, n2);
+                GOST_SMALL_BACKWARD(n, n1, n2);
+                GOST_SMALL_BACKWARD(n, n1, n2);
+        }
+        for (i = 0; i < n; i++) {
+                out[i * 2] = n2[i];
+                out[i * 2 + 1] = n1[i];
+        }
+}
+
+/*
+ * n <= 8 blocks encrypted, each under its own key, as n1/n2 halves in
+ * place: for many short messages or sessions that share no key, whose
+ * lanes' table lookups still overlap.
+ */
+GOST_SMALL_INLINE void
+gostsmall_keyed(word32 n1[8], word32 n2[8], word32 const *const key[8], size_t n)
+{
+        static unsigned char const order[32] = {
+                0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7,
+                0, 1, 2, 3, 4, 5, 6, 7, 7, 6, 5, 4, 3, 2, 1, 0
+        };
+        size_t r, l;
+        word32 t;
+
+        for (r = 0; r < 32; r += 2) {
+                for (l = 0; l < n; l++)
+                        n2[l] ^= gostsmall_f(n1[l] + key[l][order[r]]);
+                for (l = 0; l < n; l++)
+                        n1[l] ^= gostsmall_f(n2[l] + key[l][order[r + 1]]);
+        }
+        for (l = 0; l < n; l++) {
+                t = n1[l];
+                n1[l] = n2[l];
+                n2[l] = t;
+        }
+}
+
+/* One block of MAC, 16 rounds, into each of n <= 8 chains under their own keys */
+GOST_SMALL_INLINE void
+gostsmall_keyedmac(word32 n1[8], word32 n2[8], word32 const *const key[8], size_t n)
+{
+        size_t r, l;
+
+        for (r = 0; r < 16; r += 2) {
+                for (l = 0; l < n; l++)
+                        n2[l] ^= gostsmall_f(n1[l] + key[l][r % 8]);
+                for (l = 0; l < n; l++)
+                        n1[l] ^= gostsmall_f(n2[l] + key[l][r % 8 + 1]);
+        }
+}
+
+/* One step of a counter half modulo 2^32-1, as gostofb() does it */
+GOST_SMALL_INLINE word32
+gostsmall_step(word32 x, word32 c)
+{
+        x += c;
+        return x < c ? x + 1 : x;
+}
+
+/* n steps at once, for a start part way into the stream */
+GOST_SMALL_INLINE word32
+gostsmall_seek(word32 x, unsigned long long n, word32 c)
+{
+        unsigned long long const m = 0xffffffffULL;
+        unsigned long long v = (x % m + (n % m) * c % m) % m;
+
+        return v ? (word32)v : 0xffffffff;
+}
+
+GOST_SMALL_INLINE void
+gostsmall_gamma(word32 const *in, word32 *out, size_t n, word32 const iv[2],
+                unsigned long long pos, word32 const key[8])
+{
+        word32 ctr[16], gamma[16];
+        size_t i;
+
+        gostsmall_ecb(iv, ctr, 1, key, 0);
+        if (pos) {
+                ctr[0] = gostsmall_seek(ctr[0], pos, 0x01010101);
+                ctr[1] = gostsmall_seek(ctr[1], pos, 0x01010104);
+        }
+        ctr[0] = gostsmall_step(ctr[0], 0x01010101);
+        ctr[1] = gostsmall_step(ctr[1], 0x01010104);
+        for (i = 1; i < n; i++) {
+                ctr[i * 2] = gostsmall_step(ctr[i * 2 - 2], 0x01010101);
+                ctr[i * 2 + 1] = gostsmall_step(ctr[i * 2 - 1], 0x01010104);
+        }
+        gostsmall_ecb(ctr, gamma, n, key, 0);
+        for (i = 0; i < n * 2; i++)
+                out[i] = in[i] ^ gamma[i];
+}
+
+GOST_SMALL_INLINE void
+gostsmall_mac(word32 const *in, size_t n, word32 mac[2], word32 const key[8])
+{
+        GOST_SMALL_KEY(key);
+        word32 n1[1] = { 0 }, n2[1] = { 0 };
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                n1[0] ^= in[i * 2];
+                n2[0] = in[i * 2 + 1];          /* Sic: as gostmac() */
+                GOST_SMALL_FORWARD(1, n1, n2);
+                GOST_SMALL_FORWARD(1, n1, n2);
+        }
+        mac[0] = n1[0];
+        mac[1] = n2[0];
+}
+
+#define GOST_SMALL_SIZE(N) \
+        GOST_SMALL_INLINE void \
+        gostsmallcrypt##N(word32 const in[N * 2], word32 out[N * 2], \
+                          word32 const key[8]) \
+        { \
+                gostsmall_ecb(in, out, N, key, 0); \
+        } \
+        GOST_SMALL_INLINE void \
+        gostsmalldecrypt##N(word32 const in[N * 2], word32 out[N * 2], \
+                            word32 const key[8]) \
+        { \
+                gostsmall_ecb(in, out, N, key, 1); \
+        } \
+        GOST_SMALL_INLINE void \
+        gostsmallgamma##N(word32 const in[N * 2], word32 out[N * 2], \
+                          word32 const iv[2], unsigned long long pos, \
+                          word32 const key[8]) \
+        { \
+                gostsmall_gamma(in, out, N, iv, pos, key); \
+        } \
+        GOST_SMALL_INLINE void \
+        gostsmallmac##N(word32 const in[N * 2], word32 mac[2], \
+                        word32 const key[8]) \
+        { \
+                gostsmall_mac(in, N, mac, key); \
+        }
+
+GOST_SMALL_SIZE(1)
+GOST_SMALL_SIZE(2)
+GOST_SMALL_SIZE(4)
+GOST_SMALL_SIZE(8)
+
+#endif /* GOST_SMALL_H */
@@ -0,0 +1,32 @@
+#ifndef GOST_WORDS_H
+#define GOST_WORDS_H
+
+/*
+ * The library's words are little-endian bytes.  Code that hands byte
+ * buffers to the block functions as words asks whether the host is
+ * little-endian, and on other hosts swaps the words in place before
+ * and after.
+ */
+#include <stddef.h>
+
+#include "gost.h"
+
+static inline int
+gostlittleendian(void)
+{
+        word32 const one = 1;
+
+        return *(unsigned char const *)&one == 1;
+}
+
+static inline void
+gostswapwords(word32 *w, size_t n)
+{
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                w[i] = (w[i] >> 24 | (w[i] >> 8 & 0xff00) | (w[i] & 0xff00) << 8 |
+                        w[i] << 24) & 0xffffffff;
+}
+
+#endif /* GOST_WORDS_H */
@@ -0,0 +1,751 @@
+/*
+ * End-to-end throughput of file encryption: read a file, encrypt it
+ * and write it out, through each I/O strategy, in each mode, on each
+ * number of threads, on each file system given.
+ *
+ * Usage: gost_iobench [-s mib] [-t threads] [dir ...]
+ *
+ *      -s      size of the test file (default 128 MiB)
+ *      -t      most threads; counts double from 1 (default: CPUs)
+ *
+ * The directories default to /dev/shm, for tmpfs, and the current
+ * one, for whatever the disk has.  The strategies are
+ *
+ *      read/write      pread() and pwrite() of 1 MiB at a time
+ *      mmap            both files mapped, encrypted from one to the other
+ *      O_DIRECT        read/write bypassing the page cache
+ *      splice          pread(), then vmsplice() and splice() to the output
+ *      io_uring        reads and writes queued URING_DEPTH at a time, the
+ *                      writes of one batch going with the reads of the next
+ *
+ * A run counts from opening the files to the output's fsync(), with
+ * the input dropped from the page cache beforehand.  It reports wall
+ * time, MiB/s, CPU time as a share of the wall time (so up to 100%
+ * per thread) and how much of that was the kernel's, and the system
+ * calls and page faults per GiB.  Each output is checked against the
+ * ciphertext the test file should give.  Gamma runs split the file
+ * between the threads; CFB is one chain and runs on one.  A strategy
+ * the file system refuses, such as O_DIRECT on tmpfs, is reported and
+ * skipped.  The library's own thread pool is kept to the calling
+ * thread, so the thread counts are the only parallelism.
+ */
+#define _GNU_SOURCE             /* O_DIRECT, splice(), vmsplice() */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gost.h"
+
+#define CHUNK (1 << 20)         /* Bytes per read, write or encryption */
+#define ALIGN 4096              /* For O_DIRECT */
+#define URING_DEPTH 4           /* Chunks in flight per direction */
+#define MAX_DIRS 8
+
+enum strategy { RW, MMAP, DIRECT, SPLICE, URING, NSTRATEGIES };
+
+static char const *const strategy_names[NSTRATEGIES] = {
+        "read/write", "mmap", "O_DIRECT", "splice", "io_uring"
+};
+static char const *const mode_names[] = { "gamma", "cfb" };
+
+/* One run: a strategy and mode over the whole file */
+struct run {
+        int strategy, mode;
+        int in, out;
+        unsigned char *inmap, *outmap;
+        unsigned long long size;
+        word32 key[8], iv[2];
+        atomic_ullong syscalls;
+        atomic_int failed;
+};
+
+/* A thread's share of a run: bytes from..to */
+struct part {
+        pthread_t thread;
+        struct run *r;
+        unsigned long long from, to;
+        unsigned long long syscalls;
+};
+
+struct result {
+        double wall, cpu, sys;
+        unsigned long long syscalls, faults;
+        int ok;
+};
+
+static void die(char const *what)
+{
+        perror(what);
+        exit(1);
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double seconds(struct timeval tv)
+{
+        return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+/* A system call made by a part, counted */
+#define SYS(p, call) ((p)->syscalls++, (call))
+
+static void fail(struct part *p, char const *what)
+{
+        if (atomic_exchange(&p->r->failed, 1) == 0)
+                perror(what);
+}
+
+/* The test file's contents, the same for any chunk wherever it is read */
+static void fill(unsigned char *buf, size_t n, unsigned long long off)
+{
+        unsigned long long x = off / 8 * 0x9e3779b97f4a7c15ULL + 1;
+        size_t i;
+
+        for (i = 0; i < n; i += 8) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                memcpy(buf + i, &x, 8);
+        }
+}
+
+static unsigned long long checksum(unsigned long long h, unsigned char const *p,
+                                   size_t n)
+{
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                h = (h ^ p[i]) * 0x100000001b3ULL;
+        return h;
+}
+
+/*
+ * The stream for a part's bytes, wherever in the file they start.  Only
+ * gamma can start part way; for CFB that fails the run rather than
+ * giving it output from the wrong place.
+ */
+static void part_stream(struct part *p, struct gost_stream *s)
+{
+        goststreaminit(s, p->r->mode == 0 ? GOST_MODE_GAMMA : GOST_MODE_CFB, 0,
+                       p->r->iv);
+        if (p->from && goststreamseek(s, p->from, p->r->key) != 0) {
+                errno = EINVAL;
+                fail(p, "goststreamseek");
+        }
+}
+
+static unsigned char *chunk_buffer(void)
+{
+        void *buf;
+
+        if (posix_memalign(&buf, ALIGN, CHUNK) != 0)
+                return NULL;
+        return buf;
+}
+
+static int read_full(struct part *p, int fd, unsigned char *buf, size_t n,
+                     unsigned long long off)
+{
+        ssize_t r;
+
+        while (n) {
+                r = SYS(p, pread(fd, buf, n, (off_t)off));
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        return -1;
+                buf += r;
+                n -= (size_t)r;
+                off += (unsigned long long)r;
+        }
+        return 0;
+}
+
+static int write_full(struct part *p, int fd, unsigned char const *buf, size_t n,
+                      unsigned long long off)
+{
+        ssize_t w;
+
+        while (n) {
+                w = SYS(p, pwrite(fd, buf, n, (off_t)off));
+                if (w < 0 && errno == EINTR)
+                        continue;
+                if (w < 0)
+                        return -1;
+                buf += w;
+                n -= (size_t)w;
+                off += (unsigned long long)w;
+        }
+        return 0;
+}
+
+/* read/write and O_DIRECT, which differ only in how the files were opened */
+static void rw_part(struct part *p)
+{
+        struct run *r = p->r;
+        struct gost_stream s;
+        unsigned char *buf = chunk_buffer();
+        unsigned long long off;
+        size_t n;
+
+        if (!buf) {
+                fail(p, "posix_memalign");
+                return;
+        }
+        part_stream(p, &s);
+        for (off = p->from; off < p->to && !r->failed; off += n) {
+                n = p->to - off < CHUNK ? (size_t)(p->to - off) : CHUNK;
+                if (read_full(p, r->in, buf, n, off) != 0) {
+                        fail(p, "pread");
+                        break;
+                }
+                goststream(&s, buf, buf, n, r->key);
+                if (write_full(p, r->out, buf, n, off) != 0) {
+                        fail(p, "pwrite");
+                        break;
+                }
+        }
+        free(buf);
+}
+
+static void mmap_part(struct part *p)
+{
+        struct run *r = p->r;
+        struct gost_stream s;
+        unsigned long long off;
+        size_t n;
+
+        part_stream(p, &s);
+        for (off = p->from; off < p->to && !r->failed; off += n) {
+                n = p->to - off < CHUNK ? (size_t)(p->to - off) : CHUNK;
+                goststream(&s, r->inmap + off, r->outmap + off, n, r->key);
+        }
+}
+
+static void splice_part(struct part *p)
+{
+        struct run *r = p->r;
+        struct gost_stream s;
+        unsigned char *buf = chunk_buffer();
+        unsigned long long off;
+        struct iovec iov;
+        loff_t to;
+        ssize_t m;
+        size_t n, piped;
+        int pipefd[2];
+
+        if (!buf || SYS(p, pipe(pipefd)) != 0) {
+                fail(p, "pipe");
+                free(buf);
+                return;
+        }
+        SYS(p, fcntl(pipefd[1], F_SETPIPE_SZ, CHUNK));
+        part_stream(p, &s);
+        for (off = p->from; off < p->to && !r->failed; off += n) {
+                n = p->to - off < CHUNK ? (size_t)(p->to - off) : CHUNK;
+                if (read_full(p, r->in, buf, n, off) != 0) {
+                        fail(p, "pread");
+                        break;
+                }
+                goststream(&s, buf, buf, n, r->key);
+                /* What fits in the pipe, then all of that on to the file */
+                for (to = (loff_t)off, piped = 0; piped < n; ) {
+                        iov.iov_base = buf + piped;
+                        iov.iov_len = n - piped;
+                        m = SYS(p, vmsplice(pipefd[1], &iov, 1, 0));
+                        if (m <= 0) {
+                                fail(p, "vmsplice");
+                                break;
+                        }
+                        piped += (size_t)m;
+                        while (m > 0) {
+                                ssize_t w = SYS(p, splice(pipefd[0], NULL, r->out, &to,
+                                                          (size_t)m, SPLICE_F_MOVE));
+
+                                if (w <= 0) {
+                                        fail(p, "splice");
+                                        piped = n;
+                                        break;
+                                }
+                                m -= w;
+                        }
+                }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        free(buf);
+}
+
+struct uring {
+        int fd;
+        unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+        unsigned *cqhead, *cqtail, *cqmask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sqring, *cqring;
+        size_t sqlen, cqlen, sqeslen;
+};
+
+static int uring_setup(struct part *p, struct uring *u, unsigned entries)
+{
+        struct io_uring_params prm;
+        unsigned char *sq, *cq;
+
+        memset(&prm, 0, sizeof(prm));
+        u->fd = (int)SYS(p, syscall(__NR_io_uring_setup, entries, &prm));
+        if (u->fd < 0)
+                return -1;
+        u->sqlen = prm.sq_off.array + prm.sq_entries * sizeof(unsigned);
+        u->cqlen = prm.cq_off.cqes + prm.cq_entries * sizeof(struct io_uring_cqe);
+        u->sqeslen = prm.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqring = SYS(p, mmap(NULL, u->sqlen, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING));
+        u->cqring = SYS(p, mmap(NULL, u->cqlen, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING));
+        u->sqes = SYS(p, mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES));
+        if (u->sqring == MAP_FAILED || u->cqring == MAP_FAILED || u->sqes == MAP_FAILED) {
+                close(u->fd);
+                return -1;
+        }
+        sq = u->sqring;
+        cq = u->cqring;
+        u->sqhead = (unsigned *)(void *)(sq + prm.sq_off.head);
+        u->sqtail = (unsigned *)(void *)(sq + prm.sq_off.tail);
+        u->sqmask = (unsigned *)(void *)(sq + prm.sq_off.ring_mask);
+        u->sqarray = (unsigned *)(void *)(sq + prm.sq_off.array);
+        u->cqhead = (unsigned *)(void *)(cq + prm.cq_off.head);
+        u->cqtail = (unsigned *)(void *)(cq + prm.cq_off.tail);
+        u->cqmask = (unsigned *)(void *)(cq + prm.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe *)(void *)(cq + prm.cq_off.cqes);
+        return 0;
+}
+
+static void uring_free(struct uring *u)
+{
+        munmap(u->sqes, u->sqeslen);
+        munmap(u->cqring, u->cqlen);
+        munmap(u->sqring, u->sqlen);
+        close(u->fd);
+}
+
+static void uring_queue(struct uring *u, int op, int fd, unsigned char *buf,
+                        size_t n, unsigned long long off)
+{
+        unsigned tail = *u->sqtail, i = tail & *u->sqmask;
+        struct io_uring_sqe *e = &u->sqes[i];
+
+        memset(e, 0, sizeof(*e));
+        e->opcode = (unsigned char)op;
+        e->fd = fd;
+        e->addr = (unsigned long long)(uintptr_t)buf;
+        e->len = (unsigned)n;
+        e->off = off;
+        e->user_data = n;
+        u->sqarray[i] = i;
+        __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit the n queued and wait for all of them; -1 if any came up short */
+static int uring_run(struct part *p, struct uring *u, unsigned n)
+{
+        unsigned head, bad = 0;
+
+        if (n == 0)
+                return 0;
+        while (SYS(p, syscall(__NR_io_uring_enter, u->fd, n, n,
+                              IORING_ENTER_GETEVENTS, NULL, 0)) < 0)
+                if (errno != EINTR)
+                        return -1;
+        head = *u->cqhead;
+        while (n) {
+                struct io_uring_cqe *c;
+
+                if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+                        /* Woken early; wait for the rest without submitting */
+                        __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+                        if (SYS(p, syscall(__NR_io_uring_enter, u->fd, 0, n,
+                                           IORING_ENTER_GETEVENTS, NULL, 0)) < 0 &&
+                            errno != EINTR)
+                                return -1;
+                        continue;
+                }
+                c = &u->cqes[head & *u->cqmask];
+                if (c->res < 0 || (unsigned long long)c->res != c->user_data)
+                        bad = 1;
+                head++;
+                n--;
+        }
+        __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+        return bad ? -1 : 0;
+}
+
+/*
+ * Two sets of URING_DEPTH buffers: while one set is encrypted the
+ * other has nothing outstanding, and then one submission sends the
+ * encrypted set's writes and the next set's reads together.
+ */
+static void uring_part(struct part *p)
+{
+        struct run *r = p->r;
+        struct gost_stream s;
+        struct uring u;
+        unsigned char *buf[2][URING_DEPTH] = { { NULL } };
+        size_t len[2][URING_DEPTH];
+        unsigned long long off[2], next = p->from;
+        unsigned cnt[2], i, q;
+        int set = 0, k;
+
+        if (uring_setup(p, &u, URING_DEPTH * 2) != 0) {
+                fail(p, "io_uring_setup");
+                return;
+        }
+        for (k = 0; k < 2; k++)
+                for (i = 0; i < URING_DEPTH; i++)
+                        if (!(buf[k][i] = chunk_buffer()))
+                                fail(p, "posix_memalign");
+        part_stream(p, &s);
+
+        /* Queue reads for a set, returning how many */
+#define READ_SET(k) do { \
+                off[k] = next; \
+                for (cnt[k] = 0; cnt[k] < URING_DEPTH && next < p->to; cnt[k]++) { \
+                        len[k][cnt[k]] = p->to - next < CHUNK ? (size_t)(p->to - next) : CHUNK; \
+                        uring_queue(&u, IORING_OP_READ, r->in, buf[k][cnt[k]], \
+                                    len[k][cnt[k]], next); \
+                        next += len[k][cnt[k]]; \
+                } \
+        } while (0)
+
+        if (!r->failed) {
+                READ_SET(0);
+                if (uring_run(p, &u, cnt[0]) != 0)
+                        fail(p, "io_uring read");
+        }
+        while (!r->failed && cnt[set]) {
+                unsigned long long o = off[set];
+
+                for (i = 0; i < cnt[set]; i++)
+                        goststream(&s, buf[set][i], buf[set][i], len[set][i], r->key);
+                for (i = 0; i < cnt[set]; o += len[set][i], i++)
+                        uring_queue(&u, IORING_OP_WRITE, r->out, buf[set][i],
+                                    len[set][i], o);
+                q = cnt[set];
+                READ_SET(set ^ 1);
+                if (uring_run(p, &u, q + cnt[set ^ 1]) != 0)
+                        fail(p, "io_uring");
+                set ^= 1;
+        }
+#undef READ_SET
+        for (k = 0; k < 2; k++)
+                for (i = 0; i < URING_DEPTH; i++)
+                        free(buf[k][i]);
+        uring_free(&u);
+}
+
+static void *part_thread(void *arg)
+{
+        struct part *p = arg;
+
+        switch (p->r->strategy) {
+        case RW:
+        case DIRECT:
+                rw_part(p);
+                break;
+        case MMAP:
+                mmap_part(p);
+                break;
+        case SPLICE:
+                splice_part(p);
+                break;
+        case URING:
+                uring_part(p);
+                break;
+        }
+        atomic_fetch_add(&p->r->syscalls, p->syscalls);
+        return NULL;
+}
+
+/* The output's checksum, read back outside the timed part */
+static unsigned long long output_checksum(char const *path)
+{
+        unsigned char *buf = malloc(CHUNK);
+        unsigned long long h = 0xcbf29ce484222325ULL;
+        ssize_t n;
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0 || !buf)
+                die(path);
+        while ((n = read(fd, buf, CHUNK)) > 0)
+                h = checksum(h, buf, (size_t)n);
+        close(fd);
+        free(buf);
+        return h;
+}
+
+/* 0, or -1 if the file system will not do this strategy */
+static int run_one(struct run *r, char const *inpath, char const *outpath,
+                   int threads, unsigned long long expect, struct result *res)
+{
+        struct part parts[64], setup = { 0 };
+        struct rusage ru0, ru1;
+        unsigned long long chunks = (r->size + CHUNK - 1) / CHUNK;
+        int direct = r->strategy == DIRECT ? O_DIRECT : 0, i;
+        double t0;
+
+        atomic_init(&r->syscalls, 0);
+        atomic_init(&r->failed, 0);
+        r->inmap = r->outmap = NULL;
+        setup.r = r;
+
+        /* Start cold: the input is to come from the file system, not memory */
+        r->in = open(inpath, O_RDONLY);
+        if (r->in < 0)
+                die(inpath);
+        fdatasync(r->in);
+        posix_fadvise(r->in, 0, 0, POSIX_FADV_DONTNEED);
+        close(r->in);
+
+        getrusage(RUSAGE_SELF, &ru0);
+        t0 = now();
+        r->in = SYS(&setup, open(inpath, O_RDONLY | direct));
+        r->out = SYS(&setup, open(outpath, (r->strategy == MMAP ? O_RDWR : O_WRONLY) |
+                                  O_CREAT | O_TRUNC | direct, 0600));
+        if (r->in < 0 || r->out < 0) {
+                if (errno != EINVAL)
+                        die(r->in < 0 ? inpath : outpath);
+                if (r->in >= 0)
+                        close(r->in);
+                unlink(outpath);
+                return -1;
+        }
+        if (SYS(&setup, ftruncate(r->out, (off_t)r->size)) != 0)
+                die(outpath);
+        if (r->strategy == MMAP) {
+                r->inmap = SYS(&setup, mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->in, 0));
+                r->outmap = SYS(&setup, mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, r->out, 0));
+                if (r->inmap == MAP_FAILED || r->outmap == MAP_FAILED)
+                        die("mmap");
+        }
+
+        for (i = 0; i < threads; i++) {
+                parts[i].r = r;
+                parts[i].syscalls = 0;
+                parts[i].from = chunks * (unsigned long long)i / (unsigned)threads * CHUNK;
+                parts[i].to = chunks * (unsigned long long)(i + 1) / (unsigned)threads * CHUNK;
+                if (parts[i].to > r->size)
+                        parts[i].to = r->size;
+        }
+        for (i = 1; i < threads; i++)
+                if (pthread_create(&parts[i].thread, NULL, part_thread, &parts[i]) != 0)
+                        die("pthread_create");
+        part_thread(&parts[0]);
+        for (i = 1; i < threads; i++)
+                pthread_join(parts[i].thread, NULL);
+
+        if (r->strategy == MMAP) {
+                SYS(&setup, msync(r->outmap, r->size, MS_SYNC));
+                SYS(&setup, munmap(r->outmap, r->size));
+                SYS(&setup, munmap(r->inmap, r->size));
+        }
+        if (SYS(&setup, fsync(r->out)) != 0)
+                die("fsync");
+        SYS(&setup, close(r->out));
+        SYS(&setup, close(r->in));
+        res->wall = now() - t0;
+        getrusage(RUSAGE_SELF, &ru1);
+
+        res->cpu = seconds(ru1.ru_utime) - seconds(ru0.ru_utime) +
+                   seconds(ru1.ru_stime) - seconds(ru0.ru_stime);
+        res->sys = seconds(ru1.ru_stime) - seconds(ru0.ru_stime);
+        res->syscalls = atomic_load(&r->syscalls) + setup.syscalls;
+        res->faults = (unsigned long long)(ru1.ru_minflt - ru0.ru_minflt +
+                                           ru1.ru_majflt - ru0.ru_majflt);
+        res->ok = !r->failed && output_checksum(outpath) == expect;
+
+        /* Leave the next run the memory this one's output took */
+        r->out = open(outpath, O_RDONLY);
+        if (r->out >= 0) {
+                posix_fadvise(r->out, 0, 0, POSIX_FADV_DONTNEED);
+                close(r->out);
+        }
+        unlink(outpath);
+        return 0;
+}
+
+/*
+ * Write the test file, and work out the checksum of its ciphertext in
+ * each mode while it is in memory; the time that takes is the
+ * encryption alone, for comparison.
+ */
+static void make_input(char const *path, struct run *r, unsigned long long expect[2],
+                       double mem[2])
+{
+        unsigned char *plain = malloc(CHUNK), *crypt = malloc(CHUNK);
+        struct gost_stream s[2];
+        unsigned long long off;
+        size_t n;
+        double t0;
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600), k;
+
+        if (fd < 0 || !plain || !crypt)
+                die(path);
+        for (k = 0; k < 2; k++) {
+                goststreaminit(&s[k], k == 0 ? GOST_MODE_GAMMA : GOST_MODE_CFB, 0, r->iv);
+                expect[k] = 0xcbf29ce484222325ULL;
+                mem[k] = 0;
+        }
+        for (off = 0; off < r->size; off += n) {
+                n = r->size - off < CHUNK ? (size_t)(r->size - off) : CHUNK;
+                fill(plain, n, off);
+                if (write(fd, plain, n) != (ssize_t)n)
+                        die(path);
+                for (k = 0; k < 2; k++) {
+                        t0 = now();
+                        goststream(&s[k], plain, crypt, n, r->key);
+                        mem[k] += now() - t0;
+                        expect[k] = checksum(expect[k], crypt, n);
+                }
+        }
+        if (fsync(fd) != 0 || close(fd) != 0)
+                die(path);
+        free(crypt);
+        free(plain);
+}
+
+static char const *fs_name(char const *dir)
+{
+        static char name[32];
+        struct statfs st;
+
+        if (statfs(dir, &st) != 0)
+                return "?";
+        switch ((unsigned long)st.f_type) {
+        case 0x01021994UL:
+                return "tmpfs";
+        case 0xef53UL:
+                return "ext4";
+        case 0x58465342UL:
+                return "xfs";
+        case 0x9123683eUL:
+                return "btrfs";
+        case 0x2fc12fc1UL:
+                return "zfs";
+        }
+        snprintf(name, sizeof(name), "0x%lx", (unsigned long)st.f_type);
+        return name;
+}
+
+static void bench_dir(char const *dir, unsigned long long size, int maxthreads)
+{
+        char inpath[4096], outpath[4096];
+        unsigned long long expect[2];
+        double mem[2], gib = (double)size / (1 << 30), mib = (double)size / (1 << 20);
+        struct result res;
+        struct run r;
+        int mode, strategy, threads;
+
+        memset(&r, 0, sizeof(r));
+        r.size = size;
+        for (int i = 0; i < 8; i++)
+                r.key[i] = (word32)(0x01020304UL * (i + 1));
+        r.iv[0] = 0x01234567;
+        r.iv[1] = 0x89abcdef;
+        snprintf(inpath, sizeof(inpath), "%s/gost_iobench.%ld.in", dir, (long)getpid());
+        snprintf(outpath, sizeof(outpath), "%s/gost_iobench.%ld.out", dir, (long)getpid());
+        make_input(inpath, &r, expect, mem);
+
+        printf("%s (%s), %.0f MiB\n", dir, fs_name(dir), mib);
+        printf("  %-10s %-5s %7s %8s %9s %6s %6s %12s %11s\n", "strategy", "mode",
+               "threads", "wall s", "MiB/s", "cpu%", "sys%", "syscalls/GiB",
+               "faults/GiB");
+        for (mode = 0; mode < 2; mode++)
+                printf("  %-10s %-5s %7d %8.3f %9.1f\n", "memory", mode_names[mode], 1,
+                       mem[mode], mib / mem[mode]);
+        for (strategy = 0; strategy < NSTRATEGIES; strategy++)
+                for (mode = 0; mode < 2; mode++)
+                        for (threads = 1; threads <= maxthreads; threads *= 2) {
+                                if (mode == 1 && threads > 1)
+                                        break;  /* One CFB chain */
+                                r.strategy = strategy;
+                                r.mode = mode;
+                                if (run_one(&r, inpath, outpath, threads, expect[mode],
+                                            &res) != 0) {
+                                        printf("  %-10s %-5s %7d  not supported here\n",
+                                               strategy_names[strategy],
+                                               mode_names[mode], threads);
+                                        break;
+                                }
+                                printf("  %-10s %-5s %7d %8.3f %9.1f %6.1f %6.1f %12.0f %11.0f%s\n",
+                                       strategy_names[strategy], mode_names[mode],
+                                       threads, res.wall, mib / res.wall,
+                                       100 * res.cpu / res.wall, 100 * res.sys / res.wall,
+                                       res.syscalls / gib, res.faults / gib,
+                                       res.ok ? "" : "  WRONG OUTPUT");
+                                fflush(stdout);
+                        }
+        unlink(inpath);
+}
+
+static void usage(char const *prog)
+{
+        fprintf(stderr, "Usage: %s [-s mib] [-t threads] [dir ...]\n", prog);
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        char const *defaults[] = { "/dev/shm", "." };
+        struct gost_tunables t;
+        unsigned long long mib = 128;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int maxthreads = ncpu > 0 ? (int)ncpu : 1, opt, i;
+
+        while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+                switch (opt) {
+                case 's':
+                        mib = strtoull(optarg, NULL, 0);
+                        break;
+                case 't':
+                        maxthreads = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (mib == 0 || maxthreads < 1 || maxthreads > 64 || argc - optind > MAX_DIRS)
+                usage(argv[0]);
+
+        kboxinit();
+        gostgettunables(&t);
+        t.threads = 1;
+        gostsettunables(&t);
+
+        if (optind == argc)
+                for (i = 0; i < 2; i++)
+                        bench_dir(defaults[i], mib << 20, maxthreads);
+        for (i = optind; i < argc; i++)
+                bench_dir(argv[i], mib << 20, maxthreads);
+        return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * Read-only views of gamma-encrypted files that decrypt each page the
+ * first time it is touched.
+ *
+ * The view is reserved up front and holds nothing.  A fault on a page
+ * reads the ciphertext at that page's offset, decrypts it from its own
+ * place in the gamma stream, and fills it together with the absent
+ * pages after it, up to the read-ahead, in one wide batch.  Mapping
+ * costs the same whatever the file's size; only pages read are paid for.
+ *
+ * The faults come by userfaultfd where the kernel allows it, to a
+ * thread that fills pages with UFFDIO_COPY.  Elsewhere the view is a
+ * PROT_NONE mapping of shared memory and SIGSEGV does the work: the
+ * handler decrypts into a second, writable mapping of the same memory
+ * and only then opens the page to readers, so nobody sees it half done.
+ * A page's state goes ABSENT, FILLING, PRESENT by compare and swap, so
+ * of several threads faulting on it one fills it and the rest wait.
+ * The handler does nothing that is not safe in a signal: pread(),
+ * mprotect(), and gostgammav(), which takes no locks and never goes
+ * to the pool.
+ */
+#define _GNU_SOURCE             /* memfd_create() */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "gost.h"
+#include "gostwords.h"
+
+#define LAZY_READAHEAD 16       /* Pages filled per fault by default */
+#define LAZY_MAXMAPS 64         /* Signal-mode maps live at once */
+
+enum { ABSENT, FILLING, PRESENT };
+
+struct gost_lazymap {
+        word32 key[8];
+        word32 iv[2];
+        int fd;
+        unsigned long long size;
+        size_t pagesize, npages, readahead;
+        unsigned char *base;            /* The caller's view */
+        size_t len;                     /* Of the view, in whole pages */
+        atomic_uchar *state;            /* Per page */
+        atomic_size_t filled, errors;
+
+        /* Signals: the writable view of the same memory, and our slot */
+        unsigned char *fill;
+        int slot;
+
+        /* userfaultfd: the descriptor, the thread and its staging area */
+        int uffd;
+        int stop[2];
+        unsigned char *stage;
+        pthread_t thread;
+};
+
+static _Atomic(struct gost_lazymap *) maps[LAZY_MAXMAPS];
+static struct sigaction oldsegv;
+static pthread_mutex_t lazylock = PTHREAD_MUTEX_INITIALIZER;
+static int installed;
+
+/*
+ * Pages first..first+n-1 of the plaintext into dst.  What the file
+ * cannot supply reads as zeros and is counted as an error.
+ */
+static void
+decryptpages(struct gost_lazymap *m, unsigned char *dst, size_t first, size_t n)
+{
+        unsigned long long off = (unsigned long long)first * m->pagesize;
+        size_t want = n * m->pagesize, got = 0;
+        struct gost_gammavec v;
+        ssize_t r;
+
+        if (off + want > m->size)
+                want = (size_t)(m->size - off);
+        while (got < want) {
+                r = pread(m->fd, dst + got, want - got, (off_t)(off + got));
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r <= 0) {
+                        atomic_fetch_add(&m->errors, 1);
+                        break;
+                }
+                got += (size_t)r;
+        }
+        memset(dst + got, 0, n * m->pagesize - got);
+
+        v.in = (word32 const *)(void const *)dst;
+        v.out = (word32 *)(void *)dst;
+        v.len = (got + 7) / 8;
+        v.iv = m->iv;
+        v.pos = off / 8;
+        if (!gostlittleendian())
+                gostswapwords(v.out, v.len * 2);
+        gostgammav(&v, 1, m->key);
+        if (!gostlittleendian())
+                gostswapwords(v.out, v.len * 2);
+        /* The gamma over the rest of the last block is not data */
+        memset(dst + got, 0, n * m->pagesize - got);
+}
+
+static void
+chain(int sig, siginfo_t *si, void *ctx)
+{
+        struct sigaction dfl;
+
+        if (oldsegv.sa_flags & SA_SIGINFO) {
+                oldsegv.sa_sigaction(sig, si, ctx);
+        } else if (oldsegv.sa_handler != SIG_DFL && oldsegv.sa_handler != SIG_IGN) {
+                oldsegv.sa_handler(sig);
+        } else {
+                /* The access faults again, and this time is fatal */
+                memset(&dfl, 0, sizeof(dfl));
+                dfl.sa_handler = SIG_DFL;
+                sigaction(sig, &dfl, NULL);
+        }
+}
+
+static void
+lazysegv(int sig, siginfo_t *si, void *ctx)
+{
+        int const saved = errno;
+        unsigned char *addr = si->si_addr;
+        struct gost_lazymap *m = NULL;
+        unsigned char expect;
+        size_t page, n, i;
+
+        for (i = 0; i < LAZY_MAXMAPS; i++) {
+                m = atomic_load(&maps[i]);
+                if (m && addr >= m->base && addr < m->base + m->len)
+                        break;
+        }
+        if (i == LAZY_MAXMAPS) {
+                chain(sig, si, ctx);
+                errno = saved;
+                return;
+        }
+
+        page = (size_t)(addr - m->base) / m->pagesize;
+        expect = ABSENT;
+        if (si->si_code != SEGV_ACCERR ||
+            !atomic_compare_exchange_strong(&m->state[page], &expect, FILLING)) {
+                /*
+                 * Not a protection fault, or the page is readable already
+                 * and this is a write: not ours, and returning would only
+                 * fault again.  Otherwise someone else is filling it; back
+                 * to the access once it is in.
+                 */
+                if (si->si_code != SEGV_ACCERR || expect == PRESENT)
+                        chain(sig, si, ctx);
+                else
+                        while (atomic_load(&m->state[page]) != PRESENT)
+                                sched_yield();
+                errno = saved;
+                return;
+        }
+        for (n = 1; n < m->readahead && page + n < m->npages; n++) {
+                expect = ABSENT;
+                if (!atomic_compare_exchange_strong(&m->state[page + n], &expect,
+                                                    FILLING))
+                        break;
+        }
+        decryptpages(m, m->fill + page * m->pagesize, page, n);
+        mprotect(m->base + page * m->pagesize, n * m->pagesize, PROT_READ);
+        for (i = 0; i < n; i++)
+                atomic_store(&m->state[page + i], PRESENT);
+        atomic_fetch_add(&m->filled, n);
+        errno = saved;
+}
+
+static int
+signalstart(struct gost_lazymap *m)
+{
+        struct sigaction sa;
+        struct gost_lazymap *none;
+        int fd, i;
+
+#ifdef __linux__
+        fd = memfd_create("gost_lazymap", MFD_CLOEXEC);
+#else
+        char name[64];
+
+        snprintf(name, sizeof(name), "/gost_lazymap.%ld.%p", (long)getpid(), (void *)m);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        shm_unlink(name);
+#endif
+        if (fd < 0)
+                return -1;
+        if (ftruncate(fd, (off_t)m->len) != 0) {
+                close(fd);
+                return -1;
+        }
+        m->base = mmap(NULL, m->len, PROT_NONE, MAP_SHARED, fd, 0);
+        m->fill = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m->base == MAP_FAILED || m->fill == MAP_FAILED) {
+                if (m->base != MAP_FAILED)
+                        munmap(m->base, m->len);
+                if (m->fill != MAP_FAILED)
+                        munmap(m->fill, m->len);
+                return -1;
+        }
+
+        pthread_mutex_lock(&lazylock);
+        for (i = 0; i < LAZY_MAXMAPS; i++) {
+                none = NULL;
+                if (atomic_compare_exchange_strong(&maps[i], &none, m))
+                        break;
+        }
+        if (i < LAZY_MAXMAPS && !installed) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_sigaction = lazysegv;
+                sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+                sigemptyset(&sa.sa_mask);
+                installed = sigaction(SIGSEGV, &sa, &oldsegv) == 0;
+        }
+        pthread_mutex_unlock(&lazylock);
+        if (i == LAZY_MAXMAPS || !installed) {
+                if (i < LAZY_MAXMAPS)
+                        atomic_store(&maps[i], NULL);
+                munmap(m->base, m->len);
+                munmap(m->fill, m->len);
+                return -1;
+        }
+        m->slot = i;
+        return 0;
+}
+
+#ifdef __linux__
+static void
+uffdwake(struct gost_lazymap *m, unsigned char *page)
+{
+        struct uffdio_range w;
+
+        w.start = (unsigned long)(uintptr_t)page;
+        w.len = m->pagesize;
+        ioctl(m->uffd, UFFDIO_WAKE, &w);
+}
+
+/* Fill len bytes at dst from src, page by page if some are there already */
+static void
+uffdcopy(struct gost_lazymap *m, unsigned char *dst, unsigned char *src,
+         size_t len)
+{
+        struct uffdio_copy c;
+        size_t i;
+
+        c.dst = (unsigned long)(uintptr_t)dst;
+        c.src = (unsigned long)(uintptr_t)src;
+        c.len = len;
+        c.mode = 0;
+        c.copy = 0;
+        if (ioctl(m->uffd, UFFDIO_COPY, &c) == 0)
+                return;
+        for (i = 0; i < len; i += m->pagesize) {
+                c.dst = (unsigned long)(uintptr_t)(dst + i);
+                c.src = (unsigned long)(uintptr_t)(src + i);
+                c.len = m->pagesize;
+                c.mode = 0;
+                c.copy = 0;
+                ioctl(m->uffd, UFFDIO_COPY, &c);
+        }
+        /* Whatever was there, the faulting thread can go on */
+        uffdwake(m, dst);
+}
+
+static void *
+uffdthread(void *arg)
+{
+        struct gost_lazymap *m = arg;
+        struct pollfd p[2];
+        struct uffd_msg msg;
+        unsigned char *fault;
+        size_t page, n, i;
+
+        p[0].fd = m->uffd;
+        p[0].events = POLLIN;
+        p[1].fd = m->stop[0];
+        p[1].events = POLLIN;
+        for (;;) {
+                if (poll(p, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                if (p[1].revents)
+                        break;
+                if (read(m->uffd, &msg, sizeof(msg)) != (ssize_t)sizeof(msg) ||
+                    msg.event != UFFD_EVENT_PAGEFAULT)
+                        continue;
+
+                page = (size_t)((uintptr_t)msg.arg.pagefault.address -
+                                (uintptr_t)m->base) / m->pagesize;
+                fault = m->base + page * m->pagesize;
+                if (atomic_load(&m->state[page]) == PRESENT) {
+                        uffdwake(m, fault);
+                        continue;
+                }
+                for (n = 1; n < m->readahead && page + n < m->npages &&
+                            atomic_load(&m->state[page + n]) == ABSENT; n++)
+                        ;
+                decryptpages(m, m->stage, page, n);
+                /* Counted first: the copy wakes the reader */
+                for (i = 0; i < n; i++)
+                        atomic_store(&m->state[page + i], PRESENT);
+                atomic_fetch_add(&m->filled, n);
+                uffdcopy(m, fault, m->stage, n * m->pagesize);
+        }
+        return NULL;
+}
+
+static int
+uffdstart(struct gost_lazymap *m)
+{
+        struct uffdio_api api;
+        struct uffdio_register reg;
+
+        m->uffd = (int)syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+        /* Unprivileged, faults from user space are all we need */
+        if (m->uffd < 0)
+                m->uffd = (int)syscall(__NR_userfaultfd,
+                                       O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+        if (m->uffd < 0)
+                return -1;
+        memset(&api, 0, sizeof(api));
+        api.api = UFFD_API;
+        if (ioctl(m->uffd, UFFDIO_API, &api) != 0)
+                goto fail;
+
+        m->base = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        m->stage = mmap(NULL, m->readahead * m->pagesize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m->base == MAP_FAILED || m->stage == MAP_FAILED)
+                goto unmap;
+        memset(&reg, 0, sizeof(reg));
+        reg.range.start = (unsigned long)(uintptr_t)m->base;
+        reg.range.len = m->len;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(m->uffd, UFFDIO_REGISTER, &reg) != 0 || pipe(m->stop) != 0)
+                goto unmap;
+        if (pthread_create(&m->thread, NULL, uffdthread, m) != 0) {
+                close(m->stop[0]);
+                close(m->stop[1]);
+                goto unmap;
+        }
+        return 0;
+
+unmap:
+        if (m->base != MAP_FAILED)
+                munmap(m->base, m->len);
+        if (m->stage != MAP_FAILED)
+                munmap(m->stage, m->readahead * m->pagesize);
+fail:
+        close(m->uffd);
+        m->uffd = -1;
+        return -1;
+}
+#endif
+
+struct gost_lazymap *
+gostlazymap(int fd, word32 const iv[2], word32 const key[8], size_t readahead,
+            int flags)
+{
+        struct gost_lazymap *m;
+        struct stat st;
+        long ps = sysconf(_SC_PAGESIZE);
+        int started = -1;
+
+        if (fstat(fd, &st) != 0 || st.st_size <= 0 || ps <= 0 || ps % 8) {
+                errno = EINVAL;
+                return NULL;
+        }
+        m = calloc(1, sizeof(*m));
+        if (!m)
+                return NULL;
+        memcpy(m->key, key, sizeof(m->key));
+        m->iv[0] = iv[0];
+        m->iv[1] = iv[1];
+        m->size = (unsigned long long)st.st_size;
+        m->pagesize = (size_t)ps;
+        m->npages = (size_t)((m->size + m->pagesize - 1) / m->pagesize);
+        m->len = m->npages * m->pagesize;
+        m->readahead = readahead ? readahead : LAZY_READAHEAD;
+        m->uffd = -1;
+        m->slot = -1;
+        m->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        m->state = calloc(m->npages, sizeof(*m->state));
+        if (m->fd < 0 || !m->state)
+                goto fail;
+        atomic_init(&m->filled, 0);
+        atomic_init(&m->errors, 0);
+
+#ifdef __linux__
+        if (!(flags & GOST_LAZY_SIGNALS))
+                started = uffdstart(m);
+#else
+        (void)flags;
+#endif
+        if (started != 0)
+                started = signalstart(m);
+        if (started == 0)
+                return m;
+fail:
+        if (m->fd >= 0)
+                close(m->fd);
+        free(m->state);
+        free(m);
+        return NULL;
+}
+
+void const *
+gostlazyaddr(struct gost_lazymap const *m)
+{
+        return m->base;
+}
+
+unsigned long long
+gostlazysize(struct gost_lazymap const *m)
+{
+        return m->size;
+}
+
+void
+gostlazystats(struct gost_lazymap const *m, size_t *filled, size_t *errors)
+{
+        *filled = atomic_load(&m->filled);
+        *errors = atomic_load(&m->errors);
+}
+
+void
+gostlazyunmap(struct gost_lazymap *m)
+{
+        volatile word32 *k;
+        int i;
+
+        if (!m)
+                return;
+#ifdef __linux__
+        if (m->uffd >= 0) {
+                if (write(m->stop[1], "", 1) != 1)
+                        pthread_cancel(m->thread);
+                pthread_join(m->thread, NULL);
+                close(m->stop[0]);
+                close(m->stop[1]);
+                close(m->uffd);
+                munmap(m->stage, m->readahead * m->pagesize);
+        }
+#endif
+        if (m->slot >= 0) {
+                atomic_store(&maps[m->slot], NULL);
+                munmap(m->fill, m->len);
+        }
+        munmap(m->base, m->len);
+        close(m->fd);
+        for (k = m->key, i = 0; i < 8; i++)
+                k[i] = 0;
+        free(m->state);
+        free(m);
+}
@@ -0,0 +1,313 @@
+/*
+ * Chunked encrypted objects that can be changed in place.
+ *
+ * An object is cut into chunks of a fixed size.  Chunk i is gamma at
+ * byte i * chunk of the stream under the object's IV with its second
+ * word offset by the chunk's generation, and its tag is the MAC of its
+ * index, generation and plaintext.  The tags are the leaves of a binary
+ * tree whose inner nodes are MACs of their two children, so the root
+ * covers the whole object.  Changing a few bytes re-encrypts only their
+ * chunks, one generation on so that no gamma is ever used twice, and
+ * recomputes only those leaves and the nodes above them.
+ *
+ * The IV a chunk's gamma starts from is E(E(iv) ^ generation) under the
+ * object's key, not the object's IV plus the generation: that would be
+ * another object's IV, and so its gamma, whenever IVs are handed out in
+ * sequence.  Encrypted, the IVs of every object and generation are as
+ * far apart as unrelated random ones.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "gost.h"
+#include "probe.h"
+
+#define DOMAIN_LEAF 1           /* Second word of the second block of a tag */
+#define DOMAIN_NODE 2
+
+struct gost_object {
+        word32 key[8];
+        word32 base[2];         /* E(iv), which each generation's IV is drawn from */
+        unsigned long long size;
+        size_t chunk;           /* Bytes, a multiple of 8 */
+        size_t nchunks;
+        size_t leaves;          /* nchunks rounded up to a power of two */
+        word32 *meta;           /* Generations, then the tree */
+        size_t nwords;
+};
+
+static word32 *
+node(struct gost_object const *o, size_t n)
+{
+        return o->meta + o->nchunks + n * 2;
+}
+
+static size_t
+chunkbytes(struct gost_object const *o, size_t i)
+{
+        unsigned long long rest = o->size - (unsigned long long)i * o->chunk;
+
+        return rest < o->chunk ? (size_t)rest : o->chunk;
+}
+
+/*
+ * A stream for chunk i at its current generation, with the MAC already
+ * chained over the chunk's index and generation.  The MAC starts at the
+ * chunk, so the position can be set directly.
+ */
+static void
+chunkstream(struct gost_object const *o, struct gost_stream *s, size_t i,
+            int flags)
+{
+        word32 const gen = o->meta[i];
+        word32 iv[2], head[4];
+
+        iv[0] = o->base[0] ^ gen;
+        iv[1] = o->base[1];
+        gostcrypt(iv, iv, o->key);
+        goststreaminit(s, GOST_MODE_GAMMA, flags | GOST_STREAM_MAC, iv);
+        s->pos = (unsigned long long)i * o->chunk;
+        head[0] = (word32)((unsigned long long)i & 0xffffffff);
+        head[1] = (word32)((unsigned long long)i >> 32);
+        head[2] = gen;
+        head[3] = DOMAIN_LEAF;
+        gostmacchain(head, 2, s->mac, o->key);
+}
+
+static void
+streamtag(struct gost_stream const *s, word32 tag[2], word32 const key[8])
+{
+        unsigned char mac[8];
+
+        goststreammac(s, mac, key);
+        tag[0] = (word32)mac[0] | (word32)mac[1] << 8 |
+                 (word32)mac[2] << 16 | (word32)mac[3] << 24;
+        tag[1] = (word32)mac[4] | (word32)mac[5] << 8 |
+                 (word32)mac[6] << 16 | (word32)mac[7] << 24;
+}
+
+/* Recompute inner node n from its children */
+static void
+nodetag(struct gost_object *o, size_t n)
+{
+        word32 m[8];
+
+        m[0] = (word32)((unsigned long long)n & 0xffffffff);
+        m[1] = (word32)((unsigned long long)n >> 32);
+        m[2] = 0;
+        m[3] = DOMAIN_NODE;
+        memcpy(m + 4, node(o, n * 2), 4 * sizeof(word32));
+        node(o, n)[0] = node(o, n)[1] = 0;
+        gostmacchain(m, 4, node(o, n), o->key);
+}
+
+/* Every node above leaves first..last, a level at a time */
+static void
+rehash(struct gost_object *o, size_t first, size_t last)
+{
+        size_t a = o->leaves + first, b = o->leaves + last, n;
+
+        while (a > 1) {
+                a /= 2;
+                b /= 2;
+                for (n = a; n <= b; n++)
+                        nodetag(o, n);
+        }
+}
+
+static struct gost_object *
+objectalloc(unsigned long long size, size_t chunk, word32 const iv[2],
+            word32 const key[8])
+{
+        struct gost_object *o;
+        unsigned long long n;
+
+        if (chunk == 0 || chunk % 8 || size == 0)
+                return NULL;
+        n = (size - 1) / chunk + 1;
+        if (n > (size_t)-1 / 8)
+                return NULL;
+        o = calloc(1, sizeof(*o));
+        if (!o)
+                return NULL;
+        memcpy(o->key, key, sizeof(o->key));
+        gostcrypt(iv, o->base, o->key);
+        o->size = size;
+        o->chunk = chunk;
+        o->nchunks = (size_t)n;
+        for (o->leaves = 1; o->leaves < o->nchunks; o->leaves *= 2)
+                ;
+        o->nwords = o->nchunks + o->leaves * 4;
+        o->meta = calloc(o->nwords, sizeof(word32));
+        if (!o->meta) {
+                free(o);
+                return NULL;
+        }
+        return o;
+}
+
+struct gost_object *
+gostobjectseal(unsigned char const *plain, unsigned char *cipher,
+               unsigned long long size, size_t chunk, word32 const iv[2],
+               word32 const key[8])
+{
+        struct gost_object *o = objectalloc(size, chunk, iv, key);
+        struct gost_stream s;
+        size_t i, off;
+
+        if (!o)
+                return NULL;
+        GOST_PROBE2(entry, "objectseal", size);
+        for (i = 0; i < o->nchunks; i++) {
+                off = i * chunk;
+                chunkstream(o, &s, i, 0);
+                goststream(&s, plain + off, cipher + off, chunkbytes(o, i), key);
+                streamtag(&s, node(o, o->leaves + i), key);
+        }
+        rehash(o, 0, o->leaves - 1);
+        GOST_PROBE1(exit, "objectseal");
+        return o;
+}
+
+struct gost_object *
+gostobjectopen(word32 const *meta, unsigned long long size, size_t chunk,
+               word32 const iv[2], word32 const key[8])
+{
+        struct gost_object *o = objectalloc(size, chunk, iv, key);
+
+        if (!o)
+                return NULL;
+        memcpy(o->meta, meta, o->nwords * sizeof(word32));
+        rehash(o, 0, o->leaves - 1);
+        if (memcmp(o->meta, meta, o->nwords * sizeof(word32)) != 0) {
+                gostobjectfree(o);
+                return NULL;
+        }
+        return o;
+}
+
+void
+gostobjectfree(struct gost_object *o)
+{
+        volatile word32 *k;
+        int i;
+
+        if (!o)
+                return;
+        for (k = o->key, i = 0; i < 8; i++)
+                k[i] = 0;
+        free(o->meta);
+        free(o);
+}
+
+word32 const *
+gostobjectmeta(struct gost_object const *o, size_t *nwords)
+{
+        *nwords = o->nwords;
+        return o->meta;
+}
+
+void
+gostobjectroot(struct gost_object const *o, word32 root[2])
+{
+        root[0] = node(o, 1)[0];
+        root[1] = node(o, 1)[1];
+}
+
+/* Decrypt chunk i into buf and check it against its leaf */
+static int
+openchunk(struct gost_object const *o, unsigned char const *cipher, size_t i,
+          unsigned char *buf)
+{
+        struct gost_stream s;
+        word32 tag[2];
+        word32 const *leaf = node(o, o->leaves + i);
+
+        chunkstream(o, &s, i, GOST_STREAM_DECRYPT);
+        goststream(&s, cipher + i * o->chunk, buf, chunkbytes(o, i), o->key);
+        streamtag(&s, tag, o->key);
+        return ((tag[0] ^ leaf[0]) | (tag[1] ^ leaf[1])) ? -1 : 0;
+}
+
+/* The chunks from..to hold bytes off..off+len-1; 0 if len is 0 */
+static int
+span(struct gost_object const *o, unsigned long long off, size_t len,
+     size_t *from, size_t *to)
+{
+        if (off > o->size || len > o->size - off)
+                return -1;
+        if (len == 0)
+                return 0;
+        *from = (size_t)(off / o->chunk);
+        *to = (size_t)((off + len - 1) / o->chunk);
+        return 1;
+}
+
+int
+gostobjectread(struct gost_object const *o, unsigned char const *cipher,
+               unsigned long long off, unsigned char *out, size_t len)
+{
+        unsigned char *buf;
+        size_t from, to, i, skip, n;
+        int r = span(o, off, len, &from, &to);
+
+        if (r <= 0)
+                return r;
+        buf = malloc(o->chunk);
+        if (!buf)
+                return -1;
+        GOST_PROBE2(entry, "objectread", len);
+        for (i = from; i <= to && r == 1; i++) {
+                if (openchunk(o, cipher, i, buf) != 0) {
+                        r = -1;
+                        break;
+                }
+                skip = (size_t)(off - (unsigned long long)i * o->chunk);
+                n = chunkbytes(o, i) - skip < len ? chunkbytes(o, i) - skip : len;
+                memcpy(out, buf + skip, n);
+                out += n;
+                off += n;
+                len -= n;
+        }
+        free(buf);
+        GOST_PROBE1(exit, "objectread");
+        return r < 0 ? -1 : 0;
+}
+
+int
+gostobjectupdate(struct gost_object *o, unsigned char *cipher,
+                 unsigned long long off, unsigned char const *data, size_t len)
+{
+        struct gost_stream s;
+        unsigned char *buf, *p;
+        size_t from, to, i, skip;
+        int r = span(o, off, len, &from, &to);
+
+        if (r <= 0)
+                return r;
+        GOST_PROBE2(entry, "objectupdate", len);
+        /* Nothing is touched unless every chunk is sound */
+        buf = malloc((to - from + 1) * o->chunk);
+        if (!buf)
+                return -1;
+        for (i = from, p = buf; i <= to; i++, p += o->chunk)
+                if (o->meta[i] == 0xffffffff || openchunk(o, cipher, i, p) != 0) {
+                        free(buf);
+                        GOST_PROBE1(exit, "objectupdate");
+                        return -1;
+                }
+        skip = (size_t)(off - (unsigned long long)from * o->chunk);
+        memcpy(buf + skip, data, len);
+
+        for (i = from, p = buf; i <= to; i++, p += o->chunk) {
+                o->meta[i]++;
+                chunkstream(o, &s, i, 0);
+                goststream(&s, p, cipher + i * o->chunk, chunkbytes(o, i), o->key);
+                streamtag(&s, node(o, o->leaves + i), o->key);
+        }
+        rehash(o, from, to);
+        memset(buf, 0, (to - from + 1) * o->chunk);
+        free(buf);
+        GOST_PROBE1(exit, "objectupdate");
+        return 0;
+}
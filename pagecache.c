@@ -0,0 +1,380 @@
+/*
+ * A bounded cache of decrypted pages, keyed by object and page.
+ *
+ * The frames are split among shards, each with its own lock, hash
+ * chains and CLOCK hand, so lookups of different pages rarely meet.
+ * A hit pins its frame and costs a hash lookup; the page stays put
+ * until gostcacherelease(), and eviction passes over pinned frames.
+ *
+ * A miss claims a frame, publishes it LOADING so later lookups of the
+ * same page wait instead of loading it again, and queues it.  Misses
+ * from every shard share one queue: whichever waiter finds no fill
+ * running takes everything queued, reads the ciphertext of each page
+ * and decrypts them all in one gostgammav() call, so a burst of
+ * concurrent misses is one batch through the wide kernel rather than
+ * many short calls.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gost.h"
+#include "gostwords.h"
+
+enum { EMPTY, LOADING, VALID, FAILED };
+
+struct frame {
+        unsigned long long object, page;
+        struct frame *next;             /* In its hash chain */
+        unsigned pins;
+        unsigned char ref;              /* CLOCK's second chance */
+        unsigned char hashed;
+        atomic_uchar state;
+};
+
+struct shard {
+        pthread_mutex_t lock;
+        struct frame *frames;
+        size_t nframes, hand;
+        struct frame **bucket;
+        size_t mask;
+        unsigned long long hits, misses, evictions;
+};
+
+struct gost_cache {
+        word32 key[8];
+        size_t pagesize, nframes, nshards, pershard;
+        gost_cacheread read;
+        void *arg;
+        unsigned char *data;            /* nframes pages */
+        struct frame *frames;
+        struct shard *shards;
+
+        /* Misses waiting for a fill, and the fill's own arrays */
+        pthread_mutex_t qlock;
+        pthread_cond_t done;
+        struct frame **pending, **batch;
+        size_t npending;
+        int filling;
+        struct gost_gammavec *vec;
+        word32 *iv;
+        unsigned long long batches, failures;
+};
+
+static unsigned long long
+hash(unsigned long long object, unsigned long long page)
+{
+        unsigned long long h = object * 0x9e3779b97f4a7c15ULL ^ page;
+
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        return h ^ h >> 29;
+}
+
+static unsigned char *
+framedata(struct gost_cache const *c, struct frame const *f)
+{
+        return c->data + (size_t)(f - c->frames) * c->pagesize;
+}
+
+static struct frame **
+chain(struct shard *s, unsigned long long h)
+{
+        return &s->bucket[(h >> 32) & s->mask];
+}
+
+static void
+unhash(struct shard *s, struct frame *f)
+{
+        struct frame **p = chain(s, hash(f->object, f->page));
+
+        while (*p != f)
+                p = &(*p)->next;
+        *p = f->next;
+        f->hashed = 0;
+}
+
+/* An unpinned frame to reuse, taken out of the table, or NULL */
+static struct frame *
+victim(struct shard *s)
+{
+        struct frame *f;
+        size_t scan;
+
+        for (scan = 0; scan < 2 * s->nframes; scan++) {
+                f = &s->frames[s->hand];
+                s->hand = (s->hand + 1) % s->nframes;
+                if (f->pins)
+                        continue;
+                if (f->ref) {
+                        f->ref = 0;
+                        continue;
+                }
+                if (f->hashed) {
+                        unhash(s, f);
+                        s->evictions++;
+                }
+                return f;
+        }
+        return NULL;
+}
+
+struct gost_cache *
+gostcachenew(size_t pagesize, size_t pages, size_t shards, gost_cacheread read,
+             void *arg, word32 const key[8])
+{
+        struct gost_cache *c;
+        size_t i, b;
+
+        if (pagesize == 0 || pagesize % 8 || shards == 0 || pages < shards ||
+            !read) {
+                errno = EINVAL;
+                return NULL;
+        }
+        c = calloc(1, sizeof(*c));
+        if (!c)
+                return NULL;
+        memcpy(c->key, key, sizeof(c->key));
+        c->pagesize = pagesize;
+        c->nshards = shards;
+        c->pershard = (pages + shards - 1) / shards;
+        c->nframes = c->pershard * shards;
+        c->read = read;
+        c->arg = arg;
+        c->data = malloc(c->nframes * pagesize);
+        c->frames = calloc(c->nframes, sizeof(*c->frames));
+        c->shards = calloc(shards, sizeof(*c->shards));
+        c->pending = malloc(c->nframes * sizeof(*c->pending));
+        c->batch = malloc(c->nframes * sizeof(*c->batch));
+        c->vec = malloc(c->nframes * sizeof(*c->vec));
+        c->iv = malloc(c->nframes * 2 * sizeof(*c->iv));
+        if (!c->data || !c->frames || !c->shards || !c->pending || !c->batch ||
+            !c->vec || !c->iv)
+                goto fail;
+        for (b = 1; b < c->pershard; b *= 2)
+                ;
+        for (i = 0; i < shards; i++) {
+                struct shard *s = &c->shards[i];
+
+                s->frames = c->frames + i * c->pershard;
+                s->nframes = c->pershard;
+                s->mask = b - 1;
+                s->bucket = calloc(b, sizeof(*s->bucket));
+                if (!s->bucket)
+                        goto fail;
+                pthread_mutex_init(&s->lock, NULL);
+        }
+        for (i = 0; i < c->nframes; i++)
+                atomic_init(&c->frames[i].state, EMPTY);
+        pthread_mutex_init(&c->qlock, NULL);
+        pthread_cond_init(&c->done, NULL);
+        return c;
+
+fail:
+        if (c->shards)
+                for (i = 0; i < shards; i++)
+                        free(c->shards[i].bucket);
+        free(c->iv);
+        free(c->vec);
+        free(c->batch);
+        free(c->pending);
+        free(c->shards);
+        free(c->frames);
+        free(c->data);
+        free(c);
+        return NULL;
+}
+
+void
+gostcachefree(struct gost_cache *c)
+{
+        volatile word32 *k;
+        size_t i;
+
+        if (!c)
+                return;
+        for (i = 0; i < c->nshards; i++) {
+                pthread_mutex_destroy(&c->shards[i].lock);
+                free(c->shards[i].bucket);
+        }
+        pthread_mutex_destroy(&c->qlock);
+        pthread_cond_destroy(&c->done);
+        for (k = c->key, i = 0; i < 8; i++)
+                k[i] = 0;
+        memset(c->data, 0, c->nframes * c->pagesize);
+        free(c->iv);
+        free(c->vec);
+        free(c->batch);
+        free(c->pending);
+        free(c->shards);
+        free(c->frames);
+        free(c->data);
+        free(c);
+}
+
+/*
+ * Everything queued, read and decrypted as one batch.  Called and
+ * returns with qlock held; drops it while it works.
+ */
+static void
+fill(struct gost_cache *c)
+{
+        size_t const n = c->npending, words = c->pagesize / 4;
+        size_t i, k;
+
+        memcpy(c->batch, c->pending, n * sizeof(*c->batch));
+        c->npending = 0;
+        c->filling = 1;
+        pthread_mutex_unlock(&c->qlock);
+
+        for (i = k = 0; i < n; i++) {
+                struct frame *f = c->batch[i];
+                unsigned char *p = framedata(c, f);
+                word32 *iv = c->iv + i * 2;
+
+                if (c->read(c->arg, f->object, f->page, p, iv) != 0) {
+                        struct shard *s = &c->shards[(size_t)(f - c->frames) /
+                                                     c->pershard];
+
+                        /* Out of the table first, so the next lookup tries again */
+                        memset(p, 0, c->pagesize);
+                        pthread_mutex_lock(&s->lock);
+                        if (f->hashed)
+                                unhash(s, f);
+                        pthread_mutex_unlock(&s->lock);
+                        atomic_store(&f->state, FAILED);
+                        continue;
+                }
+                c->vec[k].in = (word32 const *)(void const *)p;
+                c->vec[k].out = (word32 *)(void *)p;
+                c->vec[k].len = c->pagesize / 8;
+                c->vec[k].iv = iv;
+                c->vec[k].pos = f->page * (c->pagesize / 8);
+                if (!gostlittleendian())
+                        gostswapwords(c->vec[k].out, words);
+                k++;
+        }
+        gostgammav(c->vec, k, c->key);
+        if (!gostlittleendian())
+                for (i = 0; i < k; i++)
+                        gostswapwords(c->vec[i].out, words);
+
+        pthread_mutex_lock(&c->qlock);
+        for (i = 0; i < n; i++)
+                if (atomic_load(&c->batch[i]->state) == LOADING)
+                        atomic_store(&c->batch[i]->state, VALID);
+        c->failures += n - k;
+        c->batches++;
+        c->filling = 0;
+        pthread_cond_broadcast(&c->done);
+}
+
+unsigned char const *
+gostcacheget(struct gost_cache *c, unsigned long long object,
+             unsigned long long page)
+{
+        unsigned long long const h = hash(object, page);
+        struct shard *s = &c->shards[h % c->nshards];
+        struct frame *f, **head;
+        int miss = 0;
+
+        pthread_mutex_lock(&s->lock);
+        head = chain(s, h);
+        for (f = *head; f; f = f->next)
+                if (f->object == object && f->page == page)
+                        break;
+        if (f) {
+                s->hits++;
+        } else {
+                f = victim(s);
+                if (!f) {
+                        pthread_mutex_unlock(&s->lock);
+                        errno = EBUSY;
+                        return NULL;
+                }
+                s->misses++;
+                miss = 1;
+                f->object = object;
+                f->page = page;
+                f->next = *head;
+                *head = f;
+                f->hashed = 1;
+                atomic_store(&f->state, LOADING);
+        }
+        f->pins++;
+        f->ref = 1;
+        pthread_mutex_unlock(&s->lock);
+
+        if (miss || atomic_load(&f->state) == LOADING) {
+                pthread_mutex_lock(&c->qlock);
+                if (miss)
+                        c->pending[c->npending++] = f;
+                while (atomic_load(&f->state) == LOADING) {
+                        if (!c->filling && c->npending)
+                                fill(c);
+                        else
+                                pthread_cond_wait(&c->done, &c->qlock);
+                }
+                pthread_mutex_unlock(&c->qlock);
+        }
+        if (atomic_load(&f->state) != VALID) {
+                pthread_mutex_lock(&s->lock);
+                f->pins--;
+                pthread_mutex_unlock(&s->lock);
+                errno = EIO;
+                return NULL;
+        }
+        return framedata(c, f);
+}
+
+void
+gostcacherelease(struct gost_cache *c, unsigned char const *p)
+{
+        size_t const i = (size_t)(p - c->data) / c->pagesize;
+        struct shard *s = &c->shards[i / c->pershard];
+
+        pthread_mutex_lock(&s->lock);
+        c->frames[i].pins--;
+        pthread_mutex_unlock(&s->lock);
+}
+
+void
+gostcacheinvalidate(struct gost_cache *c, unsigned long long object,
+                    unsigned long long page)
+{
+        unsigned long long const h = hash(object, page);
+        struct shard *s = &c->shards[h % c->nshards];
+        struct frame *f;
+
+        pthread_mutex_lock(&s->lock);
+        for (f = *chain(s, h); f; f = f->next)
+                if (f->object == object && f->page == page) {
+                        /* Holders keep what they have; the next get reloads */
+                        unhash(s, f);
+                        break;
+                }
+        pthread_mutex_unlock(&s->lock);
+}
+
+void
+gostcachestats(struct gost_cache *c, struct gost_cachestats *st)
+{
+        size_t i;
+
+        memset(st, 0, sizeof(*st));
+        for (i = 0; i < c->nshards; i++) {
+                struct shard *s = &c->shards[i];
+
+                pthread_mutex_lock(&s->lock);
+                st->hits += s->hits;
+                st->misses += s->misses;
+                st->evictions += s->evictions;
+                pthread_mutex_unlock(&s->lock);
+        }
+        pthread_mutex_lock(&c->qlock);
+        st->batches = c->batches;
+        st->failures = c->failures;
+        pthread_mutex_unlock(&c->qlock);
+}
@@ -0,0 +1,202 @@
+/*
+ * A small fork-join thread pool for the bulk modes.
+ *
+ * gostparallel() splits a job into parts and runs them on the pool's
+ * workers, with the calling thread taking parts too; it returns once
+ * every part is done.  Several callers may have jobs in the pool at
+ * once: workers take parts from the oldest job first, and the load
+ * they report lets the planner fan out less when the pool is busy.
+ *
+ * The workers are started on first use.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gost.h"
+#include "probe.h"
+
+struct job {
+        void (*fn)(void *arg, size_t part);
+        void *arg;
+        size_t nparts;
+        size_t next;            /* First part nobody has taken yet */
+        size_t done;            /* Parts finished */
+        struct job *link;       /* Queue of jobs with parts left to take */
+        pthread_cond_t finished;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static struct job *head, *tail;
+static pthread_t *workers;
+static int nworkers;
+static int busy;                /* Workers running a part */
+static int stopping;
+
+/* Take the next part of the oldest job; called with the lock held */
+static struct job *
+takepart(size_t *part)
+{
+        struct job *j = head;
+
+        if (!j)
+                return NULL;
+        *part = j->next++;
+        if (j->next == j->nparts) {
+                head = j->link;
+                if (!head)
+                        tail = NULL;
+        }
+        return j;
+}
+
+static void
+runpart(struct job *j, size_t part)
+{
+        j->fn(j->arg, part);
+
+        pthread_mutex_lock(&lock);
+        if (++j->done == j->nparts)
+                pthread_cond_signal(&j->finished);
+        pthread_mutex_unlock(&lock);
+}
+
+static void *
+worker(void *unused)
+{
+        struct job *j;
+        size_t part;
+
+        (void)unused;
+        pthread_mutex_lock(&lock);
+        for (;;) {
+                while (!head && !stopping)
+                        pthread_cond_wait(&work, &lock);
+                if (stopping)
+                        break;
+                j = takepart(&part);
+                busy++;
+                pthread_mutex_unlock(&lock);
+
+                runpart(j, part);
+
+                pthread_mutex_lock(&lock);
+                busy--;
+        }
+        pthread_mutex_unlock(&lock);
+        return NULL;
+}
+
+int
+gostpoolthreads(void)
+{
+        struct gost_tunables t;
+        long n;
+
+        gostgettunables(&t);
+        if (t.threads > 0)
+                return t.threads;
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int)n : 1;
+}
+
+/* Start the workers if they are not running; called with the lock held */
+static void
+poolstart(void)
+{
+        int i, n = gostpoolthreads() - 1;
+
+        if (workers || n <= 0)
+                return;
+        workers = malloc((size_t)n * sizeof(*workers));
+        if (!workers)
+                return;         /* Callers still run every part themselves */
+        for (i = 0; i < n; i++)
+                if (pthread_create(&workers[i], NULL, worker, NULL) != 0)
+                        break;
+        nworkers = i;
+}
+
+void
+gostpoolstop(void)
+{
+        int i;
+
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&lock);
+
+        for (i = 0; i < nworkers; i++)
+                pthread_join(workers[i], NULL);
+
+        pthread_mutex_lock(&lock);
+        free(workers);
+        workers = NULL;
+        nworkers = 0;
+        stopping = 0;
+        pthread_mutex_unlock(&lock);
+}
+
+int
+gostpoolidle(void)
+{
+        int idle;
+
+        pthread_mutex_lock(&lock);
+        poolstart();
+        idle = nworkers - busy;
+        if (head)
+                idle = 0;       /* Someone's parts are already waiting */
+        pthread_mutex_unlock(&lock);
+        return idle > 0 ? idle : 0;
+}
+
+void
+gostparallel(void (*fn)(void *arg, size_t part), void *arg, size_t nparts)
+{
+        struct job j, *taken;
+        size_t part;
+
+        if (nparts == 0)
+                return;
+        if (nparts == 1) {
+                fn(arg, 0);
+                return;
+        }
+
+        j.fn = fn;
+        j.arg = arg;
+        j.nparts = nparts;
+        j.next = 0;
+        j.done = 0;
+        j.link = NULL;
+        pthread_cond_init(&j.finished, NULL);
+
+        pthread_mutex_lock(&lock);
+        poolstart();
+        GOST_PROBE2(pool_job, nparts, nworkers - busy);
+        if (tail)
+                tail->link = &j;
+        else
+                head = &j;
+        tail = &j;
+        pthread_cond_broadcast(&work);
+
+        /*
+         * Take parts rather than sleep until ours are all claimed.  The
+         * oldest job comes first, so this may mean helping someone else.
+         */
+        while (j.next < j.nparts) {
+                taken = takepart(&part);
+                pthread_mutex_unlock(&lock);
+                runpart(taken, part);
+                pthread_mutex_lock(&lock);
+        }
+        while (j.done < j.nparts)
+                pthread_cond_wait(&j.finished, &lock);
+        pthread_mutex_unlock(&lock);
+
+        pthread_cond_destroy(&j.finished);
+}
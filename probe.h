@@ -0,0 +1,67 @@
+#ifndef GOST_PROBE_H
+#define GOST_PROBE_H
+
+/*
+ * Static tracepoints (USDT) for perf, bpftrace and SystemTap.
+ *
+ * With <sys/sdt.h> each probe is a single nop plus an ELF note that the
+ * tracer uses to patch it when attached, so a probe costs next to
+ * nothing until somebody is listening.  Without the header, or with
+ * GOST_NO_PROBES defined, the probes compile away and their arguments
+ * are never evaluated.
+ *
+ * The provider is "gost".  mode is a string and counts are in blocks:
+ *
+ *      "ecb", "gamma", "cfbdec", "ofb", "cfbencrypt", "cfbdecrypt", "mac"
+ *      "gammav"                vectors, and batches of blocks across them
+ *      "ctr", "ofb3413", "cbcencrypt", "cbcdecrypt", "cfbencrypt3413",
+ *      "cfbdecrypt3413"        the modes of GOST R 34.13-2015
+ *
+ * but in bytes for the byte interfaces, messages for "cmacbatch" and
+ * requests for "sessions", whose batches are of blocks:
+ *
+ *      "stream", "recrypt"     goststream(), goststreamrecrypt()
+ *      "objectseal", "objectread", "objectupdate"
+ *      "cmac", "cmacbatch"     gostcmac(), gostcmacbatch()
+ *      "sessions"              gostsessionscrypt()
+ *
+ *      entry(mode, count)              a public mode call starts
+ *      exit(mode)                      ... and returns
+ *      plan(mode, blocks, strategy)    planner chose "scalar", "wide" or "split"
+ *      batch(mode, blocks, width)      a batch is handed to a kernel
+ *      split(mode, blocks, parts)      a call is divided across the pool
+ *      pool_job(parts, idle)           gostparallel() queues a job
+ *      choice(mode, width, tier, chunk) the dispatcher is reconfigured
+ *      sboxes()                        the S-box tables are rebuilt
+ *      autotune(result)                gostautotune() returns
+ *
+ * For example:
+ *      bpftrace -e 'usdt:./gost_benchmark:gost:plan
+ *              { @[str(arg0), str(arg2)] = hist(arg1); }'
+ */
+
+#if !defined(GOST_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define GOST_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef GOST_HAVE_PROBES
+#define GOST_PROBE0(name) DTRACE_PROBE(gost, name)
+#define GOST_PROBE1(name, a) DTRACE_PROBE1(gost, name, a)
+#define GOST_PROBE2(name, a, b) DTRACE_PROBE2(gost, name, a, b)
+#define GOST_PROBE3(name, a, b, c) DTRACE_PROBE3(gost, name, a, b, c)
+#define GOST_PROBE4(name, a, b, c, d) DTRACE_PROBE4(gost, name, a, b, c, d)
+#else
+/* sizeof keeps the arguments "used" without evaluating them */
+#define GOST_PROBE0(name) ((void)0)
+#define GOST_PROBE1(name, a) ((void)sizeof(a))
+#define GOST_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define GOST_PROBE3(name, a, b, c) \
+        ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define GOST_PROBE4(name, a, b, c, d) \
+        ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
+#endif /* GOST_PROBE_H */
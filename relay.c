@@ -0,0 +1,1081 @@
+/*
+ * An encrypting TCP relay in the manner of stunnel, and a loopback
+ * load generator to measure it.
+ *
+ * Usage: gost_relay -e|-d keyfile listenport host:port
+ *        gost_relay echo port
+ *        gost_relay load [-c conns] [-r rounds] [-s bytes] [-t seconds] port
+ *        gost_relay bench [-c conns] [-r rounds] [-s bytes] [-t seconds]
+ *
+ * A relay started with -e takes plaintext connections and carries them
+ * encrypted to host:port, where one started with -d turns them back
+ * into plaintext for the real service.  Each direction of each
+ * connection is its own gamma stream, whose sender picks a random IV
+ * and sends it ahead of the data.  The data goes in records: a 4-byte
+ * little-endian length, the ciphertext, and an 8-byte CMAC over the IV,
+ * the record's stream position, its length and its ciphertext, so that
+ * records can be neither altered nor moved.  The -d side passes nothing
+ * of a record on before its MAC checks.  A record of no data ends the
+ * stream, so that a cut one shows too; a record that does not check,
+ * or a stream that stops without its end, drops the connection.  The
+ * MAC key is the relay key's encryption of a constant, not the key the
+ * gamma uses.
+ *
+ * One thread runs it all on edge-triggered epoll.  Each turn of the
+ * loop reads what every ready connection has, encrypts all of it with
+ * one gostgammav() call, so that short records from many connections
+ * share the wide kernels, checks or makes their MACs with one
+ * gostcmacbatch() call, and then writes it all on.  Buffers come from
+ * a pool and go back as soon as their data is written, so an idle
+ * connection holds none.
+ *
+ * echo is a plaintext echo server standing in for the service.  load
+ * opens conns connections to port; each makes rounds of requests of
+ * the given size, checks the echoes, then closes and is replaced.  It
+ * reports connections/s, throughput and round trip latency.  A listen
+ * port of 0 picks a free one, which is printed.  bench runs
+ * an echo server and a -d and a -e relay in front of it in threads of
+ * this process, and drives load through them and then straight at the
+ * echo server for comparison.
+ */
+#define _GNU_SOURCE             /* accept4() */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gost.h"
+#include "gostwords.h"
+
+#define BUF_BYTES 16384         /* Read at a time from one connection */
+#define MAX_EVENTS 256
+#define HEAD 24                 /* Room before the data for what its MAC covers */
+#define PREFIX 20               /* The IV, the stream position and the length */
+#define FRAMING 12              /* The length and the MAC, on the wire */
+
+enum relaymode { ENCRYPT, DECRYPT, ECHO };
+
+/*
+ * Data in flight, at HEAD + pos % 8.  The record's prefix goes just
+ * before it, its last 4 bytes the length, and the MAC just after, so
+ * that a whole record is one run of bytes.
+ */
+struct buf {
+        struct buf *next;
+        unsigned long long data[(HEAD + 8 + BUF_BYTES + 8) / 8];
+};
+
+struct conn;
+
+struct end {
+        struct conn *c;
+        int fd;
+        int readable, writable; /* Until read or write says EAGAIN */
+};
+
+struct dir {
+        struct end *from, *to;
+        int used;
+        int crypt;              /* Plain for echo */
+        int sendiv;             /* Sends its IV first, rather than reading it */
+        unsigned char ivbuf[8];
+        size_t ivdone;          /* Bytes of ivbuf sent or received */
+        word32 iv[2];
+        unsigned long long pos; /* Stream bytes processed */
+        struct buf *buf;
+        size_t skew, len, sent; /* Data is at skew; len bytes, sent of them */
+        struct buf *rec;        /* A record coming in, not yet whole */
+        size_t got;             /* Bytes of it so far, from its length on */
+        int eof, shut, queued;
+};
+
+struct conn {
+        struct end end[2];
+        struct dir dir[2];
+        int dead;
+        struct conn *next;      /* On the list to free */
+};
+
+struct relay {
+        int mode;
+        int listenfd;
+        int ep;
+        struct addrinfo *target;
+        word32 key[8];
+        struct gost_cmackey mk;
+        struct buf *pool;
+        struct dir **queue, **next;
+        size_t nqueue, cap;
+        struct gost_gammavec *v;
+        struct gost_cmacjob *jobs;
+        size_t vcap;
+        struct conn *dead;
+};
+
+static void die(char const *what)
+{
+        perror(what);
+        exit(1);
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static struct buf *getbuf(struct relay *r)
+{
+        struct buf *b = r->pool;
+
+        if (b) {
+                r->pool = b->next;
+                return b;
+        }
+        b = malloc(sizeof(*b));
+        if (!b)
+                die("malloc");
+        return b;
+}
+
+static void putbuf(struct relay *r, struct buf *b)
+{
+        b->next = r->pool;
+        r->pool = b;
+}
+
+static void queue(struct relay *r, struct dir *d)
+{
+        if (!d->used || d->queued)
+                return;
+        if (r->nqueue == r->cap) {
+                r->cap = r->cap ? r->cap * 2 : 64;
+                r->queue = realloc(r->queue, r->cap * sizeof(*r->queue));
+                r->next = realloc(r->next, r->cap * sizeof(*r->next));
+                if (!r->queue || !r->next)
+                        die("realloc");
+        }
+        d->queued = 1;
+        r->queue[r->nqueue++] = d;
+}
+
+static void kill_conn(struct relay *r, struct conn *c)
+{
+        int i;
+
+        if (c->dead)
+                return;
+        c->dead = 1;
+        for (i = 0; i < 2; i++) {
+                if (c->dir[i].buf)
+                        putbuf(r, c->dir[i].buf);
+                if (c->dir[i].rec)
+                        putbuf(r, c->dir[i].rec);
+                c->dir[i].buf = c->dir[i].rec = NULL;
+                if (c->end[i].fd >= 0 && (i == 0 || c->end[1].fd != c->end[0].fd))
+                        close(c->end[i].fd);
+        }
+        c->next = r->dead;
+        r->dead = c;
+}
+
+static void nodelay(int fd)
+{
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void watch(struct relay *r, struct end *e)
+{
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = e;
+        if (epoll_ctl(r->ep, EPOLL_CTL_ADD, e->fd, &ev) != 0)
+                die("epoll_ctl");
+}
+
+/* The IV as sent, little-endian like everything else */
+static void ivwords(struct dir *d)
+{
+        d->iv[0] = (word32)d->ivbuf[0] | (word32)d->ivbuf[1] << 8 |
+                   (word32)d->ivbuf[2] << 16 | (word32)d->ivbuf[3] << 24;
+        d->iv[1] = (word32)d->ivbuf[4] | (word32)d->ivbuf[5] << 8 |
+                   (word32)d->ivbuf[6] << 16 | (word32)d->ivbuf[7] << 24;
+}
+
+/* Where the data of b starts */
+static unsigned char *bufdata(struct buf *b, size_t skew)
+{
+        return (unsigned char *)b->data + HEAD + skew;
+}
+
+static void put32(unsigned char *p, unsigned long long v)
+{
+        for (int i = 0; i < 4; i++)
+                p[i] = (unsigned char)(v >> i * 8);
+}
+
+/* What the MAC covers ahead of the data: IV, position and length */
+static void prefix(struct dir const *d, unsigned char *p)
+{
+        memcpy(p - PREFIX, d->ivbuf, 8);
+        put32(p - 12, d->pos);
+        put32(p - 8, d->pos >> 32);
+        put32(p - 4, d->len);
+}
+
+static void setup_dir(struct dir *d, struct end *from, struct end *to,
+                      int crypt, int sendiv)
+{
+        d->from = from;
+        d->to = to;
+        d->used = 1;
+        d->crypt = crypt;
+        d->sendiv = crypt && sendiv;
+        if (d->sendiv) {
+                if (getrandom(d->ivbuf, sizeof(d->ivbuf), 0) != sizeof(d->ivbuf))
+                        die("getrandom");
+                ivwords(d);
+        }
+        if (!crypt)
+                d->ivdone = 8;
+}
+
+static void accept_all(struct relay *r)
+{
+        for (;;) {
+                int fd = accept4(r->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                struct conn *c;
+
+                if (fd < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return;
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno == EMFILE || errno == ENFILE)
+                                return;
+                        die("accept4");
+                }
+                c = calloc(1, sizeof(*c));
+                if (!c)
+                        die("calloc");
+                nodelay(fd);
+                c->end[0].c = c->end[1].c = c;
+                c->end[0].fd = fd;
+                if (r->mode == ECHO) {
+                        c->end[1].fd = fd;
+                        setup_dir(&c->dir[0], &c->end[0], &c->end[0], 0, 0);
+                        watch(r, &c->end[0]);
+                        continue;
+                }
+                c->end[1].fd = socket(r->target->ai_family,
+                                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (c->end[1].fd < 0) {
+                        close(fd);
+                        free(c);
+                        continue;
+                }
+                nodelay(c->end[1].fd);
+                if (connect(c->end[1].fd, r->target->ai_addr, r->target->ai_addrlen) != 0 &&
+                    errno != EINPROGRESS) {
+                        close(c->end[1].fd);
+                        close(fd);
+                        free(c);
+                        continue;
+                }
+                /* dir[0] runs client to target; the encrypted side gets the IVs */
+                setup_dir(&c->dir[0], &c->end[0], &c->end[1], 1, r->mode == ENCRYPT);
+                setup_dir(&c->dir[1], &c->end[1], &c->end[0], 1, r->mode == DECRYPT);
+                watch(r, &c->end[0]);
+                watch(r, &c->end[1]);
+        }
+}
+
+/* The record that ends the stream, MAC and all, to go out as data */
+static void end_record(struct relay *r, struct dir *d)
+{
+        unsigned char *p;
+
+        d->buf = getbuf(r);
+        d->skew = (size_t)(d->pos % 8);
+        d->len = 0;
+        d->sent = 0;
+        p = bufdata(d->buf, d->skew);
+        prefix(d, p);
+        gostcmac(&r->mk, p - PREFIX, PREFIX, p);
+}
+
+/* Read towards a whole record; 1 once there is one to check */
+static int fill_record(struct relay *r, struct dir *d)
+{
+        unsigned char *p;
+        ssize_t n;
+
+        if (!d->rec) {
+                d->rec = getbuf(r);
+                d->skew = (size_t)(d->pos % 8);
+                d->got = 0;
+        }
+        p = bufdata(d->rec, d->skew) - 4;
+        for (;;) {
+                size_t need = d->got < 4 ? 4 : d->len + FRAMING;
+
+                n = read(d->from->fd, p + d->got, need - d->got);
+                if (n <= 0)
+                        break;
+                d->got += (size_t)n;
+                if (d->got == 4) {
+                        d->len = (size_t)p[0] | (size_t)p[1] << 8 |
+                                 (size_t)p[2] << 16 | (size_t)p[3] << 24;
+                        if (d->len > BUF_BYTES) {
+                                kill_conn(r, d->from->c);
+                                return 0;
+                        }
+                } else if (d->got == d->len + FRAMING) {
+                        d->buf = d->rec;
+                        d->rec = NULL;
+                        d->sent = 0;
+                        return 1;
+                }
+        }
+        if (n == 0)
+                kill_conn(r, d->from->c);       /* Cut off before its end */
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                d->from->readable = 0;
+        else if (errno != EINTR)
+                kill_conn(r, d->from->c);
+        return 0;
+}
+
+/* Read one buffer's worth, or one record; 1 if there is data to process */
+static int fill(struct relay *r, struct dir *d)
+{
+        struct buf *b;
+        ssize_t n;
+
+        while (!d->sendiv && d->ivdone < 8) {
+                n = read(d->from->fd, d->ivbuf + d->ivdone, 8 - d->ivdone);
+                if (n > 0) {
+                        d->ivdone += (size_t)n;
+                        if (d->ivdone == 8)
+                                ivwords(d);
+                        continue;
+                }
+                if (n == 0) {
+                        kill_conn(r, d->from->c);
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        d->from->readable = 0;
+                } else if (errno != EINTR) {
+                        kill_conn(r, d->from->c);
+                }
+                return 0;
+        }
+        if (d->crypt && !d->sendiv)
+                return fill_record(r, d);
+
+        b = getbuf(r);
+        d->skew = (size_t)(d->pos % 8);
+        n = read(d->from->fd, bufdata(b, d->skew), BUF_BYTES);
+        if (n > 0) {
+                d->buf = b;
+                d->len = (size_t)n;
+                d->sent = 0;
+                return d->crypt;
+        }
+        putbuf(r, b);
+        if (n == 0) {
+                d->eof = 1;
+                if (d->sendiv)
+                        end_record(r, d);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                d->from->readable = 0;
+        } else if (errno != EINTR) {
+                kill_conn(r, d->from->c);
+        }
+        return 0;
+}
+
+static int same_mac(unsigned char const *a, unsigned char const *b)
+{
+        unsigned char x = 0;
+
+        for (int i = 0; i < 8; i++)
+                x |= a[i] ^ b[i];
+        return x == 0;
+}
+
+/*
+ * Check the MACs of the records that came in this turn, all in one
+ * batch.  A connection whose record fails is dropped, and the end
+ * record ends its stream; what is left of rec, returned, has data.
+ */
+static size_t check_all(struct relay *r, struct dir **rec, size_t nrec)
+{
+        struct gost_cmacjob *jobs = r->jobs;
+        size_t i, k, nj = 0;
+
+        for (i = 0; i < nrec; i++) {
+                struct dir *d = rec[i];
+                unsigned char *p = bufdata(d->buf, d->skew);
+
+                prefix(d, p);
+                if (d->sendiv)
+                        continue;
+                jobs[nj].ck = &r->mk;
+                jobs[nj].msg = p - PREFIX;
+                jobs[nj++].len = PREFIX + d->len;
+        }
+        gostcmacbatch(jobs, nj);
+        for (i = k = 0; i < nrec; i++) {
+                struct dir *d = rec[i];
+
+                if (d->sendiv)
+                        continue;
+                if (!same_mac(jobs[k++].mac, bufdata(d->buf, d->skew) + d->len)) {
+                        kill_conn(r, d->from->c);
+                } else if (d->len == 0) {
+                        putbuf(r, d->buf);
+                        d->buf = NULL;
+                        d->eof = 1;
+                }
+        }
+        for (i = k = 0; i < nrec; i++)
+                if (!rec[i]->from->c->dead && rec[i]->buf)
+                        rec[k++] = rec[i];
+        return k;
+}
+
+/*
+ * Encrypt everything read this turn, once what came in has checked.
+ * The bytes before the first block boundary and after the last go
+ * through a byte stream; all the whole blocks, of every connection, go
+ * to gostgammav() together, and the MACs of what goes out to
+ * gostcmacbatch().
+ */
+static void crypt_all(struct relay *r, struct dir **rec, size_t nrec)
+{
+        struct gost_gammavec *v;
+        struct gost_cmacjob *jobs;
+        size_t i, k, nv = 0, nj = 0;
+
+        if (nrec > r->vcap) {
+                r->vcap = nrec * 2;
+                r->v = realloc(r->v, r->vcap * sizeof(*r->v));
+                r->jobs = realloc(r->jobs, r->vcap * sizeof(*r->jobs));
+                if (!r->v || !r->jobs)
+                        die("realloc");
+        }
+        nrec = check_all(r, rec, nrec);
+        v = r->v;
+        jobs = r->jobs;
+        for (i = 0; i < nrec; i++) {
+                struct dir *d = rec[i];
+                unsigned char *p = bufdata(d->buf, d->skew);
+                size_t head = (8 - d->skew) % 8, whole, tail;
+                struct gost_stream s;
+
+                if (head > d->len)
+                        head = d->len;
+                whole = (d->len - head) / 8;
+                tail = d->len - head - whole * 8;
+                if (head || tail) {
+                        goststreaminit(&s, GOST_MODE_GAMMA, 0, d->iv);
+                        goststreamseek(&s, d->pos, r->key);
+                        goststream(&s, p, p, head, r->key);
+                        goststreamseek(&s, d->pos + head + whole * 8, r->key);
+                        goststream(&s, p + head + whole * 8, p + head + whole * 8,
+                                   tail, r->key);
+                }
+                if (whole) {
+                        v[nv].in = v[nv].out = (word32 *)(void *)(p + head);
+                        v[nv].len = whole;
+                        v[nv].iv = d->iv;
+                        v[nv].pos = (d->pos + head) / 8;
+                        if (!gostlittleendian())
+                                gostswapwords(v[nv].out, whole * 2);
+                        nv++;
+                }
+                d->pos += d->len;
+        }
+        gostgammav(v, nv, r->key);
+        if (!gostlittleendian())
+                for (i = 0; i < nv; i++)
+                        gostswapwords(v[i].out, v[i].len * 2);
+
+        for (i = 0; i < nrec; i++) {
+                struct dir *d = rec[i];
+                unsigned char *p = bufdata(d->buf, d->skew);
+
+                if (!d->sendiv)
+                        continue;
+                jobs[nj].ck = &r->mk;
+                jobs[nj].msg = p - PREFIX;
+                jobs[nj++].len = PREFIX + d->len;
+        }
+        gostcmacbatch(jobs, nj);
+        for (i = k = 0; i < nrec; i++)
+                if (rec[i]->sendiv)
+                        memcpy(bufdata(rec[i]->buf, rec[i]->skew) + rec[i]->len,
+                               jobs[k++].mac, 8);
+}
+
+/* What of the data in hand goes out: all of a record, or just plaintext */
+static unsigned char *out(struct dir const *d, size_t *len)
+{
+        unsigned char *p = bufdata(d->buf, d->skew);
+
+        *len = d->len;
+        if (!d->sendiv)
+                return p;
+        *len += FRAMING;
+        return p - 4;
+}
+
+/* Write what there is, the IV first; shut the far end down after EOF */
+static void flush(struct relay *r, struct dir *d)
+{
+        struct iovec iov[2];
+        size_t len = 0;
+        int n = 0;
+        ssize_t w;
+
+        while (d->to->writable && (d->ivdone < 8 || d->buf)) {
+                n = 0;
+                if (d->sendiv && d->ivdone < 8) {
+                        iov[n].iov_base = d->ivbuf + d->ivdone;
+                        iov[n++].iov_len = 8 - d->ivdone;
+                }
+                if (d->buf) {
+                        iov[n].iov_base = out(d, &len) + d->sent;
+                        iov[n++].iov_len = len - d->sent;
+                }
+                if (n == 0)
+                        break;          /* Still waiting to read an IV */
+                w = writev(d->to->fd, iov, n);
+                if (w < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                d->to->writable = 0;
+                        else if (errno != EINTR)
+                                kill_conn(r, d->to->c);
+                        return;
+                }
+                if (d->sendiv && d->ivdone < 8) {
+                        size_t m = (size_t)w < 8 - d->ivdone ? (size_t)w : 8 - d->ivdone;
+
+                        d->ivdone += m;
+                        w -= (ssize_t)m;
+                }
+                d->sent += (size_t)w;
+                if (d->buf && d->sent == len) {
+                        putbuf(r, d->buf);
+                        d->buf = NULL;
+                }
+        }
+
+        if (d->eof && !d->buf && !d->shut && (!d->sendiv || d->ivdone == 8)) {
+                struct conn *c = d->from->c;
+
+                shutdown(d->to->fd, SHUT_WR);
+                d->shut = 1;
+                if ((!c->dir[0].used || c->dir[0].shut) &&
+                    (!c->dir[1].used || c->dir[1].shut))
+                        kill_conn(r, c);
+        }
+}
+
+static int can_progress(struct dir const *d)
+{
+        if (d->from->c->dead)
+                return 0;
+        if (!d->buf && !d->eof && d->from->readable)
+                return 1;
+        return d->to->writable &&
+               (d->buf || (d->sendiv && d->ivdone < 8) || (d->eof && !d->shut));
+}
+
+static void run_relay(struct relay *r)
+{
+        struct epoll_event ev[MAX_EVENTS];
+        struct dir **rec = NULL;
+        size_t reccap = 0;
+
+        for (;;) {
+                int nev = epoll_wait(r->ep, ev, MAX_EVENTS, r->nqueue ? 0 : -1);
+                size_t i, nrec = 0, nnext = 0;
+                struct dir **t;
+
+                if (nev < 0 && errno != EINTR)
+                        die("epoll_wait");
+                for (int k = 0; k < nev; k++) {
+                        struct end *e = ev[k].data.ptr;
+
+                        if (!e) {
+                                accept_all(r);
+                                continue;
+                        }
+                        if (ev[k].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                                e->readable = 1;
+                        if (ev[k].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                                e->writable = 1;
+                        queue(r, &e->c->dir[0]);
+                        queue(r, &e->c->dir[1]);
+                }
+
+                if (r->nqueue > reccap) {
+                        reccap = r->cap;
+                        rec = realloc(rec, reccap * sizeof(*rec));
+                        if (!rec)
+                                die("realloc");
+                }
+                for (i = 0; i < r->nqueue; i++) {
+                        struct dir *d = r->queue[i];
+
+                        if (!d->from->c->dead && !d->buf && !d->eof &&
+                            d->from->readable && fill(r, d))
+                                rec[nrec++] = d;
+                }
+                /* Another connection's read may have killed one of these */
+                for (i = 0; i < nrec; i++)
+                        if (rec[i]->from->c->dead)
+                                rec[i--] = rec[--nrec];
+                crypt_all(r, rec, nrec);
+                for (i = 0; i < r->nqueue; i++)
+                        if (!r->queue[i]->from->c->dead)
+                                flush(r, r->queue[i]);
+
+                for (i = 0; i < r->nqueue; i++) {
+                        struct dir *d = r->queue[i];
+
+                        d->queued = 0;
+                        if (can_progress(d)) {
+                                d->queued = 1;
+                                r->next[nnext++] = d;
+                        }
+                }
+                t = r->queue;
+                r->queue = r->next;
+                r->next = t;
+                r->nqueue = nnext;
+
+                while (r->dead) {
+                        struct conn *c = r->dead;
+
+                        r->dead = c->next;
+                        free(c);
+                }
+        }
+}
+
+static int listen_on(int port)
+{
+        struct sockaddr_in6 a;
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1, zero = 0;
+
+        if (fd < 0)
+                die("socket");
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        memset(&a, 0, sizeof(a));
+        a.sin6_family = AF_INET6;
+        a.sin6_addr = in6addr_any;
+        a.sin6_port = htons((unsigned short)port);
+        if (bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, 1024) != 0)
+                die("bind");
+        return fd;
+}
+
+static int bound_port(int fd)
+{
+        struct sockaddr_in6 a;
+        socklen_t len = sizeof(a);
+
+        if (getsockname(fd, (struct sockaddr *)&a, &len) != 0)
+                die("getsockname");
+        return ntohs(a.sin6_port);
+}
+
+/* A listening socket for the command line's port, which may be 0 */
+static int listen_arg(char const *port)
+{
+        int fd = listen_on(atoi(port));
+
+        fprintf(stderr, "gost_relay: listening on port %d\n", bound_port(fd));
+        return fd;
+}
+
+static struct addrinfo *resolve(char const *host, char const *port)
+{
+        struct addrinfo hints, *ai;
+        int e;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        e = getaddrinfo(host, port, &hints, &ai);
+        if (e != 0) {
+                fprintf(stderr, "gost_relay: %s:%s: %s\n", host, port, gai_strerror(e));
+                exit(1);
+        }
+        return ai;
+}
+
+static struct relay *new_relay(int mode, int listenfd, struct addrinfo *target,
+                               word32 const key[8])
+{
+        struct relay *r = calloc(1, sizeof(*r));
+        struct epoll_event ev;
+
+        if (!r)
+                die("calloc");
+        r->mode = mode;
+        r->listenfd = listenfd;
+        r->target = target;
+        if (key) {
+                /* The MAC key, apart from the gamma's */
+                static word32 const label[8] = {
+                        0x74736f67, 0x6c65725f, 0x61207961, 0x6b20636d,
+                        0x00007965, 0, 0, 0
+                };
+                word32 mk[8];
+
+                memcpy(r->key, key, sizeof(r->key));
+                gostecb(label, mk, 4, r->key);
+                gostcmackey(&r->mk, mk);
+        }
+        r->ep = epoll_create1(EPOLL_CLOEXEC);
+        if (r->ep < 0)
+                die("epoll_create1");
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(r->ep, EPOLL_CTL_ADD, listenfd, &ev) != 0)
+                die("epoll_ctl");
+        return r;
+}
+
+static void *relay_thread(void *arg)
+{
+        run_relay(arg);
+        return NULL;
+}
+
+/*
+ * The load generator.  Each client sends a request, waits for all of
+ * its echo, checks it, and after rounds of those closes and is
+ * replaced by a new connection.
+ */
+struct client {
+        int fd;
+        int id;
+        size_t round, sent, got;
+        double start;           /* Of the current round */
+};
+
+struct load {
+        struct addrinfo *target;
+        int ep;
+        size_t size, rounds;
+        unsigned char *req;
+        double *lat;
+        size_t nlat, latcap;
+        size_t conns, bytes, errors, nextid;
+};
+
+static unsigned char payload(int id, size_t round, size_t i)
+{
+        return (unsigned char)(id * 131 + round * 31 + i * 7);
+}
+
+static void client_open(struct load *l, struct client *c)
+{
+        struct epoll_event ev;
+
+        c->fd = socket(l->target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->fd < 0)
+                die("socket");
+        nodelay(c->fd);
+        if (connect(c->fd, l->target->ai_addr, l->target->ai_addrlen) != 0 &&
+            errno != EINPROGRESS)
+                die("connect");
+        c->id = (int)l->nextid++;
+        c->round = c->sent = c->got = 0;
+        c->start = now();
+        ev.events = EPOLLOUT;
+        ev.data.ptr = c;
+        if (epoll_ctl(l->ep, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+                die("epoll_ctl");
+}
+
+static void client_want(struct load *l, struct client *c, unsigned events)
+{
+        struct epoll_event ev;
+
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(l->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* 1 when the connection is finished with, well or badly */
+static int client_event(struct load *l, struct client *c)
+{
+        unsigned char in[BUF_BYTES];
+        ssize_t n;
+
+        if (c->sent < l->size) {
+                for (size_t i = c->sent; i < l->size; i++)
+                        l->req[i] = payload(c->id, c->round, i);
+                n = write(c->fd, l->req + c->sent, l->size - c->sent);
+                if (n < 0)
+                        return errno == EAGAIN ? 0 : (l->errors++, 1);
+                c->sent += (size_t)n;
+                if (c->sent == l->size)
+                        client_want(l, c, EPOLLIN);
+                return 0;
+        }
+        n = read(c->fd, in, sizeof(in));
+        if (n <= 0) {
+                if (n < 0 && errno == EAGAIN)
+                        return 0;
+                l->errors++;
+                return 1;
+        }
+        for (ssize_t i = 0; i < n; i++)
+                if (in[i] != payload(c->id, c->round, c->got + (size_t)i)) {
+                        l->errors++;
+                        return 1;
+                }
+        c->got += (size_t)n;
+        if (c->got < l->size)
+                return 0;
+
+        if (l->nlat == l->latcap) {
+                l->latcap = l->latcap ? l->latcap * 2 : 4096;
+                l->lat = realloc(l->lat, l->latcap * sizeof(*l->lat));
+                if (!l->lat)
+                        die("realloc");
+        }
+        l->lat[l->nlat++] = now() - c->start;
+        l->bytes += l->size;
+        if (++c->round == l->rounds) {
+                l->conns++;
+                return 1;
+        }
+        c->sent = c->got = 0;
+        c->start = now();
+        client_want(l, c, EPOLLOUT);
+        return 0;
+}
+
+static int compare_double(void const *a, void const *b)
+{
+        double x = *(double const *)a, y = *(double const *)b;
+
+        return (x > y) - (x < y);
+}
+
+static int run_load(struct addrinfo *target, size_t nconns, size_t rounds,
+                    size_t size, double seconds)
+{
+        struct epoll_event ev[MAX_EVENTS];
+        struct client *cl = calloc(nconns, sizeof(*cl));
+        struct load l;
+        double t0, end, t;
+
+        memset(&l, 0, sizeof(l));
+        l.target = target;
+        l.size = size;
+        l.rounds = rounds;
+        l.req = malloc(size);
+        l.ep = epoll_create1(EPOLL_CLOEXEC);
+        if (!cl || !l.req || l.ep < 0)
+                die("load setup");
+
+        t0 = now();
+        end = t0 + seconds;
+        for (size_t i = 0; i < nconns; i++)
+                client_open(&l, &cl[i]);
+        while ((t = now()) < end) {
+                int nev = epoll_wait(l.ep, ev, MAX_EVENTS, 100);
+
+                for (int k = 0; k < nev; k++) {
+                        struct client *c = ev[k].data.ptr;
+
+                        if (client_event(&l, c)) {
+                                close(c->fd);
+                                client_open(&l, c);
+                        }
+                }
+        }
+        t -= t0;
+        for (size_t i = 0; i < nconns; i++)
+                close(cl[i].fd);
+        close(l.ep);
+
+        if (l.nlat)
+                qsort(l.lat, l.nlat, sizeof(*l.lat), compare_double);
+        printf("  connections/s : %10.1f\n", (double)l.conns / t);
+        printf("  throughput    : %10.2f MiB/s each way\n",
+               (double)l.bytes / t / (1 << 20));
+        if (l.nlat)
+                printf("  latency       : %8.1f us p50 %8.1f us p99 %8.1f us max\n",
+                       l.lat[l.nlat / 2] * 1e6, l.lat[l.nlat * 99 / 100] * 1e6,
+                       l.lat[l.nlat - 1] * 1e6);
+        printf("  errors        : %10zu\n", l.errors);
+        free(l.lat);
+        free(l.req);
+        free(cl);
+        return l.errors ? 1 : 0;
+}
+
+static void usage(char const *prog)
+{
+        fprintf(stderr,
+                "Usage: %s -e|-d keyfile listenport host:port\n"
+                "       %s echo port\n"
+                "       %s load [-c conns] [-r rounds] [-s bytes] [-t seconds] port\n"
+                "       %s bench [-c conns] [-r rounds] [-s bytes] [-t seconds]\n",
+                prog, prog, prog, prog);
+        exit(1);
+}
+
+static void load_key(char const *path, word32 key[8])
+{
+        unsigned char b[33];
+        FILE *fp = fopen(path, "rb");
+        size_t n;
+
+        if (!fp)
+                die(path);
+        n = fread(b, 1, sizeof(b), fp);
+        fclose(fp);
+        if (n != 32) {
+                fprintf(stderr, "gost_relay: %s must hold exactly 32 bytes\n", path);
+                exit(1);
+        }
+        for (int i = 0; i < 8; i++)
+                key[i] = (word32)b[i * 4] | (word32)b[i * 4 + 1] << 8 |
+                         (word32)b[i * 4 + 2] << 16 | (word32)b[i * 4 + 3] << 24;
+}
+
+static struct addrinfo *parse_target(char *arg)
+{
+        char *colon = strrchr(arg, ':');
+
+        if (!colon)
+                return NULL;
+        *colon = '\0';
+        return resolve(arg, colon + 1);
+}
+
+static void start_relay(int mode, int listenfd, struct addrinfo *target,
+                        word32 const key[8])
+{
+        pthread_t t;
+
+        if (pthread_create(&t, NULL, relay_thread,
+                           new_relay(mode, listenfd, target, key)) != 0)
+                die("pthread_create");
+}
+
+int main(int argc, char **argv)
+{
+        size_t conns = 64, rounds = 100, size = 1024;
+        double seconds = 5;
+        int opt;
+
+        signal(SIGPIPE, SIG_IGN);
+        kboxinit();
+
+        if (argc >= 2 && (strcmp(argv[1], "load") == 0 || strcmp(argv[1], "bench") == 0)) {
+                int bench = strcmp(argv[1], "bench") == 0;
+                char port[16];
+
+                optind = 2;
+                while ((opt = getopt(argc, argv, "c:r:s:t:")) != -1) {
+                        switch (opt) {
+                        case 'c':
+                                conns = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'r':
+                                rounds = strtoul(optarg, NULL, 0);
+                                break;
+                        case 's':
+                                size = strtoul(optarg, NULL, 0);
+                                break;
+                        case 't':
+                                seconds = strtod(optarg, NULL);
+                                break;
+                        default:
+                                usage(argv[0]);
+                        }
+                }
+                if (conns == 0 || rounds == 0 || size == 0 || seconds <= 0 ||
+                    argc - optind != (bench ? 0 : 1))
+                        usage(argv[0]);
+                if (!bench)
+                        return run_load(resolve("localhost", argv[optind]),
+                                        conns, rounds, size, seconds);
+
+                /* echo <- relay -d <- relay -e <- load, all on loopback */
+                {
+                        word32 key[8];
+                        int echofd = listen_on(0), dfd = listen_on(0), efd = listen_on(0);
+                        struct addrinfo *echo, *d, *e;
+                        int r1, r2;
+
+                        for (int i = 0; i < 8; i++)
+                                key[i] = (word32)(0x01020304UL * (i + 1));
+                        snprintf(port, sizeof(port), "%d", bound_port(echofd));
+                        echo = resolve("localhost", port);
+                        snprintf(port, sizeof(port), "%d", bound_port(dfd));
+                        d = resolve("localhost", port);
+                        snprintf(port, sizeof(port), "%d", bound_port(efd));
+                        e = resolve("localhost", port);
+                        start_relay(ECHO, echofd, NULL, NULL);
+                        start_relay(DECRYPT, dfd, echo, key);
+                        start_relay(ENCRYPT, efd, d, key);
+
+                        printf("%zu connections of %zu rounds of %zu bytes, %.1f s each:\n",
+                               conns, rounds, size, seconds);
+                        printf("Through both relays:\n");
+                        r1 = run_load(e, conns, rounds, size, seconds);
+                        printf("Straight to the echo server:\n");
+                        r2 = run_load(echo, conns, rounds, size, seconds);
+                        return r1 || r2;
+                }
+        }
+
+        if (argc == 3 && strcmp(argv[1], "echo") == 0) {
+                run_relay(new_relay(ECHO, listen_arg(argv[2]), NULL, NULL));
+                return 0;
+        }
+
+        if (argc == 5 && (strcmp(argv[1], "-e") == 0 || strcmp(argv[1], "-d") == 0)) {
+                word32 key[8];
+                struct addrinfo *target = parse_target(argv[4]);
+
+                if (!target)
+                        usage(argv[0]);
+                load_key(argv[2], key);
+                run_relay(new_relay(argv[1][1] == 'e' ? ENCRYPT : DECRYPT,
+                                    listen_arg(argv[3]), target, key));
+                return 0;
+        }
+        usage(argv[0]);
+        return 1;
+}
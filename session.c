@@ -0,0 +1,419 @@
+/*
+ * A table of gamma stream sessions kept as columns rather than objects.
+ *
+ * Each session is a row across a few arrays: its key, its IV and the
+ * encrypted IV the counters start from, its position, and with
+ * GOST_STREAM_MAC the MAC chain and the plaintext of its partial block.
+ * No keystream is kept: the block a session stopped in the middle of
+ * is simply encrypted again when it resumes, which costs one lane.
+ *
+ * gostsessionscrypt() advances many sessions at once.  It walks the
+ * requests in order, stepping each session's counter as it goes, and
+ * gathers every block touched, whoever it belongs to, with its counter
+ * and key.  Runs of blocks of one session go through the wide kernel
+ * under that key; the others go through the rounds together in lanes,
+ * each under its own key.  The gamma is scattered back into the
+ * requests' buffers in the order it was taken, so the blocks of one
+ * session stay in sequence; the MAC chains of different sessions then
+ * run side by side in lanes too.  A request long enough to fill the
+ * wide kernels on its own goes to goststream() instead, once the lanes
+ * before it are out.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "gost.h"
+#include "gostsmall.h"
+#include "probe.h"
+
+#define SESSION_BATCH 64       /* Blocks staged before they run */
+#define SESSION_LANES 8         /* Blocks under different keys at once */
+#define SESSION_RUN 4           /* Blocks of one session that go wide */
+#define SESSION_DIRECT 512      /* Bytes from which a request goes alone */
+
+struct gost_sessions {
+        size_t capacity, open;
+        int flags;                      /* GOST_STREAM_MAC, _DECRYPT */
+        word32 *key;                    /* 8 words a session */
+        word32 *iv;                     /* 2 words a session */
+        word32 *start;                  /* The encrypted IV */
+        unsigned long long *pos;
+        word32 *mac;                    /* GOST_STREAM_MAC only */
+        unsigned char *part;            /* 8 bytes a session, likewise */
+        word32 *free;                   /* Ids not in use, a stack */
+        size_t nfree;
+        unsigned char *inuse;           /* A bit a session, set while open */
+};
+
+/* A block, or the part of one, that a request touches */
+struct lane {
+        size_t id;
+        unsigned char const *in;
+        unsigned char *out;
+        unsigned o, n;                  /* Bytes o..o+n-1 of the block */
+};
+
+static word32
+load32(unsigned char const *p)
+{
+        return (word32)p[0] | (word32)p[1] << 8 | (word32)p[2] << 16 |
+               (word32)p[3] << 24;
+}
+
+static void
+store32(unsigned char *p, word32 x)
+{
+        p[0] = (unsigned char)x;
+        p[1] = (unsigned char)(x >> 8);
+        p[2] = (unsigned char)(x >> 16);
+        p[3] = (unsigned char)(x >> 24);
+}
+
+struct gost_sessions *
+gostsessionsnew(size_t capacity, int flags)
+{
+        struct gost_sessions *t;
+        int const mac = flags & GOST_STREAM_MAC;
+        size_t i;
+
+        if (capacity == 0 || capacity > 0xffffffff)
+                return NULL;
+        t = calloc(1, sizeof(*t));
+        if (!t)
+                return NULL;
+        t->capacity = capacity;
+        t->flags = flags;
+        t->key = malloc(capacity * 8 * sizeof(word32));
+        t->iv = malloc(capacity * 2 * sizeof(word32));
+        t->start = malloc(capacity * 2 * sizeof(word32));
+        t->pos = malloc(capacity * sizeof(*t->pos));
+        t->free = malloc(capacity * sizeof(*t->free));
+        t->inuse = calloc((capacity + 7) / 8, 1);
+        if (mac) {
+                t->mac = malloc(capacity * 2 * sizeof(word32));
+                t->part = malloc(capacity * 8);
+        }
+        if (!t->key || !t->iv || !t->start || !t->pos || !t->free || !t->inuse ||
+            (mac && (!t->mac || !t->part))) {
+                gostsessionsfree(t);
+                return NULL;
+        }
+        /* Lowest ids first, so a lightly used table stays at the front */
+        for (i = 0; i < capacity; i++)
+                t->free[i] = (word32)(capacity - 1 - i);
+        t->nfree = capacity;
+        return t;
+}
+
+void
+gostsessionsfree(struct gost_sessions *t)
+{
+        if (!t)
+                return;
+        if (t->key)
+                memset(t->key, 0, t->capacity * 8 * sizeof(word32));
+        free(t->key);
+        free(t->iv);
+        free(t->start);
+        free(t->pos);
+        free(t->mac);
+        free(t->part);
+        free(t->free);
+        free(t->inuse);
+        free(t);
+}
+
+size_t
+gostsessionopen(struct gost_sessions *t, word32 const key[8], word32 const iv[2])
+{
+        size_t id;
+
+        if (t->nfree == 0)
+                return (size_t)-1;
+        id = t->free[--t->nfree];
+        t->inuse[id / 8] |= (unsigned char)(1 << id % 8);
+        memcpy(t->key + id * 8, key, 8 * sizeof(word32));
+        t->iv[id * 2] = iv[0];
+        t->iv[id * 2 + 1] = iv[1];
+        gostcrypt(iv, t->start + id * 2, key);
+        t->pos[id] = 0;
+        if (t->mac)
+                t->mac[id * 2] = t->mac[id * 2 + 1] = 0;
+        t->open++;
+        return id;
+}
+
+int
+gostsessionclose(struct gost_sessions *t, size_t id)
+{
+        /* Freeing an id twice would put it on the stack twice */
+        if (id >= t->capacity || !(t->inuse[id / 8] & 1 << id % 8))
+                return -1;
+        t->inuse[id / 8] &= (unsigned char)~(1 << id % 8);
+        memset(t->key + id * 8, 0, 8 * sizeof(word32));
+        t->free[t->nfree++] = (word32)id;
+        t->open--;
+        return 0;
+}
+
+/* A block of plaintext for a session's MAC */
+struct macblock {
+        size_t id;
+        word32 w[2];
+};
+
+/*
+ * The MAC blocks of a batch, in the order they came.  Sorted by
+ * session, keeping that order, each session's blocks are one chain;
+ * the chains of different sessions run side by side in lanes.
+ */
+static void
+maclanes(struct gost_sessions *t, struct macblock *mb, size_t n)
+{
+        word32 n1[SESSION_LANES], n2[SESSION_LANES];
+        word32 const *key[SESSION_LANES];
+        size_t at[SESSION_LANES], end[SESSION_LANES];
+        size_t next = 0, k = 0, i, j, l;
+        struct macblock b;
+
+        for (i = 1; i < n; i++) {
+                b = mb[i];
+                for (j = i; j > 0 && mb[j - 1].id > b.id; j--)
+                        mb[j] = mb[j - 1];
+                mb[j] = b;
+        }
+
+        for (;;) {
+                while (k < SESSION_LANES && next < n) {
+                        size_t const id = mb[next].id;
+
+                        at[k] = next;
+                        while (next < n && mb[next].id == id)
+                                next++;
+                        end[k] = next;
+                        n1[k] = t->mac[id * 2];
+                        n2[k] = t->mac[id * 2 + 1];
+                        key[k] = t->key + id * 8;
+                        k++;
+                }
+                if (k == 0)
+                        break;
+                for (l = 0; l < k; l++) {
+                        n1[l] ^= mb[at[l]].w[0];
+                        n2[l] = mb[at[l]].w[1];         /* Sic: as gostmac() */
+                }
+                gostsmall_keyedmac(n1, n2, key, k);
+
+                /* Retire the chains that are done, keeping the lanes packed */
+                for (l = 0; l < k; ) {
+                        size_t const id = mb[at[l]].id;
+
+                        if (++at[l] < end[l]) {
+                                l++;
+                                continue;
+                        }
+                        t->mac[id * 2] = n1[l];
+                        t->mac[id * 2 + 1] = n2[l];
+                        k--;
+                        at[l] = at[k];
+                        end[l] = end[k];
+                        n1[l] = n1[k];
+                        n2[l] = n2[k];
+                        key[l] = key[k];
+                }
+        }
+}
+
+/*
+ * Gamma for each staged block, then out of it into the requests, in
+ * order.  A run of blocks of one session has one key and goes through
+ * the wide kernel; the rest go SESSION_LANES at a time, each lane
+ * under its own session's key.
+ */
+static void
+flush(struct gost_sessions *t, struct lane const *lane, word32 const *ctr,
+      size_t n)
+{
+        int const decrypt = t->flags & GOST_STREAM_DECRYPT;
+        word32 g[SESSION_BATCH * 2];
+        word32 n1[SESSION_LANES], n2[SESSION_LANES];
+        word32 const *key[SESSION_LANES];
+        struct macblock mb[SESSION_BATCH];
+        size_t at[SESSION_BATCH], nat = 0, nmb = 0, l, e, k, i;
+        unsigned char gamma[8];
+        unsigned j;
+
+        if (n)
+                GOST_PROBE3(batch, "sessions", n, SESSION_LANES);
+        for (l = 0; l < n; l = e) {
+                for (e = l + 1; e < n && lane[e].id == lane[l].id; e++)
+                        ;
+                if (e - l >= SESSION_RUN)
+                        gostecb(ctr + l * 2, g + l * 2, e - l, t->key + lane[l].id * 8);
+                else
+                        for (; l < e; l++)
+                                at[nat++] = l;
+        }
+        for (i = 0; i < nat; i += k) {
+                k = nat - i < SESSION_LANES ? nat - i : SESSION_LANES;
+                for (l = 0; l < k; l++) {
+                        n1[l] = ctr[at[i + l] * 2];
+                        n2[l] = ctr[at[i + l] * 2 + 1];
+                        key[l] = t->key + lane[at[i + l]].id * 8;
+                }
+                gostsmall_keyed(n1, n2, key, k);
+                for (l = 0; l < k; l++) {
+                        g[at[i + l] * 2] = n1[l];
+                        g[at[i + l] * 2 + 1] = n2[l];
+                }
+        }
+
+        /* Whole blocks by the word; finished blocks queue for the MAC */
+        for (l = 0; l < n; l++) {
+                struct lane const *a = &lane[l];
+                unsigned char *part = t->part ? t->part + a->id * 8 : NULL;
+
+                if (a->o == 0 && a->n == 8) {
+                        word32 x0 = load32(a->in), x1 = load32(a->in + 4);
+                        word32 y0 = x0 ^ g[l * 2], y1 = x1 ^ g[l * 2 + 1];
+
+                        store32(a->out, y0);
+                        store32(a->out + 4, y1);
+                        if (part) {
+                                mb[nmb].id = a->id;
+                                mb[nmb].w[0] = decrypt ? y0 : x0;
+                                mb[nmb++].w[1] = decrypt ? y1 : x1;
+                        }
+                        continue;
+                }
+                store32(gamma, g[l * 2]);
+                store32(gamma + 4, g[l * 2 + 1]);
+                for (j = 0; j < a->n; j++) {
+                        unsigned char x = a->in[j], y = x ^ gamma[a->o + j];
+
+                        a->out[j] = y;
+                        if (part)
+                                part[a->o + j] = decrypt ? y : x;
+                }
+                if (part && a->o + a->n == 8) {
+                        mb[nmb].id = a->id;
+                        mb[nmb].w[0] = load32(part);
+                        mb[nmb++].w[1] = load32(part + 4);
+                }
+        }
+        if (nmb)
+                maclanes(t, mb, nmb);
+}
+
+/* A request on its own through goststream(), and its state back */
+static void
+direct(struct gost_sessions *t, struct gost_sessionop const *op)
+{
+        word32 const *key = t->key + op->id * 8;
+        struct gost_stream s;
+        word32 g[2] = { 0, 0 };
+
+        goststreaminit(&s, GOST_MODE_GAMMA, t->flags, t->iv + op->id * 2);
+        s.pos = t->pos[op->id];
+        if (t->mac) {
+                s.mac[0] = t->mac[op->id * 2];
+                s.mac[1] = t->mac[op->id * 2 + 1];
+                memcpy(s.part, t->part + op->id * 8, 8);
+        }
+        if (s.pos % 8) {
+                /* goststream() takes the partial block's gamma as given */
+                gostgamma(g, g, 1, s.iv, s.pos / 8, key);
+                store32(s.gamma, g[0]);
+                store32(s.gamma + 4, g[1]);
+        }
+        goststream(&s, op->in, op->out, op->len, key);
+        t->pos[op->id] = s.pos;
+        if (t->mac) {
+                t->mac[op->id * 2] = s.mac[0];
+                t->mac[op->id * 2 + 1] = s.mac[1];
+                memcpy(t->part + op->id * 8, s.part, 8);
+        }
+}
+
+void
+gostsessionscrypt(struct gost_sessions *t, struct gost_sessionop const *ops,
+                  size_t nops)
+{
+        struct lane lane[SESSION_BATCH];
+        word32 ctr[SESSION_BATCH * 2];
+        size_t n = 0, i, done, m;
+
+        GOST_PROBE2(entry, "sessions", nops);
+        for (i = 0; i < nops; i++) {
+                struct gost_sessionop const *op = &ops[i];
+                word32 const *start = t->start + op->id * 2;
+                unsigned long long pos = t->pos[op->id];
+                word32 c[2];
+
+                if (op->len >= SESSION_DIRECT) {
+                        flush(t, lane, ctr, n);
+                        n = 0;
+                        direct(t, op);
+                        continue;
+                }
+                if (op->len == 0)
+                        continue;
+
+                /* Block pos/8 is under the counter stepped pos/8 + 1 times */
+                c[0] = gostsmall_seek(start[0], pos / 8 + 1, 0x01010101);
+                c[1] = gostsmall_seek(start[1], pos / 8 + 1, 0x01010104);
+                for (done = 0; done < op->len; done += m) {
+                        lane[n].id = op->id;
+                        lane[n].in = op->in + done;
+                        lane[n].out = op->out + done;
+                        lane[n].o = (unsigned)(pos % 8);
+                        m = 8 - lane[n].o;
+                        if (m > op->len - done)
+                                m = op->len - done;
+                        lane[n].n = (unsigned)m;
+                        ctr[n * 2] = c[0];
+                        ctr[n * 2 + 1] = c[1];
+                        pos += m;
+                        c[0] = gostsmall_step(c[0], 0x01010101);
+                        c[1] = gostsmall_step(c[1], 0x01010104);
+                        if (++n == SESSION_BATCH) {
+                                flush(t, lane, ctr, n);
+                                n = 0;
+                        }
+                }
+                t->pos[op->id] = pos;
+        }
+        flush(t, lane, ctr, n);
+        GOST_PROBE1(exit, "sessions");
+}
+
+void
+gostsessionmac(struct gost_sessions const *t, size_t id, unsigned char mac[8])
+{
+        struct gost_stream s;
+
+        if (!t->mac) {
+                memset(mac, 0, 8);
+                return;
+        }
+        goststreaminit(&s, GOST_MODE_GAMMA, t->flags, t->iv + id * 2);
+        s.pos = t->pos[id];
+        s.mac[0] = t->mac[id * 2];
+        s.mac[1] = t->mac[id * 2 + 1];
+        memcpy(s.part, t->part + id * 8, 8);
+        goststreammac(&s, mac, t->key + id * 8);
+}
+
+unsigned long long
+gostsessiontell(struct gost_sessions const *t, size_t id)
+{
+        return t->pos[id];
+}
+
+size_t
+gostsessionsbytes(struct gost_sessions const *t)
+{
+        return t->capacity * (8 + 2 + 2 + 1) * sizeof(word32) +
+               t->capacity * sizeof(*t->pos) + (t->capacity + 7) / 8 +
+               (t->mac ? t->capacity * (2 * sizeof(word32) + 8) : 0);
+}
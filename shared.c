@@ -0,0 +1,79 @@
+/*
+ * A gamma stream shared by concurrent writers.
+ *
+ * The only shared state that changes is the length of the stream.  A
+ * writer claims its range with one atomic add and then works alone:
+ * the gamma at any position comes from the IV by counter seek, so
+ * there is nothing to wait for and nothing to hand on.
+ */
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gost.h"
+
+struct gost_shared {
+        word32 key[8];
+        word32 iv[2];
+        atomic_ullong next;     /* First byte nobody has reserved */
+};
+
+struct gost_shared *
+gostsharednew(word32 const iv[2], word32 const key[8])
+{
+        struct gost_shared *sh = malloc(sizeof(*sh));
+
+        if (!sh)
+                return NULL;
+        memcpy(sh->key, key, sizeof(sh->key));
+        sh->iv[0] = iv[0];
+        sh->iv[1] = iv[1];
+        atomic_init(&sh->next, 0);
+        return sh;
+}
+
+void
+gostsharedfree(struct gost_shared *sh)
+{
+        volatile word32 *k;
+        int i;
+
+        if (!sh)
+                return;
+        for (k = sh->key, i = 0; i < 8; i++)
+                k[i] = 0;
+        free(sh);
+}
+
+unsigned long long
+gostsharedreserve(struct gost_shared *sh, size_t len)
+{
+        return atomic_fetch_add_explicit(&sh->next, len, memory_order_relaxed);
+}
+
+unsigned long long
+gostsharedtell(struct gost_shared *sh)
+{
+        return atomic_load_explicit(&sh->next, memory_order_relaxed);
+}
+
+void
+gostsharedcrypt(struct gost_shared const *sh, unsigned char const *in,
+                unsigned char *out, size_t len, unsigned long long pos)
+{
+        struct gost_stream s;
+
+        goststreaminit(&s, GOST_MODE_GAMMA, 0, sh->iv);
+        goststreamseek(&s, pos, sh->key);
+        goststream(&s, in, out, len, sh->key);
+}
+
+unsigned long long
+gostsharedwrite(struct gost_shared *sh, unsigned char const *in,
+                unsigned char *out, size_t len)
+{
+        unsigned long long pos = gostsharedreserve(sh, len);
+
+        gostsharedcrypt(sh, in, out, len, pos);
+        return pos;
+}
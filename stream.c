@@ -0,0 +1,282 @@
+/*
+ * Byte streams in gamma and CFB mode with state that can be saved and
+ * restored, for jobs that must survive being killed part way.
+ *
+ * Everything a stream needs to carry on is in struct gost_stream, and
+ * all of it but the gamma of the partial block, which is cheap to
+ * recompute, goes into the saved form.  Resuming from a state saved
+ * after n bytes gives exactly the bytes an uninterrupted run would.
+ */
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gost.h"
+#include "gostwords.h"
+#include "probe.h"
+
+#define STAGE_BLOCKS 512        /* Staged through words when not aligned */
+#define TILE_BYTES 16384        /* Recrypted at a time: well inside L1 plus L2 */
+
+#define STATE_TAG (GOST_STATESIZE - 8)  /* Offset of the MAC of the state */
+
+/* Whether a byte buffer can be handed to the block code as words */
+static int
+direct(void const *p)
+{
+        return gostlittleendian() && (uintptr_t)p % sizeof(word32) == 0;
+}
+
+static word32
+load32(unsigned char const *p)
+{
+        return (word32)p[0] | (word32)p[1] << 8 | (word32)p[2] << 16 |
+               (word32)p[3] << 24;
+}
+
+static void
+store32(unsigned char *p, word32 x)
+{
+        p[0] = (unsigned char)x;
+        p[1] = (unsigned char)(x >> 8);
+        p[2] = (unsigned char)(x >> 16);
+        p[3] = (unsigned char)(x >> 24);
+}
+
+/* Gamma for the block holding pos, for a partial block */
+static void
+refill(struct gost_stream *s, word32 const key[8])
+{
+        word32 g[2] = { 0, 0 };
+
+        if (s->mode == GOST_MODE_GAMMA)
+                gostgamma(g, g, 1, s->iv, s->pos / 8, key);
+        else
+                gostcrypt(s->iv, g, key);
+        store32(s->gamma, g[0]);
+        store32(s->gamma + 4, g[1]);
+}
+
+/* One byte of a partial block */
+static unsigned char
+step(struct gost_stream *s, unsigned char x, word32 const key[8])
+{
+        int const decrypt = s->flags & GOST_STREAM_DECRYPT;
+        unsigned o = (unsigned)(s->pos % 8);
+        unsigned char y;
+
+        if (o == 0)
+                refill(s, key);
+        y = x ^ s->gamma[o];
+        s->part[o] = decrypt ? y : x;
+        s->held[o] = decrypt ? x : y;
+        if (o == 7) {
+                if (s->mode == GOST_MODE_CFB) {
+                        s->iv[0] = load32(s->held);
+                        s->iv[1] = load32(s->held + 4);
+                }
+                if (s->flags & GOST_STREAM_MAC) {
+                        word32 p[2];
+
+                        p[0] = load32(s->part);
+                        p[1] = load32(s->part + 4);
+                        gostmacchain(p, 1, s->mac, key);
+                }
+        }
+        s->pos++;
+        return y;
+}
+
+/* n whole blocks, starting on a block boundary */
+static void
+blocks(struct gost_stream *s, word32 const *in, word32 *out, size_t n,
+       word32 const key[8])
+{
+        int const decrypt = s->flags & GOST_STREAM_DECRYPT;
+        int const mac = s->flags & GOST_STREAM_MAC;
+        size_t i, m;
+
+        /* The MAC is of the plaintext, which in place is gone afterwards */
+        if (mac && !decrypt)
+                gostmacchain(in, n, s->mac, key);
+        if (s->mode == GOST_MODE_GAMMA) {
+                gostgamma(in, out, n, s->iv, s->pos / 8, key);
+        } else if (decrypt) {
+                gostcfbdec(in, out, n, s->iv, key);
+        } else {
+                for (i = 0; i < n; i += m) {
+                        m = n - i < INT_MAX ? n - i : INT_MAX;
+                        gostcfbencrypt(in + i * 2, out + i * 2, (int)m,
+                                       s->iv, key);
+                }
+        }
+        if (mac && decrypt)
+                gostmacchain(out, n, s->mac, key);
+        s->pos += (unsigned long long)n * 8;
+}
+
+void
+goststreaminit(struct gost_stream *s, int mode, int flags, word32 const iv[2])
+{
+        memset(s, 0, sizeof(*s));
+        s->mode = mode;
+        s->flags = flags;
+        s->iv[0] = iv[0];
+        s->iv[1] = iv[1];
+}
+
+void
+goststream(struct gost_stream *s, unsigned char const *in, unsigned char *out,
+           size_t len, word32 const key[8])
+{
+        word32 stage[STAGE_BLOCKS * 2];
+        size_t whole, m, i;
+
+        GOST_PROBE2(entry, "stream", len);
+        for (; len && s->pos % 8; len--)
+                *out++ = step(s, *in++, key);
+
+        whole = len / 8;
+        if (whole && direct(in) && direct(out)) {
+                blocks(s, (word32 const *)(void const *)in,
+                       (word32 *)(void *)out, whole, key);
+                in += whole * 8;
+                out += whole * 8;
+        } else {
+                for (; whole; whole -= m, in += m * 8, out += m * 8) {
+                        m = whole < STAGE_BLOCKS ? whole : STAGE_BLOCKS;
+                        for (i = 0; i < m * 2; i++)
+                                stage[i] = load32(in + i * 4);
+                        blocks(s, stage, stage, m, key);
+                        for (i = 0; i < m * 2; i++)
+                                store32(out + i * 4, stage[i]);
+                }
+        }
+
+        for (len %= 8; len; len--)
+                *out++ = step(s, *in++, key);
+        GOST_PROBE1(exit, "stream");
+}
+
+int
+goststreamseek(struct gost_stream *s, unsigned long long pos,
+               word32 const key[8])
+{
+        if (s->mode != GOST_MODE_GAMMA || (s->flags & GOST_STREAM_MAC))
+                return -1;
+        s->pos = pos;
+        if (pos % 8)
+                refill(s, key);
+        return 0;
+}
+
+void
+goststreamrecrypt(struct gost_stream *from, word32 const fromkey[8],
+                  struct gost_stream *to, word32 const tokey[8],
+                  unsigned char const *in, unsigned char *out, size_t len)
+{
+        size_t m;
+
+        GOST_PROBE2(entry, "recrypt", len);
+        for (; len; len -= m, in += m, out += m) {
+                m = len < TILE_BYTES ? len : TILE_BYTES;
+                goststream(from, in, out, m, fromkey);
+                goststream(to, out, out, m, tokey);
+        }
+        GOST_PROBE1(exit, "recrypt");
+}
+
+void
+goststreammac(struct gost_stream const *s, unsigned char mac[8],
+              word32 const key[8])
+{
+        unsigned char last[8] = { 0 };
+        word32 m[2], p[2];
+        unsigned o = (unsigned)(s->pos % 8);
+
+        m[0] = s->mac[0];
+        m[1] = s->mac[1];
+        if (o) {
+                memcpy(last, s->part, o);
+                p[0] = load32(last);
+                p[1] = load32(last + 4);
+                gostmacchain(p, 1, m, key);
+        }
+        store32(mac, m[0]);
+        store32(mac + 4, m[1]);
+}
+
+/* The MAC of a saved state, over its first STATE_TAG bytes */
+static void
+statetag(unsigned char const *state, word32 tag[2], word32 const key[8])
+{
+        word32 w[(STATE_TAG + 7) / 8 * 2] = { 0 };
+        size_t i;
+
+        for (i = 0; i < STATE_TAG / 4; i++)
+                w[i] = load32(state + i * 4);
+        tag[0] = tag[1] = 0;
+        gostmacchain(w, sizeof(w) / sizeof(w[0]) / 2, tag, key);
+}
+
+void
+goststreamsave(struct gost_stream const *s, unsigned char out[GOST_STATESIZE],
+               word32 const key[8])
+{
+        word32 tag[2];
+        unsigned o = (unsigned)(s->pos % 8);
+
+        memset(out, 0, GOST_STATESIZE);
+        out[0] = 'G';
+        out[1] = 'S';
+        out[2] = GOST_STATEVERSION;
+        out[3] = (unsigned char)(s->mode << 4 | s->flags);
+        store32(out + 4, (word32)(s->pos & 0xffffffff));
+        store32(out + 8, (word32)(s->pos >> 32));
+        store32(out + 12, s->iv[0]);
+        store32(out + 16, s->iv[1]);
+        store32(out + 20, s->mac[0]);
+        store32(out + 24, s->mac[1]);
+        /* Only the bytes of the partial block so far mean anything */
+        if (s->flags & GOST_STREAM_MAC)
+                memcpy(out + 28, s->part, o);
+        if (s->mode == GOST_MODE_CFB)
+                memcpy(out + 36, s->held, o);
+        statetag(out, tag, key);
+        store32(out + STATE_TAG, tag[0]);
+        store32(out + STATE_TAG + 4, tag[1]);
+}
+
+int
+goststreamload(struct gost_stream *s, unsigned char const in[GOST_STATESIZE],
+               word32 const key[8])
+{
+        struct gost_stream t;
+        word32 tag[2];
+        int mode = in[3] >> 4, flags = in[3] & 0xf;
+
+        if (in[0] != 'G' || in[1] != 'S' || in[2] != GOST_STATEVERSION)
+                return -1;
+        statetag(in, tag, key);
+        if ((tag[0] ^ load32(in + STATE_TAG)) | (tag[1] ^ load32(in + STATE_TAG + 4)))
+                return -1;
+        if (mode != GOST_MODE_GAMMA && mode != GOST_MODE_CFB)
+                return -1;
+        if (flags & ~(GOST_STREAM_DECRYPT | GOST_STREAM_MAC))
+                return -1;
+
+        memset(&t, 0, sizeof(t));
+        t.mode = mode;
+        t.flags = flags;
+        t.pos = (unsigned long long)load32(in + 8) << 32 | load32(in + 4);
+        t.iv[0] = load32(in + 12);
+        t.iv[1] = load32(in + 16);
+        t.mac[0] = load32(in + 20);
+        t.mac[1] = load32(in + 24);
+        memcpy(t.part, in + 28, 8);
+        memcpy(t.held, in + 36, 8);
+        if (t.pos % 8)
+                refill(&t, key);
+        *s = t;
+        return 0;
+}
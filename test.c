@@ -0,0 +1,1719 @@
+/*
+ * Known-answer and differential tests for the GOST 28147-89 code.
+ *
+ * The single-block gostcrypt()/gostdecrypt() and the block-at-a-time
+ * modes gostofb(), gostcfbencrypt(), gostcfbdecrypt() and gostmac()
+ * are the reference.  They are pinned down by known answers, and
+ * every faster path is compared against them over random keys,
+ * lengths and buffer alignments.
+ *
+ * Usage: gost_test [iterations] [seed]
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gost.h"
+#include "gostsmall.h"
+
+#define MAX_BLOCKS 67   /* Enough to cover every tail of an 8-wide kernel */
+#define MAX_OFFSET 4    /* Word offsets tried for unaligned buffers */
+
+static int failures;
+
+#define CHECK(cond, ...) \
+        do { \
+                if (!(cond)) { \
+                        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                        fprintf(stderr, __VA_ARGS__); \
+                        fputc('\n', stderr); \
+                        failures++; \
+                } \
+        } while (0)
+
+/* xorshift64*, so runs are reproducible from the seed alone */
+static unsigned long long rng_state;
+
+static word32 rand32(void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return (word32)((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void rand_words(word32 *p, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+                p[i] = rand32();
+}
+
+static int same_words(word32 const *a, word32 const *b, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+                if (a[i] != b[i])
+                        return 0;
+        return 1;
+}
+
+/*
+ * Known answers.
+ *
+ * The key, plaintext and ECB ciphertext are the Magma examples of
+ * GOST R 34.12-2015 (A.2) and GOST R 34.13-2015 (A.2), written in the
+ * little-endian word order used here: in[0] is the low half of the
+ * 64-bit block, key[0] is the first (most significant) key word.
+ */
+static word32 const kat_key[8] = {
+        0xffeeddcc, 0xbbaa9988, 0x77665544, 0x33221100,
+        0xf0f1f2f3, 0xf4f5f6f7, 0xf8f9fafb, 0xfcfdfeff
+};
+
+static word32 const kat_plain[8] = {
+        0x3c130a59, 0x92def06b, 0xf8189d20, 0xdb54c704,
+        0x67a8024c, 0x4a98fb2e, 0x17b57e41, 0x8912409b
+};
+
+static word32 const kat_ecb[8] = {
+        0x94f372a0, 0x2b073f04, 0xd3556e48, 0xde70e715,
+        0xeacfbc1e, 0x11d8d9e9, 0x96c67efb, 0x7c682609
+};
+
+static word32 const kat_iv[2] = { 0x90abcdef, 0x12345678 };
+
+/*
+ * Neither the gamma mode nor the 16-round MAC has published vectors for
+ * these boxes, so these were produced by the reference code.  They catch
+ * any change to the reference itself.
+ */
+struct regression {
+        char const *name;
+        unsigned char const (*sbox)[16];
+        word32 ecb[2];
+        word32 ofb[8];
+        word32 mac[2];
+};
+
+static struct regression const regressions[] = {
+        { "des", gost_sbox_des,
+          { 0x70a54cc5, 0x326a3402 },
+          { 0xa5deb36b, 0x81fcb163, 0x5f9de4d3, 0x41e1db52,
+            0xa1e130de, 0xe26c2159, 0xe6859a02, 0x7e94938d },
+          { 0xc731b17b, 0x8d8e483e } },
+        { "tc26-z", gost_sbox_tc26_z,
+          { 0x94f372a0, 0x2b073f04 },
+          { 0x647b0e95, 0x460e645f, 0x8db8d502, 0x7561993e,
+            0x1b207d92, 0x3477c78f, 0xb858bb4c, 0xb6891363 },
+          { 0x5924dabc, 0x32052a88 } },
+};
+
+static void test_kat(void)
+{
+        word32 out[8];
+        size_t i;
+
+        gostsboxinit(gost_sbox_tc26_z);
+
+        for (i = 0; i < 4; i++) {
+                gostcrypt(&kat_plain[i * 2], &out[i * 2], kat_key);
+                CHECK(same_words(&out[i * 2], &kat_ecb[i * 2], 2),
+                      "tc26-z gostcrypt block %zu", i);
+                gostdecrypt(&kat_ecb[i * 2], &out[i * 2], kat_key);
+                CHECK(same_words(&out[i * 2], &kat_plain[i * 2], 2),
+                      "tc26-z gostdecrypt block %zu", i);
+        }
+
+        gostcrypt2(kat_plain, out, kat_key);
+        gostcrypt2(&kat_plain[4], &out[4], kat_key);
+        CHECK(same_words(out, kat_ecb, 8), "tc26-z gostcrypt2");
+
+        gostcrypt4(kat_plain, out, kat_key);
+        CHECK(same_words(out, kat_ecb, 8), "tc26-z gostcrypt4");
+
+        gostcrypt4s(kat_plain, out, kat_key);
+        CHECK(same_words(out, kat_ecb, 8), "tc26-z gostcrypt4s");
+
+        {
+                word32 in16[16], out16[16];
+
+                memcpy(in16, kat_plain, sizeof(kat_plain));
+                memcpy(in16 + 8, kat_plain, sizeof(kat_plain));
+                gostcrypt8h(in16, out16, kat_key);
+                CHECK(same_words(out16, kat_ecb, 8) &&
+                      same_words(out16 + 8, kat_ecb, 8), "tc26-z gostcrypt8h");
+        }
+
+        {
+                /* GOST R 34.13-2015 A.2.6: the MAC of P1..P4, and its subkeys */
+                static unsigned char const cmac[8] = {
+                        0x15, 0x4e, 0x72, 0x10, 0x20, 0x30, 0xc5, 0xbb
+                };
+                static word32 const k1[2] = { 0x42521424, 0x5f459b33 };
+                static word32 const k2[2] = { 0x84a42848, 0xbe8b3666 };
+                struct gost_cmackey ck;
+                unsigned char msg[32], mac[8];
+
+                for (i = 0; i < 32; i++)
+                        msg[i] = (unsigned char)(kat_plain[i / 8 * 2 + 1 - i % 8 / 4] >>
+                                                 (24 - i % 4 * 8));
+                gostcmackey(&ck, kat_key);
+                CHECK(same_words(ck.k1, k1, 2) && same_words(ck.k2, k2, 2),
+                      "tc26-z gostcmackey subkeys");
+                gostcmac(&ck, msg, sizeof(msg), mac);
+                CHECK(memcmp(mac, cmac, 8) == 0, "tc26-z gostcmac");
+        }
+
+        {
+                /* GOST R 34.13-2015 A.2.2 to A.2.5 */
+                static word32 const ctr[8] = {
+                        0x97b7b93c, 0x4e98110c, 0xd6e85d69, 0x3e250d93,
+                        0x07b2dbef, 0x136d8688, 0xab52a12d, 0x568eb680
+                };
+                static word32 const ofb[8] = {
+                        0x66903c83, 0xdb37e0e2, 0x1f9a089c, 0x0d46644c,
+                        0x430e327e, 0xa0f83062, 0xbd4fdb05, 0xc824efb8
+                };
+                static word32 const cbc[8] = {
+                        0xea683919, 0x96d1b05e, 0xabb937b9, 0xaff76129,
+                        0xc4bc0019, 0x5058b4a1, 0x7cd7e667, 0x20b78b1a
+                };
+                static word32 const cfb[8] = {
+                        0x66903c83, 0xdb37e0e2, 0x1f9a089c, 0x0d46644c,
+                        0x5315d38b, 0x24bdd203, 0x21075505, 0xbcc03214
+                };
+                /* The IVs of two and three blocks, first block first */
+                static word32 const iv3[6] = {
+                        0x90abcdef, 0x12345678, 0x0abcdef1, 0x23456789,
+                        0xabcdef12, 0x34567890
+                };
+                word32 reg[6];
+
+                gost3413ctr(kat_plain, out, 4, 0x12345678, 0, kat_key);
+                CHECK(same_words(out, ctr, 8), "tc26-z gost3413ctr");
+                memcpy(reg, iv3, sizeof(reg));
+                gost3413ofb(kat_plain, out, 4, reg, 2, kat_key);
+                CHECK(same_words(out, ofb, 8), "tc26-z gost3413ofb");
+                memcpy(reg, iv3, sizeof(reg));
+                gost3413cbcencrypt(kat_plain, out, 4, reg, 3, kat_key);
+                CHECK(same_words(out, cbc, 8), "tc26-z gost3413cbcencrypt");
+                memcpy(reg, iv3, sizeof(reg));
+                gost3413cbcdecrypt(out, out, 4, reg, 3, kat_key);
+                CHECK(same_words(out, kat_plain, 8), "tc26-z gost3413cbcdecrypt");
+                memcpy(reg, iv3, sizeof(reg));
+                gost3413cfbencrypt(kat_plain, out, 4, reg, 2, kat_key);
+                CHECK(same_words(out, cfb, 8), "tc26-z gost3413cfbencrypt");
+                memcpy(reg, iv3, sizeof(reg));
+                gost3413cfbdecrypt(out, out, 4, reg, 2, kat_key);
+                CHECK(same_words(out, kat_plain, 8), "tc26-z gost3413cfbdecrypt");
+        }
+
+        for (i = 0; i < sizeof(regressions) / sizeof(regressions[0]); i++) {
+                struct regression const *r = &regressions[i];
+
+                gostsboxinit(r->sbox);
+                gostcrypt(kat_plain, out, kat_key);
+                CHECK(same_words(out, r->ecb, 2), "%s gostcrypt", r->name);
+                gostofb(kat_plain, out, 4, kat_iv, kat_key);
+                CHECK(same_words(out, r->ofb, 8), "%s gostofb", r->name);
+                gostmac(kat_plain, 4, out, kat_key);
+                CHECK(same_words(out, r->mac, 2), "%s gostmac", r->name);
+        }
+}
+
+/*
+ * Straight-from-the-standard models of the chaining modes, built only
+ * on the single-block gostcrypt().  The reference modes must agree with
+ * these, and everything else must agree with the reference modes.
+ */
+/* One step of the gamma counter: add modulo 2^32-1, 0 written as all-ones */
+static void model_step(word32 ctr[2])
+{
+        unsigned long long s;
+
+        s = (unsigned long long)ctr[0] + 0x01010101;
+        ctr[0] = (word32)(s % 0xffffffffULL);
+        if (ctr[0] == 0)
+                ctr[0] = 0xffffffff;
+        s = (unsigned long long)ctr[1] + 0x01010104;
+        ctr[1] = (word32)(s % 0xffffffffULL);
+        if (ctr[1] == 0)
+                ctr[1] = 0xffffffff;
+}
+
+static void model_ofb(word32 const *in, word32 *out, size_t len,
+                      word32 const iv[2], word32 const key[8])
+{
+        word32 ctr[2], gamma[2];
+
+        gostcrypt(iv, ctr, key);
+        while (len--) {
+                model_step(ctr);
+                gostcrypt(ctr, gamma, key);
+                *out++ = *in++ ^ gamma[0];
+                *out++ = *in++ ^ gamma[1];
+        }
+}
+
+static void model_cfb(word32 const *in, word32 *out, size_t len,
+                      word32 iv[2], word32 const key[8], int decrypt)
+{
+        word32 gamma[2];
+
+        while (len--) {
+                gostcrypt(iv, gamma, key);
+                if (decrypt) {
+                        iv[0] = in[0];
+                        iv[1] = in[1];
+                }
+                out[0] = in[0] ^ gamma[0];
+                out[1] = in[1] ^ gamma[1];
+                if (!decrypt) {
+                        iv[0] = out[0];
+                        iv[1] = out[1];
+                }
+                in += 2;
+                out += 2;
+        }
+}
+
+/*
+ * One-block ECB kernels.  Each must match gostcrypt() on every block it
+ * is given; the harness feeds them tails through narrower kernels just
+ * as a bulk caller would.
+ */
+struct kernel {
+        char const *name;
+        size_t width;
+        void (*fn)(word32 const *, word32 *, word32 const *);
+};
+
+static void kernel1(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt(in, out, key);
+}
+
+static void kernel2(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt2(in, out, key);
+}
+
+static void kernel4(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4(in, out, key);
+}
+
+static void kernel1b(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcryptb(in, out, key);
+}
+
+static void kernel2b(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt2b(in, out, key);
+}
+
+static void kernel4b(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4b(in, out, key);
+}
+
+static void kernel4s(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt4s(in, out, key);
+}
+
+static void kernel8h(word32 const *in, word32 *out, word32 const *key)
+{
+        gostcrypt8h(in, out, key);
+}
+
+static struct kernel const kernels[] = {
+        { "gostcrypt2", 2, kernel2 },
+        { "gostcrypt4", 4, kernel4 },
+        { "gostcryptb", 1, kernel1b },
+        { "gostcrypt2b", 2, kernel2b },
+        { "gostcrypt4b", 4, kernel4b },
+        { "gostcrypt4s", 4, kernel4s },
+        { "gostcrypt8h", 8, kernel8h },
+};
+
+static void run_kernel(struct kernel const *k, word32 const *in, word32 *out,
+                       size_t len, word32 const key[8])
+{
+        size_t i = 0;
+
+        for (; i + k->width <= len; i += k->width)
+                k->fn(&in[i * 2], &out[i * 2], key);
+        for (; i < len; i++)
+                kernel1(&in[i * 2], &out[i * 2], key);
+}
+
+struct buffers {
+        word32 plain[MAX_BLOCKS * 2 + MAX_OFFSET];
+        word32 expect[MAX_BLOCKS * 2 + MAX_OFFSET];
+        word32 got[MAX_BLOCKS * 2 + MAX_OFFSET];
+        word32 back[MAX_BLOCKS * 2 + MAX_OFFSET];
+};
+
+static void test_ecb(struct buffers *b, word32 const key[8], size_t len,
+                     size_t off)
+{
+        word32 *in = b->plain + off, *out = b->got + off;
+        size_t i, k;
+
+        for (i = 0; i < len; i++) {
+                gostcrypt(&in[i * 2], &b->expect[i * 2], key);
+                gostdecrypt(&b->expect[i * 2], &b->back[i * 2], key);
+        }
+        CHECK(same_words(b->back, in, len * 2),
+              "gostdecrypt does not invert gostcrypt (len %zu)", len);
+
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                run_kernel(&kernels[k], in, out, len, key);
+                CHECK(same_words(out, b->expect, len * 2),
+                      "%s (len %zu, offset %zu)", kernels[k].name, len, off);
+
+                /* In place */
+                memcpy(out, in, len * 2 * sizeof(word32));
+                run_kernel(&kernels[k], out, out, len, key);
+                CHECK(same_words(out, b->expect, len * 2),
+                      "%s in place (len %zu, offset %zu)",
+                      kernels[k].name, len, off);
+        }
+}
+
+static void test_ofb(struct buffers *b, word32 const key[8], size_t len,
+                     size_t off)
+{
+        word32 *in = b->plain + off, *out = b->got + off;
+        word32 iv[2];
+
+        rand_words(iv, 2);
+        model_ofb(in, b->expect, len, iv, key);
+
+        gostofb(in, out, (int)len, iv, key);
+        CHECK(same_words(out, b->expect, len * 2),
+              "gostofb (len %zu, offset %zu)", len, off);
+
+        gostofb(out, b->back, (int)len, iv, key);
+        CHECK(same_words(b->back, in, len * 2),
+              "gostofb is not self-inverse (len %zu)", len);
+
+        memcpy(out, in, len * 2 * sizeof(word32));
+        gostofb(out, out, (int)len, iv, key);
+        CHECK(same_words(out, b->expect, len * 2),
+              "gostofb in place (len %zu, offset %zu)", len, off);
+}
+
+static void test_cfb(struct buffers *b, word32 const key[8], size_t len,
+                     size_t off)
+{
+        word32 *in = b->plain + off, *out = b->got + off;
+        word32 iv0[2], iv[2], miv[2];
+        size_t split = len ? (size_t)rand32() % (len + 1) : 0;
+
+        rand_words(iv0, 2);
+
+        memcpy(miv, iv0, sizeof(miv));
+        model_cfb(in, b->expect, len, miv, key, 0);
+
+        memcpy(iv, iv0, sizeof(iv));
+        gostcfbencrypt(in, out, (int)len, iv, key);
+        CHECK(same_words(out, b->expect, len * 2) && same_words(iv, miv, 2),
+              "gostcfbencrypt (len %zu, offset %zu)", len, off);
+
+        /* The IV carries the chain across calls */
+        memcpy(iv, iv0, sizeof(iv));
+        gostcfbencrypt(in, out, (int)split, iv, key);
+        gostcfbencrypt(in + split * 2, out + split * 2, (int)(len - split),
+                       iv, key);
+        CHECK(same_words(out, b->expect, len * 2) && same_words(iv, miv, 2),
+              "gostcfbencrypt split at %zu (len %zu)", split, len);
+
+        memcpy(iv, iv0, sizeof(iv));
+        gostcfbdecrypt(b->expect, b->back, (int)len, iv, key);
+        CHECK(same_words(b->back, in, len * 2) && same_words(iv, miv, 2),
+              "gostcfbdecrypt (len %zu, offset %zu)", len, off);
+
+        memcpy(iv, iv0, sizeof(iv));
+        memcpy(out, b->expect, len * 2 * sizeof(word32));
+        gostcfbdecrypt(out, out, (int)len, iv, key);
+        CHECK(same_words(out, in, len * 2),
+              "gostcfbdecrypt in place (len %zu, offset %zu)", len, off);
+}
+
+static void test_mac(struct buffers *b, word32 const key[8], size_t len,
+                     size_t off)
+{
+        word32 *in = b->plain + off;
+        word32 expect[2], mac[2] = { 0, 0 };
+        size_t split = len ? (size_t)rand32() % (len + 1) : 0;
+
+        gostmac(in, (int)len, expect, key);
+        gostmacchain(in, split, mac, key);
+        gostmacchain(in + split * 2, len - split, mac, key);
+        CHECK(same_words(mac, expect, 2),
+              "gostmacchain split at %zu (len %zu)", split, len);
+}
+
+/*
+ * A byte stream cut into random pieces, saved and restored into a
+ * fresh state between every two, against the block modes on the
+ * zero-padded message.  Odd offsets take the staged path.
+ */
+#define STREAM_BYTES (MAX_BLOCKS * 8)
+
+static void stream_pieces(struct gost_stream *s, unsigned char const *in,
+                          unsigned char *out, size_t n, word32 const key[8])
+{
+        unsigned char state[GOST_STATESIZE];
+        size_t done = 0, m;
+
+        while (done < n) {
+                m = (size_t)rand32() % (n - done + 1);
+                if (rand32() % 4 == 0)
+                        m = m % 9;      /* Plenty of partial blocks */
+                goststream(s, in + done, out + done, m, key);
+                done += m;
+                goststreamsave(s, state, key);
+                memset(s, 0xa5, sizeof(*s));
+                CHECK(goststreamload(s, state, key) == 0,
+                      "goststreamload of a good state at %zu", done);
+        }
+}
+
+static void test_stream(word32 const key[8])
+{
+        static unsigned char plain[STREAM_BYTES + 1], crypt[STREAM_BYTES + 1],
+                             back[STREAM_BYTES + 1];
+        word32 pw[MAX_BLOCKS * 2], cw[MAX_BLOCKS * 2], iv[2], riv[2], wrong[8];
+        word32 expect[2];
+        unsigned char emac[8], mac[8], state[GOST_STATESIZE];
+        struct gost_stream s;
+        size_t n = (size_t)rand32() % (STREAM_BYTES + 1);
+        size_t off = rand32() % 2, blocks = (n + 7) / 8, i;
+        int mode;
+
+        for (i = 0; i < n; i++)
+                plain[off + i] = (unsigned char)rand32();
+        memset(pw, 0, sizeof(pw));
+        for (i = 0; i < n; i++)
+                pw[i / 4] |= (word32)plain[off + i] << (i % 4 * 8);
+        rand_words(iv, 2);
+        gostmac(pw, (int)blocks, expect, key);
+        for (i = 0; i < 8; i++)
+                emac[i] = (unsigned char)(expect[i / 4] >> (i % 4 * 8));
+
+        for (mode = GOST_MODE_GAMMA; mode <= GOST_MODE_CFB; mode++) {
+                riv[0] = iv[0];
+                riv[1] = iv[1];
+                if (mode == GOST_MODE_GAMMA)
+                        gostofb(pw, cw, (int)blocks, iv, key);
+                else
+                        gostcfbencrypt(pw, cw, (int)blocks, riv, key);
+
+                goststreaminit(&s, mode, GOST_STREAM_MAC, iv);
+                stream_pieces(&s, plain + off, crypt + off, n, key);
+                for (i = 0; i < n; i++)
+                        if (crypt[off + i] != (unsigned char)(cw[i / 4] >> (i % 4 * 8)))
+                                break;
+                CHECK(i == n, "goststream mode %d encrypt (len %zu, byte %zu)",
+                      mode, n, i);
+                goststreammac(&s, mac, key);
+                CHECK(memcmp(mac, emac, 8) == 0,
+                      "goststreammac mode %d encrypt (len %zu)", mode, n);
+
+                goststreaminit(&s, mode, GOST_STREAM_MAC | GOST_STREAM_DECRYPT, iv);
+                memcpy(back + off, crypt + off, n);
+                stream_pieces(&s, back + off, back + off, n, key);
+                CHECK(memcmp(back + off, plain + off, n) == 0,
+                      "goststream mode %d decrypt in place (len %zu)", mode, n);
+                goststreammac(&s, back, key);
+                CHECK(memcmp(back, emac, 8) == 0,
+                      "goststreammac mode %d decrypt (len %zu)", mode, n);
+        }
+
+        /* A state that was damaged, or saved under another key, is refused */
+        goststreamsave(&s, state, key);
+        memcpy(wrong, key, sizeof(wrong));
+        wrong[rand32() % 8] ^= 1;
+        CHECK(goststreamload(&s, state, wrong) == -1, "goststreamload under another key");
+        i = (size_t)rand32() % GOST_STATESIZE;
+        state[i] ^= (unsigned char)(1 << rand32() % 8);
+        CHECK(goststreamload(&s, state, key) == -1,
+              "goststreamload of a state damaged at byte %zu", i);
+}
+
+/*
+ * Re-encryption in one pass, from every mode to every mode, against
+ * encrypting the plaintext under the new key directly.  Long enough to
+ * cross several tiles, and resumed from saved states part way.
+ */
+#define RECRYPT_BYTES 40000
+
+static void test_recrypt(void)
+{
+        static unsigned char plain[RECRYPT_BYTES], crypt[RECRYPT_BYTES],
+                             want[RECRYPT_BYTES];
+        word32 key[2][8], iv[2][2];
+        unsigned char mac[8], wantmac[8], oldmac[8], state[GOST_STATESIZE];
+        struct gost_stream a, b;
+        size_t n = RECRYPT_BYTES - (size_t)rand32() % 64, cut, i;
+        int from, to;
+
+        rand_words(key[0], 16);
+        rand_words(iv[0], 4);
+        for (i = 0; i < n; i++)
+                plain[i] = (unsigned char)rand32();
+
+        for (from = GOST_MODE_GAMMA; from <= GOST_MODE_CFB; from++)
+                for (to = GOST_MODE_GAMMA; to <= GOST_MODE_CFB; to++) {
+                        goststreaminit(&a, to, GOST_STREAM_MAC, iv[1]);
+                        goststream(&a, plain, want, n, key[1]);
+                        goststreammac(&a, wantmac, key[1]);
+
+                        goststreaminit(&a, from, GOST_STREAM_MAC, iv[0]);
+                        goststream(&a, plain, crypt, n, key[0]);
+                        goststreammac(&a, oldmac, key[0]);
+
+                        cut = (size_t)rand32() % n;
+                        goststreaminit(&a, from, GOST_STREAM_DECRYPT | GOST_STREAM_MAC, iv[0]);
+                        goststreaminit(&b, to, GOST_STREAM_MAC, iv[1]);
+                        goststreamrecrypt(&a, key[0], &b, key[1], crypt, crypt, cut);
+                        goststreamsave(&b, state, key[1]);
+                        memset(&b, 0, sizeof(b));
+                        CHECK(goststreamload(&b, state, key[1]) == 0, "goststreamload");
+                        goststreamrecrypt(&a, key[0], &b, key[1], crypt + cut,
+                                          crypt + cut, n - cut);
+                        CHECK(memcmp(crypt, want, n) == 0,
+                              "goststreamrecrypt %d to %d (len %zu, cut %zu)",
+                              from, to, n, cut);
+                        goststreammac(&a, mac, key[0]);
+                        CHECK(memcmp(mac, oldmac, 8) == 0,
+                              "goststreamrecrypt %d to %d old MAC", from, to);
+                        goststreammac(&b, mac, key[1]);
+                        CHECK(memcmp(mac, wantmac, 8) == 0,
+                              "goststreamrecrypt %d to %d new MAC", from, to);
+                }
+}
+
+/*
+ * A chunked object under random edits, against the plaintext kept on
+ * the side: reads give it back, each edit changes only the ciphertext
+ * of its own chunks, the metadata reopens, and damage is caught.  An
+ * object a generation on does not take the gamma of the object whose
+ * IV is one more.
+ */
+#define OBJECT_BYTES 5000
+#define OBJECT_CHUNK 256
+
+static void test_object(void)
+{
+        static unsigned char plain[OBJECT_BYTES], crypt[OBJECT_BYTES],
+                             before[OBJECT_BYTES], got[OBJECT_BYTES];
+        unsigned char data[600];
+        struct gost_object *o, *p;
+        word32 key[8], iv[2], root[2], root2[2], *meta;
+        word32 const *m;
+        size_t size = OBJECT_BYTES - (size_t)rand32() % 300, nwords, off, len, i;
+        int edit;
+
+        rand_words(key, 8);
+        rand_words(iv, 2);
+        for (i = 0; i < size; i++)
+                plain[i] = (unsigned char)rand32();
+        o = gostobjectseal(plain, crypt, size, OBJECT_CHUNK, iv, key);
+        CHECK(o != NULL, "gostobjectseal");
+        if (!o)
+                return;
+        CHECK(gostobjectread(o, crypt, 0, got, size) == 0 &&
+              memcmp(got, plain, size) == 0, "gostobjectread of a sealed object");
+
+        for (edit = 0; edit < 20; edit++) {
+                off = (size_t)rand32() % size;
+                len = (size_t)rand32() % sizeof(data);
+                if (len > size - off)
+                        len = size - off;
+                for (i = 0; i < len; i++)
+                        data[i] = (unsigned char)rand32();
+                memcpy(before, crypt, size);
+                gostobjectroot(o, root);
+                CHECK(gostobjectupdate(o, crypt, off, data, len) == 0,
+                      "gostobjectupdate at %zu len %zu", off, len);
+                memcpy(plain + off, data, len);
+                for (i = 0; i < size; i++)
+                        if (crypt[i] != before[i] &&
+                            (len == 0 || i / OBJECT_CHUNK < off / OBJECT_CHUNK ||
+                             i / OBJECT_CHUNK > (off + len - 1) / OBJECT_CHUNK))
+                                break;
+                CHECK(i == size, "gostobjectupdate at %zu len %zu touched byte %zu",
+                      off, len, i);
+                gostobjectroot(o, root2);
+                CHECK(len == 0 || root[0] != root2[0] || root[1] != root2[1],
+                      "gostobjectupdate at %zu len %zu left the root alone", off, len);
+                i = (size_t)rand32() % size;
+                CHECK(gostobjectread(o, crypt, i, got, size - i) == 0 &&
+                      memcmp(got, plain + i, size - i) == 0,
+                      "gostobjectread from %zu after edit %d", i, edit);
+        }
+        CHECK(gostobjectupdate(o, crypt, size, data, 1) == -1,
+              "gostobjectupdate past the end");
+
+        m = gostobjectmeta(o, &nwords);
+        meta = malloc(nwords * sizeof(word32));
+        memcpy(meta, m, nwords * sizeof(word32));
+        p = gostobjectopen(meta, size, OBJECT_CHUNK, iv, key);
+        CHECK(p != NULL, "gostobjectopen of good metadata");
+        if (p) {
+                gostobjectroot(p, root2);
+                gostobjectroot(o, root);
+                CHECK(root[0] == root2[0] && root[1] == root2[1], "gostobjectopen root");
+                CHECK(gostobjectread(p, crypt, 0, got, size) == 0 &&
+                      memcmp(got, plain, size) == 0, "gostobjectread after reopen");
+                gostobjectfree(p);
+        }
+        meta[nwords - 1 - (size_t)rand32() % 4] ^= 1;
+        p = gostobjectopen(meta, size, OBJECT_CHUNK, iv, key);
+        CHECK(p == NULL || (gostobjectroot(p, root2), root[0] != root2[0] ||
+                            root[1] != root2[1]), "gostobjectopen of a damaged tree");
+        gostobjectfree(p);
+        free(meta);
+
+        /* A damaged chunk fails to read, and an update over it does nothing */
+        i = (size_t)rand32() % size;
+        crypt[i] ^= 0x10;
+        memcpy(before, crypt, size);
+        CHECK(gostobjectread(o, crypt, i, got, 1) == -1,
+              "gostobjectread of a damaged chunk");
+        off = i / OBJECT_CHUNK * OBJECT_CHUNK;
+        len = size - off < 2 * OBJECT_CHUNK ? size - off : 2 * OBJECT_CHUNK;
+        CHECK(gostobjectupdate(o, crypt, off, plain + off, len) == -1 &&
+              memcmp(crypt, before, size) == 0, "gostobjectupdate over a damaged chunk");
+        gostobjectfree(o);
+
+        /* Zeros encrypt to the gamma itself */
+        memset(plain, 0, OBJECT_CHUNK);
+        o = gostobjectseal(plain, crypt, OBJECT_CHUNK, OBJECT_CHUNK, iv, key);
+        iv[1]++;
+        p = gostobjectseal(plain, before, OBJECT_CHUNK, OBJECT_CHUNK, iv, key);
+        CHECK(o && p && gostobjectupdate(o, crypt, 0, plain, 1) == 0 &&
+              memcmp(crypt, before, OBJECT_CHUNK) != 0,
+              "gostobjectupdate reuses the gamma of the next IV");
+        gostobjectfree(o);
+        gostobjectfree(p);
+}
+
+/*
+ * The 34.13 MAC, straight from the standard: pad unless whole, then
+ * chain through gostcrypt() with the subkey added to the last block.
+ */
+static void model_cmac(word32 const key[8], unsigned char const *p, size_t len,
+                       unsigned char mac[8])
+{
+        word32 r[2] = { 0, 0 }, k[2], c[2] = { 0, 0 }, b[2];
+        unsigned char last[8];
+        size_t nb = len ? (len + 7) / 8 : 1, i, j;
+        int d;
+
+        gostcrypt(c, r, key);
+        for (d = 0; d < (len && len % 8 == 0 ? 1 : 2); d++) {
+                k[1] = (r[1] << 1 | r[0] >> 31) & 0xffffffff;
+                k[0] = (r[0] << 1 & 0xffffffff) ^ (r[1] >> 31 ? 0x1b : 0);
+                r[0] = k[0];
+                r[1] = k[1];
+        }
+        for (i = 0; i < nb; i++) {
+                memset(last, 0, 8);
+                for (j = 0; j < 8 && i * 8 + j < len; j++)
+                        last[j] = p[i * 8 + j];
+                if (j < 8)
+                        last[j] = 0x80;
+                b[1] = (word32)last[0] << 24 | (word32)last[1] << 16 |
+                       (word32)last[2] << 8 | last[3];
+                b[0] = (word32)last[4] << 24 | (word32)last[5] << 16 |
+                       (word32)last[6] << 8 | last[7];
+                b[0] ^= c[0];
+                b[1] ^= c[1];
+                if (i == nb - 1) {
+                        b[0] ^= k[0];
+                        b[1] ^= k[1];
+                }
+                gostcrypt(b, c, key);
+        }
+        for (i = 0; i < 8; i++)
+                mac[i] = (unsigned char)(c[1 - i / 4] >> (24 - i % 4 * 8));
+}
+
+/* Whole, in pieces and batched under a mix of keys, against the model */
+#define CMAC_JOBS 37
+
+static void test_cmac(void)
+{
+        static unsigned char msg[CMAC_JOBS][80];
+        struct gost_cmackey ck[3];
+        struct gost_cmacjob jobs[CMAC_JOBS];
+        struct gost_cmac c;
+        word32 key[3][8];
+        unsigned char mac[8], want[8];
+        size_t i, j, n;
+
+        rand_words(key[0], 24);
+        for (i = 0; i < 3; i++)
+                gostcmackey(&ck[i], key[i]);
+        for (i = 0; i < CMAC_JOBS; i++) {
+                /* Every length up to 17 bytes, then some longer */
+                n = i < 18 ? i : (size_t)rand32() % sizeof(msg[i]);
+                for (j = 0; j < n; j++)
+                        msg[i][j] = (unsigned char)rand32();
+                jobs[i].ck = &ck[rand32() % 3];
+                jobs[i].msg = msg[i];
+                jobs[i].len = n;
+        }
+        gostcmacbatch(jobs, CMAC_JOBS);
+
+        for (i = 0; i < CMAC_JOBS; i++) {
+                word32 const *k = key[jobs[i].ck - ck];
+
+                model_cmac(k, msg[i], jobs[i].len, want);
+                gostcmac(jobs[i].ck, msg[i], jobs[i].len, mac);
+                CHECK(memcmp(mac, want, 8) == 0, "gostcmac (len %zu)", jobs[i].len);
+                CHECK(memcmp(jobs[i].mac, want, 8) == 0,
+                      "gostcmacbatch job %zu (len %zu)", i, jobs[i].len);
+
+                gostcmacinit(&c, jobs[i].ck);
+                for (j = 0; j < jobs[i].len; j += n) {
+                        n = (size_t)rand32() % 12;
+                        if (n > jobs[i].len - j)
+                                n = jobs[i].len - j;
+                        gostcmacupdate(&c, msg[i] + j, n);
+                }
+                gostcmacfinal(&c, mac);
+                CHECK(memcmp(mac, want, 8) == 0,
+                      "gostcmacupdate in pieces (len %zu)", jobs[i].len);
+        }
+}
+
+/* The inline small-message forms, at each of their sizes */
+static void test_small(word32 const key[8])
+{
+        static size_t const sizes[] = { 1, 2, 4, 8 };
+        word32 in[16], expect[16], got[16], iv[2], mac[2] = { 0, 0 };
+        unsigned long long pos;
+        size_t s, n, i;
+
+        rand_words(in, 16);
+        rand_words(iv, 2);
+        pos = rand32() % 4 ? rand32() : 0;
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                n = sizes[s];
+
+                for (i = 0; i < n; i++)
+                        gostcrypt(&in[i * 2], &expect[i * 2], key);
+                switch (n) {
+                case 1: gostsmallcrypt1(in, got, key); break;
+                case 2: gostsmallcrypt2(in, got, key); break;
+                case 4: gostsmallcrypt4(in, got, key); break;
+                case 8: gostsmallcrypt8(in, got, key); break;
+                }
+                CHECK(same_words(got, expect, n * 2), "gostsmallcrypt%zu", n);
+
+                for (i = 0; i < n; i++)
+                        gostdecrypt(&in[i * 2], &expect[i * 2], key);
+                switch (n) {
+                case 1: gostsmalldecrypt1(in, got, key); break;
+                case 2: gostsmalldecrypt2(in, got, key); break;
+                case 4: gostsmalldecrypt4(in, got, key); break;
+                case 8: gostsmalldecrypt8(in, got, key); break;
+                }
+                CHECK(same_words(got, expect, n * 2), "gostsmalldecrypt%zu", n);
+
+                gostgamma(in, expect, n, iv, pos, key);
+                switch (n) {
+                case 1: gostsmallgamma1(in, got, iv, pos, key); break;
+                case 2: gostsmallgamma2(in, got, iv, pos, key); break;
+                case 4: gostsmallgamma4(in, got, iv, pos, key); break;
+                case 8: gostsmallgamma8(in, got, iv, pos, key); break;
+                }
+                CHECK(same_words(got, expect, n * 2), "gostsmallgamma%zu at %llu",
+                      n, pos);
+
+                gostmac(in, (int)n, expect, key);
+                switch (n) {
+                case 1: gostsmallmac1(in, mac, key); break;
+                case 2: gostsmallmac2(in, mac, key); break;
+                case 4: gostsmallmac4(in, mac, key); break;
+                case 8: gostsmallmac8(in, mac, key); break;
+                }
+                CHECK(same_words(mac, expect, 2), "gostsmallmac%zu", n);
+        }
+}
+
+/*
+ * The bulk modes, under every choice the dispatcher can be given.
+ */
+static struct gost_choice const choices[] = {
+        { 1, GOST_TIER_WORD, 1 },
+        { 2, GOST_TIER_WORD, 3 },
+        { 4, GOST_TIER_WORD, 64 },
+        { 4, GOST_TIER_WORD, GOST_MAXCHUNK },
+        { 1, GOST_TIER_BYTE, 5 },
+        { 2, GOST_TIER_BYTE, 16 },
+        { 4, GOST_TIER_BYTE, GOST_MAXCHUNK },
+        { 4, GOST_TIER_SIMD, 7 },
+        { 4, GOST_TIER_SIMD, GOST_MAXCHUNK },
+        { 8, GOST_TIER_HYBRID, 13 },
+        { 8, GOST_TIER_HYBRID, GOST_MAXCHUNK },
+};
+
+/*
+ * Planner settings that force each strategy even on small inputs:
+ * always scalar, never split, and splits across 2 to 4 threads.
+ */
+static struct gost_tunables const plans[] = {
+        { (size_t)-1, (size_t)-1, 1, 1 },
+        { 0, (size_t)-1, 1, 1 },
+        { 0, 2, 1, 2 },
+        { 1, 2, 1, 3 },
+        { 0, 8, 3, 4 },
+};
+
+static void test_bulk(struct buffers *b, word32 const key[8], size_t len,
+                      size_t off)
+{
+        word32 *in = b->plain + off, *out = b->got + off;
+        word32 iv0[2], iv[2], miv[2];
+        size_t c, i, pos;
+        size_t p = (size_t)rand32() % (sizeof(plans) / sizeof(plans[0]));
+        int op;
+
+        rand_words(iv0, 2);
+        CHECK(gostsettunables(&plans[p]) == 0, "gostsettunables");
+
+        for (c = 0; c < sizeof(choices) / sizeof(choices[0]); c++) {
+                struct gost_choice const *ch = &choices[c];
+
+                for (op = 0; op < GOST_NOPS; op++)
+                        CHECK(gostsetchoice(op, ch) == 0, "gostsetchoice");
+
+                for (i = 0; i < len; i++)
+                        gostcrypt(&in[i * 2], &b->expect[i * 2], key);
+                gostecb(in, out, len, key);
+                CHECK(same_words(out, b->expect, len * 2),
+                      "gostecb choice %zu plan %zu (len %zu, offset %zu)",
+                      c, p, len, off);
+
+                model_ofb(in, b->expect, len, iv0, key);
+                gostgamma(in, out, len, iv0, 0, key);
+                CHECK(same_words(out, b->expect, len * 2),
+                      "gostgamma choice %zu plan %zu (len %zu, offset %zu)",
+                      c, p, len, off);
+
+                /* Starting part way into the stream */
+                pos = len ? (size_t)rand32() % len : 0;
+                gostgamma(in + pos * 2, out, len - pos, iv0, pos, key);
+                CHECK(same_words(out, b->expect + pos * 2, (len - pos) * 2),
+                      "gostgamma choice %zu from block %zu (len %zu)",
+                      c, pos, len);
+
+                memcpy(miv, iv0, sizeof(miv));
+                model_cfb(in, b->expect, len, miv, key, 0);
+                memcpy(iv, iv0, sizeof(iv));
+                gostcfbdec(b->expect, out, len, iv, key);
+                CHECK(same_words(out, in, len * 2) && same_words(iv, miv, 2),
+                      "gostcfbdec choice %zu plan %zu (len %zu, offset %zu)",
+                      c, p, len, off);
+
+                memcpy(iv, iv0, sizeof(iv));
+                memcpy(out, b->expect, len * 2 * sizeof(word32));
+                gostcfbdec(out, out, len, iv, key);
+                CHECK(same_words(out, in, len * 2) && same_words(iv, miv, 2),
+                      "gostcfbdec choice %zu plan %zu in place (len %zu)",
+                      c, p, len);
+        }
+}
+
+/*
+ * The 34.13 modes one block at a time on an explicit shift register of
+ * z blocks: the block at the front is used and the feedback goes on
+ * the back.
+ */
+enum { M3413_OFB, M3413_CBC, M3413_CFB };
+
+static void model_3413(int mode, int decrypt, word32 const *in, word32 *out,
+                       size_t len, word32 *reg, size_t z, word32 const key[8])
+{
+        word32 t[2], fb[2];
+        size_t i;
+
+        for (i = 0; i < len; i++, in += 2, out += 2) {
+                switch (mode) {
+                case M3413_OFB:
+                        gostcrypt(reg, fb, key);
+                        t[0] = in[0] ^ fb[0];
+                        t[1] = in[1] ^ fb[1];
+                        break;
+                case M3413_CBC:
+                        if (decrypt) {
+                                gostdecrypt(in, t, key);
+                                t[0] ^= reg[0];
+                                t[1] ^= reg[1];
+                                fb[0] = in[0];
+                                fb[1] = in[1];
+                        } else {
+                                t[0] = in[0] ^ reg[0];
+                                t[1] = in[1] ^ reg[1];
+                                gostcrypt(t, t, key);
+                                fb[0] = t[0];
+                                fb[1] = t[1];
+                        }
+                        break;
+                default:
+                        gostcrypt(reg, t, key);
+                        t[0] ^= in[0];
+                        t[1] ^= in[1];
+                        fb[0] = decrypt ? in[0] : t[0];
+                        fb[1] = decrypt ? in[1] : t[1];
+                        break;
+                }
+                out[0] = t[0];
+                out[1] = t[1];
+                memmove(reg, reg + 2, (z - 1) * 2 * sizeof(word32));
+                reg[z * 2 - 2] = fb[0];
+                reg[z * 2 - 1] = fb[1];
+        }
+}
+
+/*
+ * Each 34.13 mode against the model, for a random z and dispatcher
+ * choice, in two pieces to carry the register across calls, and
+ * decrypting in place.
+ */
+static void test_3413(struct buffers *b, word32 const key[8], size_t len,
+                      size_t off)
+{
+        typedef int zmode(word32 const *, word32 *, size_t, word32 *, size_t,
+                          word32 const *);
+        static zmode *const enc[3] = {
+                gost3413ofb, gost3413cbcencrypt, gost3413cfbencrypt
+        };
+        static zmode *const dec[3] = {
+                gost3413ofb, gost3413cbcdecrypt, gost3413cfbdecrypt
+        };
+        word32 *in = b->plain + off, *out = b->got + off;
+        word32 iv[12 * 2], reg[12 * 2], mreg[12 * 2];
+        size_t z = (size_t)rand32() % 12 + 1, cut = len ? (size_t)rand32() % len : 0;
+        size_t c = (size_t)rand32() % (sizeof(choices) / sizeof(choices[0]));
+        word32 ctriv = rand32();
+        unsigned long long pos = rand32() % 4 ? rand32() : 0xffffffffffffffffULL - len / 2;
+        size_t i;
+        int mode, op;
+
+        for (op = 0; op < GOST_NOPS; op++)
+                gostsetchoice(op, &choices[c]);
+        rand_words(iv, z * 2);
+
+        for (mode = M3413_OFB; mode <= M3413_CFB; mode++) {
+                memcpy(mreg, iv, z * 2 * sizeof(word32));
+                model_3413(mode, 0, in, b->expect, len, mreg, z, key);
+                memcpy(reg, iv, z * 2 * sizeof(word32));
+                enc[mode](in, out, cut, reg, z, key);
+                enc[mode](in + cut * 2, out + cut * 2, len - cut, reg, z, key);
+                CHECK(same_words(out, b->expect, len * 2) &&
+                      same_words(reg, mreg, z * 2),
+                      "34.13 mode %d encrypt choice %zu (len %zu, z %zu, cut %zu)",
+                      mode, c, len, z, cut);
+
+                memcpy(reg, iv, z * 2 * sizeof(word32));
+                dec[mode](out, out, cut, reg, z, key);
+                dec[mode](out + cut * 2, out + cut * 2, len - cut, reg, z, key);
+                CHECK(same_words(out, in, len * 2) && same_words(reg, mreg, z * 2),
+                      "34.13 mode %d decrypt in place choice %zu (len %zu, z %zu)",
+                      mode, c, len, z);
+        }
+        CHECK(gost3413ofb(in, out, len, reg, 0, key) == -1 &&
+              gost3413cbcdecrypt(in, out, len, reg, GOST_MAXCHUNK + 1, key) == -1,
+              "34.13 modes refuse z out of range");
+
+        /* CTR, wrapping the counter around when pos is near the top */
+        for (i = 0; i < len; i++) {
+                unsigned long long v = ((unsigned long long)ctriv << 32) + pos + i;
+                word32 ctr[2];
+
+                ctr[0] = (word32)(v & 0xffffffff);
+                ctr[1] = (word32)(v >> 32);
+                gostcrypt(ctr, &b->expect[i * 2], key);
+                b->expect[i * 2] ^= in[i * 2];
+                b->expect[i * 2 + 1] ^= in[i * 2 + 1];
+        }
+        gost3413ctr(in, out, len, ctriv, pos, key);
+        CHECK(same_words(out, b->expect, len * 2),
+              "gost3413ctr choice %zu (len %zu, pos %llu)", c, len, pos);
+}
+
+/* Many short streams in one call, each against its own gostgamma() */
+#define GAMMAV_STREAMS 37
+
+static void test_gammav(word32 const key[8])
+{
+        static word32 in[GAMMAV_STREAMS * 16], out[GAMMAV_STREAMS * 16],
+                      expect[16];
+        struct gost_gammavec v[GAMMAV_STREAMS];
+        word32 ivs[GAMMAV_STREAMS * 2];
+        size_t i;
+
+        rand_words(in, GAMMAV_STREAMS * 16);
+        rand_words(ivs, GAMMAV_STREAMS * 2);
+        for (i = 0; i < GAMMAV_STREAMS; i++) {
+                v[i].in = in + i * 16;
+                v[i].out = out + i * 16;
+                v[i].len = (size_t)rand32() % 9;
+                v[i].iv = ivs + i * 2;
+                v[i].pos = rand32();
+        }
+        gostgammav(v, GAMMAV_STREAMS, key);
+        for (i = 0; i < GAMMAV_STREAMS; i++) {
+                gostgamma(v[i].in, expect, v[i].len, v[i].iv, v[i].pos, key);
+                CHECK(same_words(v[i].out, expect, v[i].len * 2),
+                      "gostgammav stream %zu (len %zu)", i, v[i].len);
+        }
+}
+
+/* Seeking far into the stream, across many wraps of the counter */
+static void test_gamma_seek(word32 const key[8])
+{
+        static word32 const zero[4];
+        word32 iv[2], ctr[2], expect[2], got[4];
+        unsigned long pos, i;
+
+        rand_words(iv, 2);
+        pos = rand32() % (1UL << 20);
+
+        gostcrypt(iv, ctr, key);
+        for (i = 0; i <= pos; i++)
+                model_step(ctr);
+        gostcrypt(ctr, expect, key);
+
+        gostgamma(zero, got, 2, iv, pos, key);
+        CHECK(same_words(got, expect, 2), "gostgamma at block %lu", pos);
+}
+
+/*
+ * Several callers splitting work across the pool at once, each checked
+ * against the serial result.
+ */
+#define CONCURRENT_CALLERS 4
+#define CONCURRENT_BLOCKS 4099
+
+struct caller {
+        pthread_t thread;
+        word32 key[8];
+        word32 iv[2];
+        word32 in[CONCURRENT_BLOCKS * 2];
+        word32 expect[CONCURRENT_BLOCKS * 2];
+        word32 got[CONCURRENT_BLOCKS * 2];
+};
+
+static void *concurrent_caller(void *arg)
+{
+        struct caller *c = arg;
+        int i;
+
+        for (i = 0; i < 20; i++)
+                gostgamma(c->in, c->got, CONCURRENT_BLOCKS, c->iv,
+                          (unsigned long long)i, c->key);
+        return NULL;
+}
+
+static void test_concurrent(void)
+{
+        static struct caller callers[CONCURRENT_CALLERS];
+        struct gost_tunables t = { 0, 64, 16, 4 };
+        struct gost_tunables serial = { 0, (size_t)-1, 1, 4 };
+        int i;
+
+        gostsettunables(&serial);
+        for (i = 0; i < CONCURRENT_CALLERS; i++) {
+                struct caller *c = &callers[i];
+
+                rand_words(c->key, 8);
+                rand_words(c->iv, 2);
+                rand_words(c->in, CONCURRENT_BLOCKS * 2);
+                gostgamma(c->in, c->expect, CONCURRENT_BLOCKS, c->iv, 19, c->key);
+        }
+
+        gostsettunables(&t);
+        for (i = 0; i < CONCURRENT_CALLERS; i++)
+                pthread_create(&callers[i].thread, NULL, concurrent_caller,
+                               &callers[i]);
+        for (i = 0; i < CONCURRENT_CALLERS; i++) {
+                pthread_join(callers[i].thread, NULL);
+                CHECK(same_words(callers[i].got, callers[i].expect,
+                                 CONCURRENT_BLOCKS * 2),
+                      "concurrent gostgamma caller %d", i);
+        }
+}
+
+/*
+ * Writers appending records of odd sizes to one shared stream from
+ * several threads.  Put back at their positions, the records must make
+ * exactly the serial gamma stream.
+ */
+#define SHARED_WRITERS 4
+#define SHARED_RECORDS 200
+#define SHARED_MAXREC 300
+#define SHARED_BYTES (SHARED_WRITERS * SHARED_RECORDS * SHARED_MAXREC)
+
+struct writer {
+        pthread_t thread;
+        struct gost_shared *sh;
+        unsigned char const *plain;     /* The whole stream's plaintext */
+        unsigned char *crypt;           /* Where the records go */
+        unsigned seed;
+};
+
+static void *shared_writer(void *arg)
+{
+        struct writer *w = arg;
+        unsigned char rec[SHARED_MAXREC];
+        unsigned seed = w->seed;
+        int i;
+
+        for (i = 0; i < SHARED_RECORDS; i++) {
+                unsigned long long pos;
+                size_t len;
+
+                seed = seed * 1103515245u + 12345u;
+                len = (seed >> 16) % SHARED_MAXREC + 1;
+                /* Reserve first to learn which plaintext this record is */
+                pos = gostsharedreserve(w->sh, len);
+                gostsharedcrypt(w->sh, w->plain + pos, rec, len, pos);
+                memcpy(w->crypt + pos, rec, len);
+        }
+        return NULL;
+}
+
+static void test_shared(void)
+{
+        static unsigned char plain[SHARED_BYTES], crypt[SHARED_BYTES],
+                             expect[SHARED_BYTES];
+        static struct writer writers[SHARED_WRITERS];
+        struct gost_stream s;
+        struct gost_shared *sh;
+        word32 key[8], iv[2];
+        unsigned long long len;
+        int i;
+
+        rand_words(key, 8);
+        rand_words(iv, 2);
+        for (i = 0; i < SHARED_BYTES; i++)
+                plain[i] = (unsigned char)rand32();
+
+        sh = gostsharednew(iv, key);
+        CHECK(sh != NULL, "gostsharednew");
+        if (!sh)
+                return;
+        for (i = 0; i < SHARED_WRITERS; i++) {
+                writers[i].sh = sh;
+                writers[i].plain = plain;
+                writers[i].crypt = crypt;
+                writers[i].seed = rand32();
+                pthread_create(&writers[i].thread, NULL, shared_writer, &writers[i]);
+        }
+        for (i = 0; i < SHARED_WRITERS; i++)
+                pthread_join(writers[i].thread, NULL);
+
+        len = gostsharedtell(sh);
+        goststreaminit(&s, GOST_MODE_GAMMA, 0, iv);
+        goststream(&s, plain, expect, (size_t)len, key);
+        CHECK(memcmp(crypt, expect, (size_t)len) == 0,
+              "shared stream of %llu bytes from %d writers", len, SHARED_WRITERS);
+
+        /* And one more record, through the one-call form */
+        CHECK(gostsharedwrite(sh, plain, crypt, 5) == len, "gostsharedwrite position");
+        gostsharedcrypt(sh, crypt, crypt, 5, len);
+        CHECK(memcmp(crypt, plain, 5) == 0, "gostsharedcrypt to decrypt");
+        gostsharedfree(sh);
+}
+
+/*
+ * A lazily decrypted view of an encrypted file, by userfaultfd and by
+ * signals: untouched, nothing is filled; a read fills its page and the
+ * read-ahead after it; a write faults rather than hangs; and readers in
+ * several threads at once all see the plaintext, each page filled
+ * exactly once.
+ */
+#define LAZY_PAGES 40
+#define LAZY_READAHEAD 4
+#define LAZY_READERS 4
+
+struct lazyreader {
+        pthread_t thread;
+        unsigned char const *view, *plain;
+        size_t len, start;
+        int same;
+};
+
+static void *lazy_reader(void *arg)
+{
+        struct lazyreader *r = arg;
+        size_t i, at;
+
+        r->same = 1;
+        for (i = 0; i < r->len; i++) {
+                at = (r->start + i) % r->len;
+                if (r->view[at] != r->plain[at])
+                        r->same = 0;
+        }
+        return NULL;
+}
+
+/* Whether a write to p, made in a child, kills it with SIGSEGV */
+static int write_faults(unsigned char const *p)
+{
+        struct rlimit none = { 0, 0 };
+        pid_t pid = fork();
+        int status;
+
+        if (pid == 0) {
+                setrlimit(RLIMIT_CORE, &none);
+                alarm(5);               /* A handler that loops dies of this */
+                *(unsigned char volatile *)p = 1;
+                _exit(0);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid)
+                return 0;
+        return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+static void test_lazymap(void)
+{
+        static struct lazyreader readers[LAZY_READERS];
+        char path[] = "gost_test_lazy.XXXXXX";
+        size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t const len = LAZY_PAGES * page - 1234, expect = LAZY_PAGES;
+        unsigned char *plain = malloc(len), *crypt = malloc(len);
+        unsigned char const *view;
+        struct gost_lazymap *m;
+        struct gost_stream s;
+        word32 key[8], iv[2];
+        size_t i, filled, errors;
+        int fd, flags, same;
+
+        fd = mkstemp(path);
+        if (fd < 0 || !plain || !crypt) {
+                perror("mkstemp");
+                failures++;
+                free(plain);
+                free(crypt);
+                return;
+        }
+        rand_words(key, 8);
+        rand_words(iv, 2);
+        for (i = 0; i < len; i++)
+                plain[i] = (unsigned char)rand32();
+        goststreaminit(&s, GOST_MODE_GAMMA, 0, iv);
+        goststream(&s, plain, crypt, len, key);
+        CHECK(write(fd, crypt, len) == (ssize_t)len, "writing %s", path);
+
+        for (flags = 0; flags <= GOST_LAZY_SIGNALS; flags += GOST_LAZY_SIGNALS) {
+                m = gostlazymap(fd, iv, key, LAZY_READAHEAD, flags);
+                CHECK(m != NULL, "gostlazymap flags %d", flags);
+                if (!m)
+                        continue;
+                view = gostlazyaddr(m);
+                CHECK(gostlazysize(m) == len, "gostlazysize");
+                gostlazystats(m, &filled, &errors);
+                CHECK(filled == 0, "gostlazymap filled %zu pages untouched", filled);
+
+                CHECK(view[10 * page + 7] == plain[10 * page + 7],
+                      "gostlazymap first read, flags %d", flags);
+                gostlazystats(m, &filled, &errors);
+                CHECK(filled == LAZY_READAHEAD,
+                      "gostlazymap filled %zu pages for one read", filled);
+                CHECK(view[len - 1] == plain[len - 1], "gostlazymap last byte");
+
+                /* The view is read-only, whether the page is in yet or not */
+                CHECK(write_faults(view + 10 * page),
+                      "gostlazymap write to a present page, flags %d", flags);
+                if (flags & GOST_LAZY_SIGNALS)
+                        CHECK(write_faults(view),
+                              "gostlazymap write to an absent page, flags %d", flags);
+
+                for (i = 0; i < LAZY_READERS; i++) {
+                        readers[i].view = view;
+                        readers[i].plain = plain;
+                        readers[i].len = len;
+                        readers[i].start = i * len / LAZY_READERS;
+                        pthread_create(&readers[i].thread, NULL, lazy_reader,
+                                       &readers[i]);
+                }
+                for (same = 1, i = 0; i < LAZY_READERS; i++) {
+                        pthread_join(readers[i].thread, NULL);
+                        same &= readers[i].same;
+                }
+                CHECK(same, "gostlazymap readers, flags %d", flags);
+                gostlazystats(m, &filled, &errors);
+                CHECK(filled == expect && errors == 0,
+                      "gostlazymap filled %zu of %zu pages, %zu errors",
+                      filled, expect, errors);
+                gostlazyunmap(m);
+        }
+        close(fd);
+        remove(path);
+        free(plain);
+        free(crypt);
+}
+
+/*
+ * The page cache over objects kept in memory: pages come back
+ * decrypted, repeats are hits that do not read again, pinned pages
+ * survive eviction, a full shard and a failed read are refused, and
+ * readers in several threads all see the right pages.
+ */
+#define CACHE_OBJECTS 3
+#define CACHE_PAGES 16
+#define CACHE_PAGESIZE 256
+#define CACHE_READERS 4
+
+struct cachestore {
+        unsigned char plain[CACHE_OBJECTS][CACHE_PAGES * CACHE_PAGESIZE];
+        unsigned char crypt[CACHE_OBJECTS][CACHE_PAGES * CACHE_PAGESIZE];
+        word32 iv[CACHE_OBJECTS][2];
+        pthread_mutex_t lock;
+        unsigned long reads;
+};
+
+static int cache_read(void *arg, unsigned long long object,
+                      unsigned long long page, unsigned char *buf, word32 iv[2])
+{
+        struct cachestore *st = arg;
+
+        pthread_mutex_lock(&st->lock);
+        st->reads++;
+        pthread_mutex_unlock(&st->lock);
+        if (object >= CACHE_OBJECTS)
+                return -1;
+        memcpy(buf, st->crypt[object] + page * CACHE_PAGESIZE, CACHE_PAGESIZE);
+        iv[0] = st->iv[object][0];
+        iv[1] = st->iv[object][1];
+        return 0;
+}
+
+struct cachereader {
+        pthread_t thread;
+        struct gost_cache *c;
+        struct cachestore *st;
+        unsigned seed;
+        int bad;
+};
+
+static void *cache_reader(void *arg)
+{
+        struct cachereader *r = arg;
+        unsigned char const *p;
+        unsigned seed = r->seed, o, pg;
+        int i;
+
+        for (i = 0; i < 2000; i++) {
+                seed = seed * 1103515245u + 12345u;
+                o = (seed >> 8) % CACHE_OBJECTS;
+                pg = (seed >> 16) % CACHE_PAGES;
+                p = gostcacheget(r->c, o, pg);
+                if (!p)
+                        continue;
+                if (memcmp(p, r->st->plain[o] + pg * CACHE_PAGESIZE, CACHE_PAGESIZE))
+                        r->bad++;
+                gostcacherelease(r->c, p);
+        }
+        return NULL;
+}
+
+static void test_cache(void)
+{
+        static struct cachestore st;
+        static struct cachereader readers[CACHE_READERS];
+        unsigned char const *p, *pinned[4];
+        struct gost_cachestats cs;
+        struct gost_stream s;
+        struct gost_cache *c;
+        word32 key[8];
+        unsigned long reads;
+        size_t i, o;
+        int bad;
+
+        rand_words(key, 8);
+        for (o = 0; o < CACHE_OBJECTS; o++) {
+                rand_words(st.iv[o], 2);
+                for (i = 0; i < sizeof(st.plain[o]); i++)
+                        st.plain[o][i] = (unsigned char)rand32();
+                goststreaminit(&s, GOST_MODE_GAMMA, 0, st.iv[o]);
+                goststream(&s, st.plain[o], st.crypt[o], sizeof(st.plain[o]), key);
+        }
+        pthread_mutex_init(&st.lock, NULL);
+
+        /* One shard of four frames, to make eviction and pins easy to see */
+        c = gostcachenew(CACHE_PAGESIZE, 4, 1, cache_read, &st, key);
+        CHECK(c != NULL, "gostcachenew");
+        if (!c)
+                return;
+        p = gostcacheget(c, 1, 5);
+        CHECK(p && memcmp(p, st.plain[1] + 5 * CACHE_PAGESIZE, CACHE_PAGESIZE) == 0,
+              "gostcacheget miss");
+        gostcacherelease(c, p);
+        reads = st.reads;
+        p = gostcacheget(c, 1, 5);
+        CHECK(p && st.reads == reads, "gostcacheget hit read again");
+        gostcacherelease(c, p);
+
+        pinned[0] = gostcacheget(c, 2, 0);
+        for (i = 0; i < 40; i++) {
+                p = gostcacheget(c, 0, i % CACHE_PAGES);
+                CHECK(p && memcmp(p, st.plain[0] + i % CACHE_PAGES * CACHE_PAGESIZE,
+                                  CACHE_PAGESIZE) == 0, "gostcacheget page %zu", i);
+                if (p)
+                        gostcacherelease(c, p);
+        }
+        CHECK(pinned[0] && memcmp(pinned[0], st.plain[2], CACHE_PAGESIZE) == 0,
+              "gostcacheget pinned page changed");
+        for (i = 1; i < 4; i++)
+                pinned[i] = gostcacheget(c, 2, i);
+        CHECK(gostcacheget(c, 2, 9) == NULL, "gostcacheget with every frame pinned");
+        for (i = 0; i < 4; i++)
+                if (pinned[i])
+                        gostcacherelease(c, pinned[i]);
+
+        reads = st.reads;
+        gostcacheinvalidate(c, 2, 1);
+        p = gostcacheget(c, 2, 1);
+        CHECK(p && st.reads == reads + 1, "gostcacheinvalidate did not reload");
+        if (p)
+                gostcacherelease(c, p);
+        CHECK(gostcacheget(c, CACHE_OBJECTS, 0) == NULL, "gostcacheget failed read");
+        gostcachestats(c, &cs);
+        CHECK(cs.hits + cs.misses == 48 && cs.failures == 1,
+              "gostcachestats %llu hits, %llu misses, %llu failures",
+              cs.hits, cs.misses, cs.failures);
+        gostcachefree(c);
+
+        c = gostcachenew(CACHE_PAGESIZE, 16, 4, cache_read, &st, key);
+        CHECK(c != NULL, "gostcachenew sharded");
+        if (!c)
+                return;
+        for (i = 0; i < CACHE_READERS; i++) {
+                readers[i].c = c;
+                readers[i].st = &st;
+                readers[i].seed = rand32();
+                readers[i].bad = 0;
+                pthread_create(&readers[i].thread, NULL, cache_reader, &readers[i]);
+        }
+        for (bad = 0, i = 0; i < CACHE_READERS; i++) {
+                pthread_join(readers[i].thread, NULL);
+                bad += readers[i].bad;
+        }
+        CHECK(bad == 0, "gostcacheget readers saw %d bad pages", bad);
+        gostcachefree(c);
+        pthread_mutex_destroy(&st.lock);
+}
+
+/*
+ * A session table against a gost_stream per session: random batches of
+ * requests of random sizes, some past the direct path and some of a
+ * few bytes, sessions repeated within a batch, with and without the
+ * MAC and in both directions, give what goststream() gives.
+ */
+#define SESSIONS 12
+#define SESSION_OPS 24
+#define SESSION_MAXOP 700
+
+static void test_sessions(void)
+{
+        static unsigned char in[SESSION_OPS][SESSION_MAXOP],
+                             got[SESSION_OPS][SESSION_MAXOP],
+                             want[SESSION_OPS][SESSION_MAXOP];
+        struct gost_stream ref[SESSIONS];
+        struct gost_sessionop ops[SESSION_OPS];
+        struct gost_sessions *t;
+        word32 key[SESSIONS][8], iv[SESSIONS][2];
+        unsigned char mac[8], wantmac[8];
+        size_t id[SESSIONS], i, j, round;
+        int flags;
+
+        for (flags = 0; flags <= (GOST_STREAM_MAC | GOST_STREAM_DECRYPT); flags++) {
+                t = gostsessionsnew(SESSIONS, flags);
+                CHECK(t != NULL, "gostsessionsnew flags %d", flags);
+                if (!t)
+                        return;
+                for (i = 0; i < SESSIONS; i++) {
+                        rand_words(key[i], 8);
+                        rand_words(iv[i], 2);
+                        id[i] = gostsessionopen(t, key[i], iv[i]);
+                        goststreaminit(&ref[i], GOST_MODE_GAMMA, flags, iv[i]);
+                }
+                CHECK(gostsessionopen(t, key[0], iv[0]) == (size_t)-1,
+                      "gostsessionopen on a full table");
+
+                for (round = 0; round < 6; round++) {
+                        for (i = 0; i < SESSION_OPS; i++) {
+                                size_t k = rand32() % SESSIONS;
+
+                                ops[i].id = id[k];
+                                ops[i].len = rand32() % 4 ? rand32() % 40 :
+                                             rand32() % SESSION_MAXOP;
+                                ops[i].in = in[i];
+                                ops[i].out = got[i];
+                                for (j = 0; j < ops[i].len; j++)
+                                        in[i][j] = (unsigned char)rand32();
+                                goststream(&ref[k], in[i], want[i], ops[i].len, key[k]);
+                        }
+                        gostsessionscrypt(t, ops, SESSION_OPS);
+                        for (i = 0; i < SESSION_OPS; i++)
+                                CHECK(memcmp(got[i], want[i], ops[i].len) == 0,
+                                      "gostsessionscrypt flags %d round %zu request %zu "
+                                      "(%zu bytes)", flags, round, i, ops[i].len);
+                }
+                for (i = 0; i < SESSIONS; i++) {
+                        CHECK(gostsessiontell(t, id[i]) == ref[i].pos,
+                              "gostsessiontell session %zu", i);
+                        if (!(flags & GOST_STREAM_MAC))
+                                continue;
+                        gostsessionmac(t, id[i], mac);
+                        goststreammac(&ref[i], wantmac, key[i]);
+                        CHECK(memcmp(mac, wantmac, 8) == 0,
+                              "gostsessionmac flags %d session %zu", flags, i);
+                }
+
+                /* A closed id comes back, at the start of a fresh stream */
+                CHECK(gostsessionclose(t, id[3]) == 0, "gostsessionclose");
+                CHECK(gostsessionclose(t, id[3]) == -1, "gostsessionclose twice");
+                CHECK(gostsessionclose(t, SESSIONS * 4) == -1 &&
+                      gostsessionclose(t, (size_t)-1) == -1,
+                      "gostsessionclose out of range");
+                CHECK(gostsessionopen(t, key[3], iv[3]) == id[3] &&
+                      gostsessiontell(t, id[3]) == 0, "gostsessionopen reuse");
+                gostsessionsfree(t);
+        }
+}
+
+/* Warming and flushing the tables must leave results alone */
+static void test_prewarm(void)
+{
+        word32 key[8], iv[2], in[16], expect[16], got[16];
+
+        rand_words(key, 8);
+        rand_words(iv, 2);
+        rand_words(in, 16);
+        gostgamma(in, expect, 8, iv, 0, key);
+
+        gostflushtables();
+        gostgamma(in, got, 8, iv, 0, key);
+        CHECK(same_words(got, expect, 16), "gostgamma after gostflushtables");
+
+        gostprewarm(key);
+        gostgamma(in, got, 8, iv, 0, key);
+        CHECK(same_words(got, expect, 16), "gostgamma after gostprewarm");
+}
+
+static void test_autotune(void)
+{
+        char path[] = "gost_test_tune.XXXXXX";
+        struct gost_choice before[GOST_NOPS], after;
+        int fd, op;
+
+        fd = mkstemp(path);
+        if (fd < 0) {
+                perror("mkstemp");
+                failures++;
+                return;
+        }
+        close(fd);
+
+        /* Nothing usable in an empty file, so this tunes and saves */
+        CHECK(gostautotune(path) == 1, "gostautotune did not tune");
+        for (op = 0; op < GOST_NOPS; op++) {
+                gostgetchoice(op, &before[op]);
+                gostsetchoice(op, &choices[0]);
+        }
+
+        CHECK(gostautotune(path) == 0, "gostautotune ignored its cache");
+        for (op = 0; op < GOST_NOPS; op++) {
+                gostgetchoice(op, &after);
+                CHECK(after.width == before[op].width &&
+                      after.tier == before[op].tier &&
+                      after.chunk == before[op].chunk,
+                      "cached choice for %s differs", gostopname(op));
+        }
+        remove(path);
+}
+
+static void test_differential(unsigned long iterations)
+{
+        static struct buffers b;
+        word32 key[8];
+        unsigned long it;
+        int s;
+
+        for (s = 0; s < 2; s++) {
+                gostsboxinit(s ? gost_sbox_tc26_z : gost_sbox_des);
+                for (it = 0; it < iterations; it++) {
+                        size_t len = (size_t)rand32() % (MAX_BLOCKS + 1);
+                        size_t off = (size_t)rand32() % MAX_OFFSET;
+
+                        rand_words(key, 8);
+                        rand_words(b.plain, sizeof(b.plain) / sizeof(word32));
+
+                        test_ecb(&b, key, len, off);
+                        test_ofb(&b, key, len, off);
+                        test_cfb(&b, key, len, off);
+                        test_mac(&b, key, len, off);
+                        test_small(key);
+                        test_stream(key);
+                        test_gammav(key);
+                        test_bulk(&b, key, len, off);
+                        test_3413(&b, key, len, off);
+                        if (failures)
+                                return;
+                }
+                test_gamma_seek(key);
+                test_recrypt();
+                test_object();
+                test_cmac();
+                test_sessions();
+        }
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long iterations = 2000;
+        unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+        if (argc >= 2)
+                iterations = strtoul(argv[1], NULL, 0);
+        if (argc >= 3)
+                seed = strtoull(argv[2], NULL, 0);
+        rng_state = seed ? seed : 1;
+
+        test_kat();
+        test_differential(iterations);
+        kboxinit();
+        test_concurrent();
+        test_shared();
+        test_lazymap();
+        test_cache();
+        test_prewarm();
+        test_autotune();
+        gostpoolstop();
+
+        if (failures) {
+                fprintf(stderr, "%d check(s) failed (seed 0x%llx)\n",
+                        failures, seed);
+                return EXIT_FAILURE;
+        }
+        printf("All tests passed (%lu iterations, seed 0x%llx).\n",
+               iterations, seed);
+        return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * Startup autotuning of the kernel dispatch.
+ *
+ * The best width, table tier and batch size differ between
+ * microarchitectures, so rather than guess we time every candidate
+ * once per host and remember the winners.  The cache file is plain
+ * text, one line per operation, under a header naming the library
+ * version and CPU it was measured on:
+ *
+ *      gost-autotune 1.2 GenuineIntel-000906ea
+ *      ecb 4 word 0
+ *      gamma 4 word 64
+ *      cfbdec 2 byte 128
+ *      plan 2 16384 4096
+ *
+ * The plan line holds the planner's scalarmax, threadmin and grain.
+ * A cache for another CPU or version is ignored and overwritten.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#include "gost.h"
+#include "probe.h"
+
+#define TUNE_BLOCKS 4096        /* 32 KiB: resident in L1/L2 on anything current */
+#define TUNE_REPEATS 5          /* Best-of, to shrug off interrupts */
+
+static char const *const tiernames[GOST_NTIERS] = {
+        "word", "byte", "simd", "hybrid"
+};
+static int const widths[] = { 1, 2, 4, 8 };
+static int const chunks[] = { 16, 64, 256 };
+
+/* A short, stable description of the CPU model we are running on */
+static void
+cpusignature(char *buf, size_t size)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        unsigned int eax, ebx, ecx, edx;
+        char vendor[13];
+
+        if (__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+                memcpy(vendor, &ebx, 4);
+                memcpy(vendor + 4, &edx, 4);
+                memcpy(vendor + 8, &ecx, 4);
+                vendor[12] = '\0';
+                if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                        snprintf(buf, size, "%s-%08x", vendor, eax);
+                        return;
+                }
+        }
+#endif
+        snprintf(buf, size, "generic");
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Seconds for the fastest of TUNE_REPEATS runs of op under the current choice */
+static double
+timeop(int op, word32 *buf, word32 const key[8])
+{
+        word32 iv[2] = { 0, 0 };
+        double best = 1e9, t;
+        int r;
+
+        for (r = 0; r < TUNE_REPEATS; r++) {
+                t = now();
+                switch (op) {
+                case GOST_OP_ECB:
+                        gostecb(buf, buf, TUNE_BLOCKS, key);
+                        break;
+                case GOST_OP_GAMMA:
+                        gostgamma(buf, buf, TUNE_BLOCKS, iv, 0, key);
+                        break;
+                case GOST_OP_CFBDEC:
+                        gostcfbdec(buf, buf, TUNE_BLOCKS, iv, key);
+                        break;
+                }
+                t = now() - t;
+                if (t < best)
+                        best = t;
+        }
+        return best;
+}
+
+static void
+nothing(void *arg, size_t part)
+{
+        (void)arg;
+        (void)part;
+}
+
+static void
+tune(void)
+{
+        static word32 buf[TUNE_BLOCKS * 2];
+        word32 key[8];
+        struct gost_choice c, best;
+        struct gost_tunables saved, serial;
+        double t, besttime;
+        size_t w, k, n, nchunks;
+        int op, tier;
+
+        /* Kernels are compared on one thread, and never the scalar path */
+        gostgettunables(&saved);
+        serial = saved;
+        serial.scalarmax = 0;
+        serial.threadmin = (size_t)-1;
+        gostsettunables(&serial);
+
+        for (k = 0; k < 8; k++)
+                key[k] = (word32)(0x9e3779b9UL * (k + 1));
+        for (k = 0; k < TUNE_BLOCKS * 2; k++)
+                buf[k] = (word32)(k * 0x01000193UL);
+
+        for (op = 0; op < GOST_NOPS; op++) {
+                gostgetchoice(op, &best);
+                besttime = 1e9;
+                nchunks = op == GOST_OP_ECB ? 1 : sizeof(chunks) / sizeof(chunks[0]);
+
+                for (tier = 0; tier < GOST_NTIERS; tier++)
+                        for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+                                for (n = 0; n < nchunks; n++) {
+                                        c.width = widths[w];
+                                        c.tier = tier;
+                                        c.chunk = op == GOST_OP_ECB ? 0 : chunks[n];
+                                        /* Widths a tier lacks, and SIMD the CPU lacks */
+                                        if ((tier == GOST_TIER_SIMD ||
+                                             tier == GOST_TIER_HYBRID) && !gostsimd())
+                                                continue;
+                                        if (gostsetchoice(op, &c) != 0)
+                                                continue;
+                                        t = timeop(op, buf, key);
+                                        if (t < besttime) {
+                                                besttime = t;
+                                                best = c;
+                                        }
+                                }
+                gostsetchoice(op, &best);
+        }
+        gostsettunables(&saved);
+}
+
+/*
+ * Calibrate the planner.  scalarmax is the largest size at which the
+ * one-block path still beats the batched one.  Splitting a call pays
+ * for a trip through the pool, so grain is the work that costs a few
+ * such trips, and threadmin the size from which the parallel time
+ * plus that overhead comes in clearly under the serial time.
+ */
+static void
+calibrate(void)
+{
+        static word32 buf[TUNE_BLOCKS * 2];
+        static size_t const small[] = { 1, 2, 4, 8, 16, 32 };
+        struct gost_tunables t, scalar, batched;
+        word32 key[8] = { 0 }, iv[2] = { 0, 0 };
+        double ts, tb, tblock, tfork;
+        size_t i, n, threads;
+        int r;
+
+        gostgettunables(&t);
+        scalar = batched = t;
+        scalar.threadmin = batched.threadmin = (size_t)-1;
+        batched.scalarmax = 0;
+
+        t.scalarmax = 0;
+        for (i = 0; i < sizeof(small) / sizeof(small[0]); i++) {
+                n = small[i];
+                scalar.scalarmax = n;
+                ts = tb = 1e9;
+                for (r = 0; r < TUNE_REPEATS; r++) {
+                        double t0;
+                        int k;
+
+                        gostsettunables(&scalar);
+                        t0 = now();
+                        for (k = 0; k < 64; k++)
+                                gostgamma(buf, buf, n, iv, 0, key);
+                        t0 = now() - t0;
+                        if (t0 < ts)
+                                ts = t0;
+
+                        gostsettunables(&batched);
+                        t0 = now();
+                        for (k = 0; k < 64; k++)
+                                gostgamma(buf, buf, n, iv, 0, key);
+                        t0 = now() - t0;
+                        if (t0 < tb)
+                                tb = t0;
+                }
+                if (ts <= tb)
+                        t.scalarmax = n;
+        }
+
+        gostsettunables(&batched);
+        tblock = timeop(GOST_OP_GAMMA, buf, key) / TUNE_BLOCKS;
+
+        threads = (size_t)gostpoolthreads();
+        if (threads < 2 || tblock <= 0) {
+                t.threadmin = (size_t)-1;
+                gostsettunables(&t);
+                return;
+        }
+
+        /* A round trip through the pool with nothing to do */
+        tfork = 1e9;
+        for (r = 0; r < TUNE_REPEATS; r++) {
+                double t0 = now();
+
+                gostparallel(nothing, NULL, threads);
+                t0 = now() - t0;
+                if (t0 < tfork)
+                        tfork = t0;
+        }
+
+        t.grain = (size_t)(4 * tfork / tblock) + 1;
+        if (t.grain < 64)
+                t.grain = 64;
+        /* Serial n*tblock against n*tblock/threads + tfork, with margin */
+        t.threadmin = (size_t)(2 * tfork / (tblock * (1 - 1.0 / threads))) + 1;
+        if (t.threadmin < 2 * t.grain)
+                t.threadmin = 2 * t.grain;
+        gostsettunables(&t);
+}
+
+/* Apply the choices in a cache file; 0 if it matched this host entirely */
+static int
+loadcache(FILE *fp, char const *sig)
+{
+        struct gost_choice c[GOST_NOPS], old[GOST_NOPS];
+        struct gost_tunables t;
+        char version[32], cpu[64], name[16], tiername[16];
+        int seen = 0, op, tier;
+
+        if (fscanf(fp, "gost-autotune %31s %63s", version, cpu) != 2 ||
+            strcmp(version, GOST_VERSION) != 0 || strcmp(cpu, sig) != 0)
+                return -1;
+
+        for (op = 0; op < GOST_NOPS; op++)
+                gostgetchoice(op, &c[op]);
+
+        gostgettunables(&t);
+
+        while (fscanf(fp, "%15s", name) == 1) {
+                struct gost_choice ch;
+
+                if (strcmp(name, "plan") == 0) {
+                        if (fscanf(fp, "%zu %zu %zu", &t.scalarmax,
+                                   &t.threadmin, &t.grain) != 3)
+                                return -1;
+                        seen |= 1 << GOST_NOPS;
+                        continue;
+                }
+                if (fscanf(fp, "%d %15s %d", &ch.width, tiername, &ch.chunk) != 3)
+                        return -1;
+                for (tier = 0; tier < GOST_NTIERS; tier++)
+                        if (strcmp(tiername, tiernames[tier]) == 0)
+                                break;
+                ch.tier = tier;
+                for (op = 0; op < GOST_NOPS; op++)
+                        if (strcmp(name, gostopname(op)) == 0)
+                                break;
+                if (op == GOST_NOPS)
+                        continue;       /* An operation we no longer have */
+                c[op] = ch;
+                seen |= 1 << op;
+        }
+        if (seen != (1 << (GOST_NOPS + 1)) - 1)
+                return -1;
+
+        /* All or nothing: put the old choices back if any is invalid */
+        for (op = 0; op < GOST_NOPS; op++)
+                gostgetchoice(op, &old[op]);
+        for (op = 0; op < GOST_NOPS; op++)
+                if (gostsetchoice(op, &c[op]) != 0) {
+                        for (op = 0; op < GOST_NOPS; op++)
+                                gostsetchoice(op, &old[op]);
+                        return -1;
+                }
+        return gostsettunables(&t);
+}
+
+static int
+savecache(char const *path, char const *sig)
+{
+        struct gost_choice c;
+        struct gost_tunables t;
+        FILE *fp;
+        int op;
+
+        fp = fopen(path, "w");
+        if (!fp)
+                return -1;
+        fprintf(fp, "gost-autotune %s %s\n", GOST_VERSION, sig);
+        for (op = 0; op < GOST_NOPS; op++) {
+                gostgetchoice(op, &c);
+                fprintf(fp, "%s %d %s %d\n", gostopname(op), c.width,
+                        tiernames[c.tier], c.chunk);
+        }
+        gostgettunables(&t);
+        fprintf(fp, "plan %zu %zu %zu\n", t.scalarmax, t.threadmin, t.grain);
+        return fclose(fp) == 0 ? 0 : -1;
+}
+
+int
+gostautotune(char const *cachepath)
+{
+        char sig[64];
+        FILE *fp;
+
+        cpusignature(sig, sizeof(sig));
+
+        if (cachepath && (fp = fopen(cachepath, "r")) != NULL) {
+                int r = loadcache(fp, sig);
+
+                fclose(fp);
+                if (r == 0) {
+                        GOST_PROBE1(autotune, 0);
+                        return 0;
+                }
+        }
+
+        tune();
+        calibrate();
+
+        if (cachepath && savecache(cachepath, sig) != 0) {
+                GOST_PROBE1(autotune, -1);
+                return -1;
+        }
+        GOST_PROBE1(autotune, 1);
+        return 1;
+}